@@ -0,0 +1,83 @@
+// Compares mapnik's closed-form spherical mercator conversion, used by the
+// vector tile code, with the proj4 path that mapnik::proj_transform goes through.
+//
+// build: g++ -O3 bench/mercator_bench.cpp -o mercator_bench $(mapnik-config --cflags --libs) -lproj
+// run:   ./mercator_bench [number of coordinates]
+
+#include <mapnik/well_known_srs.hpp>
+
+#include <proj_api.h>
+
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+int main(int argc, char ** argv)
+{
+    std::size_t n = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 1000000;
+    std::vector<double> lon(n);
+    std::vector<double> lat(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        lon[i] = -180.0 + 360.0 * (static_cast<double>(i) / n);
+        lat[i] = -85.0 + 170.0 * (static_cast<double>((i * 7919) % n) / n);
+    }
+
+    // proj4
+    projPJ wgs84 = pj_init_plus("+init=epsg:4326");
+    projPJ merc = pj_init_plus("+init=epsg:3857");
+    if (!wgs84 || !merc)
+    {
+        std::fprintf(stderr, "could not initialize proj4 projections\n");
+        return 1;
+    }
+    std::vector<double> px(lon);
+    std::vector<double> py(lat);
+    double start = now();
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        px[i] *= DEG_TO_RAD;
+        py[i] *= DEG_TO_RAD;
+    }
+    pj_transform(wgs84, merc, n, 1, &px[0], &py[0], NULL);
+    double proj_elapsed = now() - start;
+
+    // closed form
+    std::vector<double> mx(lon);
+    std::vector<double> my(lat);
+    start = now();
+    mapnik::lonlat2merc(&mx[0], &my[0], static_cast<int>(n));
+    double merc_elapsed = now() - start;
+
+    double max_diff = 0;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        max_diff = std::max(max_diff, std::fabs(px[i] - mx[i]));
+        max_diff = std::max(max_diff, std::fabs(py[i] - my[i]));
+    }
+
+    // and back
+    start = now();
+    mapnik::merc2lonlat(&mx[0], &my[0], static_cast<int>(n));
+    double inverse_elapsed = now() - start;
+
+    std::printf("%lu coordinates\n", static_cast<unsigned long>(n));
+    std::printf("proj4 forward:       %8.2f ms\n", proj_elapsed);
+    std::printf("lonlat2merc:         %8.2f ms (%.1fx)\n", merc_elapsed, proj_elapsed / merc_elapsed);
+    std::printf("merc2lonlat:         %8.2f ms\n", inverse_elapsed);
+    std::printf("max difference:      %g meters\n", max_diff);
+
+    pj_free(wgs84);
+    pj_free(merc);
+    return 0;
+}
@@ -59,6 +59,10 @@
       'sources': [
           "src/node_mapnik.cpp",
           "src/mapnik_map.cpp",
+          "src/mapnik_map_pool.cpp",
+          "src/mapnik_cancel_signal.cpp",
+          "src/mapnik_tile_cache.cpp",
+          "src/render_stats.cpp",
           "src/mapnik_color.cpp",
           "src/mapnik_geometry.cpp",
           "src/mapnik_feature.cpp",
@@ -75,6 +79,9 @@
           "src/mapnik_expression.cpp",
           "src/mapnik_cairo_surface.cpp",
           "src/mapnik_vector_tile.cpp",
+          "src/metatile.cpp",
+          "src/worker_pool.cpp",
+          "src/job_metrics.cpp",
           "<(SHARED_INTERMEDIATE_DIR)/vector_tile.pb.cc"
       ],
       'include_dirs': [
@@ -126,7 +133,8 @@
                 '<!@(mapnik-config --libs)',
                 '<!@(mapnik-config --ldflags)',
                 '<!@(pkg-config protobuf --libs-only-L)',
-                '-lprotobuf-lite'
+                '-lprotobuf-lite',
+                '-lz'
             ],
             'conditions': [
               ['runtime_link == "static"', {
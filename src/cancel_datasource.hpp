@@ -0,0 +1,88 @@
+#ifndef __NODE_MAPNIK_CANCEL_DATASOURCE_H__
+#define __NODE_MAPNIK_CANCEL_DATASOURCE_H__
+
+#include "forwarding_datasource.hpp"
+#include "mapnik_cancel_signal.hpp"
+
+// mapnik
+#include <mapnik/feature.hpp>
+#include <mapnik/featureset.hpp>
+#include <mapnik/layer.hpp>
+#include <mapnik/query.hpp>
+#include "mapnik3x_compatibility.hpp"
+
+// boost
+#include MAPNIK_SHARED_INCLUDE
+#include MAPNIK_MAKE_SHARED_INCLUDE
+
+// stl
+#include <vector>
+
+namespace node_mapnik {
+
+// checks a job's cancel token while the renderer reads features, so a
+// render of one large layer can stop part way through it
+class cancel_featureset : public mapnik::Featureset
+{
+public:
+    cancel_featureset(mapnik::featureset_ptr const& fs, cancel_token const& cancel)
+        : fs_(fs),
+          cancel_(cancel),
+          count_(0) {}
+
+    mapnik::feature_ptr next()
+    {
+        // a timeout reads the clock, so not for every feature
+        if ((++count_ & 0xff) == 0)
+        {
+            cancel_.check();
+        }
+        return fs_->next();
+    }
+
+private:
+    mapnik::featureset_ptr fs_;
+    cancel_token cancel_;
+    unsigned count_;
+};
+
+class cancel_datasource : public forwarding_datasource
+{
+public:
+    cancel_datasource(MAPNIK_SHARED_PTR<mapnik::datasource> const& ds,
+                      cancel_token const& cancel)
+        : forwarding_datasource(ds),
+          cancel_(cancel) {}
+
+    mapnik::featureset_ptr features(mapnik::query const& q) const
+    {
+        cancel_.check();
+        mapnik::featureset_ptr fs = ds_->features(q);
+        if (!fs)
+        {
+            return fs;
+        }
+        return MAPNIK_MAKE_SHARED<cancel_featureset>(fs, cancel_);
+    }
+
+private:
+    cancel_token cancel_;
+};
+
+// points the datasource of every layer at a cancel_datasource
+inline void cancel_layers(std::vector<mapnik::layer> & layers,
+                          cancel_token const& cancel)
+{
+    for (std::size_t i = 0; i < layers.size(); ++i)
+    {
+        if (layers[i].datasource())
+        {
+            layers[i].set_datasource(MAPNIK_MAKE_SHARED<cancel_datasource>(layers[i].datasource(),
+                                                                           cancel));
+        }
+    }
+}
+
+}
+
+#endif // __NODE_MAPNIK_CANCEL_DATASOURCE_H__
@@ -0,0 +1,131 @@
+#ifndef __NODE_MAPNIK_COMPRESSION_H__
+#define __NODE_MAPNIK_COMPRESSION_H__
+
+// zlib
+#include <zlib.h>
+
+// stl
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <cstddef>
+
+namespace node_mapnik {
+
+// gzip and zlib (deflate) helpers for vector tile data. A vector tile
+// message starts with the layers tag (0x1a) so compressed input can be
+// told apart by its first two bytes.
+
+inline bool is_gzip_compressed(const char * data, std::size_t size)
+{
+    return size > 2 &&
+           static_cast<unsigned char>(data[0]) == 0x1F &&
+           static_cast<unsigned char>(data[1]) == 0x8B;
+}
+
+inline bool is_zlib_compressed(const char * data, std::size_t size)
+{
+    return size > 2 &&
+           static_cast<unsigned char>(data[0]) == 0x78 &&
+           ((static_cast<unsigned char>(data[0]) << 8) + static_cast<unsigned char>(data[1])) % 31 == 0;
+}
+
+inline bool is_compressed(const char * data, std::size_t size)
+{
+    return is_gzip_compressed(data, size) || is_zlib_compressed(data, size);
+}
+
+// inflating more than this is refused, so a small crafted input cannot
+// exhaust memory. Real tiles are far smaller.
+static const std::size_t MAX_INFLATED_SIZE = 64 * 1024 * 1024;
+
+// inflates gzip or zlib input into output, throwing past max_size bytes
+inline void decompress(const char * data, std::size_t size, std::string & output,
+                       std::size_t max_size = MAX_INFLATED_SIZE)
+{
+    z_stream inflate_s;
+    inflate_s.zalloc = Z_NULL;
+    inflate_s.zfree = Z_NULL;
+    inflate_s.opaque = Z_NULL;
+    inflate_s.avail_in = 0;
+    inflate_s.next_in = Z_NULL;
+    // 32 enables automatic detection of the gzip or zlib header
+    if (inflateInit2(&inflate_s, 32 + 15) != Z_OK)
+    {
+        throw std::runtime_error("could not initialize zlib for decompression");
+    }
+    inflate_s.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    inflate_s.avail_in = static_cast<uInt>(size);
+    output.clear();
+    std::size_t length = 0;
+    int ret = Z_OK;
+    do
+    {
+        // compressed tiles typically expand by 2-4x. One byte more than
+        // max_size is enough to tell that the input is too large.
+        std::size_t increase = size * 2 + 1024;
+        if (increase > max_size + 1 - length)
+        {
+            increase = max_size + 1 - length;
+        }
+        output.resize(length + increase);
+        inflate_s.next_out = reinterpret_cast<Bytef *>(&output[0] + length);
+        inflate_s.avail_out = static_cast<uInt>(increase);
+        ret = inflate(&inflate_s, Z_FINISH);
+        if (ret != Z_STREAM_END && ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            std::string msg(inflate_s.msg ? inflate_s.msg : "could not decompress data");
+            inflateEnd(&inflate_s);
+            throw std::runtime_error(msg);
+        }
+        length += (increase - inflate_s.avail_out);
+        if (length > max_size)
+        {
+            inflateEnd(&inflate_s);
+            std::ostringstream msg;
+            msg << "could not decompress data: inflated size exceeds " << max_size << " bytes";
+            throw std::runtime_error(msg.str());
+        }
+    }
+    // stop on truncated input: nothing left to read and room left to write
+    while (ret != Z_STREAM_END && (inflate_s.avail_in > 0 || inflate_s.avail_out == 0));
+    inflateEnd(&inflate_s);
+    if (ret != Z_STREAM_END)
+    {
+        throw std::runtime_error("could not decompress data: truncated input");
+    }
+    output.resize(length);
+}
+
+// deflates input into output as gzip (gzip == true) or zlib data
+inline void compress(const char * data, std::size_t size, std::string & output,
+                     bool gzip = true, int level = Z_DEFAULT_COMPRESSION)
+{
+    z_stream deflate_s;
+    deflate_s.zalloc = Z_NULL;
+    deflate_s.zfree = Z_NULL;
+    deflate_s.opaque = Z_NULL;
+    // 16 selects a gzip header instead of a zlib header
+    if (deflateInit2(&deflate_s, level, Z_DEFLATED, gzip ? 16 + 15 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        throw std::runtime_error("could not initialize zlib for compression");
+    }
+    deflate_s.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    deflate_s.avail_in = static_cast<uInt>(size);
+    std::size_t bound = deflateBound(&deflate_s, static_cast<uLong>(size));
+    output.resize(bound);
+    deflate_s.next_out = reinterpret_cast<Bytef *>(&output[0]);
+    deflate_s.avail_out = static_cast<uInt>(bound);
+    int ret = deflate(&deflate_s, Z_FINISH);
+    std::size_t length = bound - deflate_s.avail_out;
+    deflateEnd(&deflate_s);
+    if (ret != Z_STREAM_END)
+    {
+        throw std::runtime_error("could not compress data");
+    }
+    output.resize(length);
+}
+
+}
+
+#endif // __NODE_MAPNIK_COMPRESSION_H__
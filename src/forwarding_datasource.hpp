@@ -0,0 +1,60 @@
+#ifndef __NODE_MAPNIK_FORWARDING_DATASOURCE_H__
+#define __NODE_MAPNIK_FORWARDING_DATASOURCE_H__
+
+// mapnik
+#include <mapnik/datasource.hpp>
+#include <mapnik/featureset.hpp>
+#include <mapnik/query.hpp>
+#include "mapnik3x_compatibility.hpp"
+
+// boost
+#include MAPNIK_SHARED_INCLUDE
+
+namespace node_mapnik {
+
+// wraps a layer's datasource and passes every call on to it. Wrappers that
+// only change what a render reads override features().
+class forwarding_datasource : public mapnik::datasource
+{
+public:
+    explicit forwarding_datasource(MAPNIK_SHARED_PTR<mapnik::datasource> const& ds)
+        : mapnik::datasource(ds->params()),
+          ds_(ds) {}
+
+    datasource_t type() const
+    {
+        return ds_->type();
+    }
+
+    mapnik::featureset_ptr features(mapnik::query const& q) const
+    {
+        return ds_->features(q);
+    }
+
+    mapnik::featureset_ptr features_at_point(mapnik::coord2d const& pt, double tol = 0) const
+    {
+        return ds_->features_at_point(pt, tol);
+    }
+
+    mapnik::box2d<double> envelope() const
+    {
+        return ds_->envelope();
+    }
+
+    boost::optional<geometry_t> get_geometry_type() const
+    {
+        return ds_->get_geometry_type();
+    }
+
+    mapnik::layer_descriptor get_descriptor() const
+    {
+        return ds_->get_descriptor();
+    }
+
+protected:
+    MAPNIK_SHARED_PTR<mapnik::datasource> ds_;
+};
+
+}
+
+#endif // __NODE_MAPNIK_FORWARDING_DATASOURCE_H__
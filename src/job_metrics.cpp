@@ -0,0 +1,134 @@
+#include "job_metrics.hpp"
+#include "worker_pool.hpp"
+
+// stl
+#include <map>
+#include <sstream>
+
+namespace node_mapnik {
+
+// upper bounds of the histogram buckets in milliseconds; the last bucket
+// (+Inf) holds the rest
+static const double BUCKET_BOUNDS[] = { 1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000 };
+static const std::size_t BUCKET_COUNT = sizeof(BUCKET_BOUNDS) / sizeof(BUCKET_BOUNDS[0]);
+
+struct latency_histogram
+{
+    uint64_t count;
+    double sum;
+    uint64_t buckets[BUCKET_COUNT + 1]; // not cumulative
+    latency_histogram() :
+        count(0),
+        sum(0)
+    {
+        for (std::size_t i = 0; i <= BUCKET_COUNT; ++i) buckets[i] = 0;
+    }
+
+    void add(uint64_t ns)
+    {
+        double ms = static_cast<double>(ns) / 1e6;
+        std::size_t i = 0;
+        while (i < BUCKET_COUNT && ms > BUCKET_BOUNDS[i]) ++i;
+        ++buckets[i];
+        ++count;
+        sum += ms;
+    }
+};
+
+struct operation_metrics
+{
+    uint64_t count;    // after callbacks run
+    uint64_t errors;   // ... that called back with an error
+    uint64_t inflight; // queued or running
+    latency_histogram queue_wait;
+    latency_histogram execution;
+    operation_metrics() :
+        count(0),
+        errors(0),
+        inflight(0),
+        queue_wait(),
+        execution() {}
+};
+
+// main thread only
+static std::map<std::string, operation_metrics> metrics;
+
+void job_queued(std::string const& op)
+{
+    ++metrics[op].inflight;
+}
+
+void job_completed(std::string const& op,
+                   uint64_t queued_at,
+                   uint64_t started_at,
+                   uint64_t finished_at,
+                   bool failed)
+{
+    operation_metrics & m = metrics[op];
+    if (m.inflight > 0) --m.inflight;
+    ++m.count;
+    if (failed) ++m.errors;
+    m.queue_wait.add(started_at - queued_at);
+    m.execution.add(finished_at - started_at);
+}
+
+Local<Value> job_error(std::string const& message, std::string const& code)
+{
+    HandleScope scope;
+    job_failed();
+    Local<Value> err = Exception::Error(String::New(message.c_str()));
+    if (!code.empty())
+    {
+        err->ToObject()->Set(String::NewSymbol("code"), String::New(code.c_str()));
+    }
+    return scope.Close(err);
+}
+
+std::string encode_operation(std::string const& format)
+{
+    return "encode-" + format.substr(0, format.find(':'));
+}
+
+static Local<Object> histogram_object(latency_histogram const& h)
+{
+    HandleScope scope;
+    Local<Object> obj = Object::New();
+    obj->Set(String::NewSymbol("count"), Number::New(static_cast<double>(h.count)));
+    obj->Set(String::NewSymbol("sum"), Number::New(h.sum));
+    Local<Object> buckets = Object::New();
+    uint64_t cumulative = 0;
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i)
+    {
+        cumulative += h.buckets[i];
+        std::ostringstream le;
+        le << BUCKET_BOUNDS[i];
+        buckets->Set(String::New(le.str().c_str()), Number::New(static_cast<double>(cumulative)));
+    }
+    cumulative += h.buckets[BUCKET_COUNT];
+    buckets->Set(String::New("+Inf"), Number::New(static_cast<double>(cumulative)));
+    obj->Set(String::NewSymbol("buckets"), buckets);
+    return scope.Close(obj);
+}
+
+Local<Object> job_metrics_object()
+{
+    HandleScope scope;
+    Local<Object> operations = Object::New();
+    std::map<std::string, operation_metrics>::const_iterator itr = metrics.begin();
+    for (; itr != metrics.end(); ++itr)
+    {
+        operation_metrics const& m = itr->second;
+        Local<Object> op = Object::New();
+        op->Set(String::NewSymbol("count"), Number::New(static_cast<double>(m.count)));
+        op->Set(String::NewSymbol("errors"), Number::New(static_cast<double>(m.errors)));
+        op->Set(String::NewSymbol("inflight"), Number::New(static_cast<double>(m.inflight)));
+        op->Set(String::NewSymbol("queueWait"), histogram_object(m.queue_wait));
+        op->Set(String::NewSymbol("execution"), histogram_object(m.execution));
+        operations->Set(String::New(itr->first.c_str()), op);
+    }
+    Local<Object> obj = Object::New();
+    obj->Set(String::NewSymbol("operations"), operations);
+    return scope.Close(obj);
+}
+
+}
@@ -0,0 +1,44 @@
+#ifndef __NODE_MAPNIK_JOB_METRICS_H__
+#define __NODE_MAPNIK_JOB_METRICS_H__
+
+#include <v8.h>
+#include <uv.h>
+
+// stl
+#include <string>
+
+using namespace v8;
+
+namespace node_mapnik {
+
+// Counters and latency histograms per operation ('render-image',
+// 'encode-png', 'vtile-parse', ...) for jobs run on the worker pool.
+// Workers only stamp times on their own job; the pool records a job on the
+// main thread when it hands it back, so nothing here needs a lock.
+
+// a job was queued; main thread only
+void job_queued(std::string const& op);
+
+// a job's after callback has run; main thread only. Times are uv_hrtime()
+// nanoseconds.
+void job_completed(std::string const& op,
+                   uint64_t queued_at,
+                   uint64_t started_at,
+                   uint64_t finished_at,
+                   bool failed);
+
+// an Error for a failed job, with err.code set when code is not empty.
+// Counts the job as failed when called from its after callback.
+Local<Value> job_error(std::string const& message, std::string const& code = std::string());
+
+// the operation name for encoding to format, e.g. 'encode-png' for 'png8:m=h'
+std::string encode_operation(std::string const& format);
+
+// {operations: {op: {count, errors, inflight, queueWait, execution}}}, with
+// queueWait and execution as {count, sum, buckets: {le: count}} histograms
+// in milliseconds. Buckets are cumulative and end with '+Inf'.
+Local<Object> job_metrics_object();
+
+}
+
+#endif // __NODE_MAPNIK_JOB_METRICS_H__
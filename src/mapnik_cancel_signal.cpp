@@ -0,0 +1,99 @@
+#include "mapnik_cancel_signal.hpp"
+#include "utils.hpp"
+
+// node
+#include <node.h>
+
+// boost
+#include MAPNIK_MAKE_SHARED_INCLUDE
+
+namespace node_mapnik {
+
+bool parse_cancel_options(Local<Object> const& options,
+                          cancel_token & token,
+                          std::string & error_name)
+{
+    if (options->Has(String::New("signal")))
+    {
+        Local<Value> signal_opt = options->Get(String::New("signal"));
+        if (!signal_opt->IsObject())
+        {
+            error_name = "'signal' must be a mapnik.CancelSignal";
+            return false;
+        }
+        Local<Object> obj = signal_opt->ToObject();
+        if (obj->IsNull() || obj->IsUndefined() || !CancelSignal::constructor->HasInstance(obj))
+        {
+            error_name = "'signal' must be a mapnik.CancelSignal";
+            return false;
+        }
+        token.state_ = node::ObjectWrap::Unwrap<CancelSignal>(obj)->get();
+    }
+    if (options->Has(String::New("timeout")))
+    {
+        Local<Value> timeout_opt = options->Get(String::New("timeout"));
+        if (!timeout_opt->IsNumber() || timeout_opt->NumberValue() <= 0)
+        {
+            error_name = "'timeout' must be a positive number of milliseconds";
+            return false;
+        }
+        token.deadline_ = uv_hrtime() + static_cast<uint64_t>(timeout_opt->NumberValue() * 1e6);
+    }
+    return true;
+}
+
+}
+
+Persistent<FunctionTemplate> CancelSignal::constructor;
+
+void CancelSignal::Initialize(Handle<Object> target) {
+
+    HandleScope scope;
+
+    constructor = Persistent<FunctionTemplate>::New(FunctionTemplate::New(CancelSignal::New));
+    constructor->InstanceTemplate()->SetInternalFieldCount(1);
+    constructor->SetClassName(String::NewSymbol("CancelSignal"));
+
+    NODE_SET_PROTOTYPE_METHOD(constructor, "cancel", cancel);
+    ATTR(constructor, "cancelled", get_prop, NULL);
+
+    target->Set(String::NewSymbol("CancelSignal"),constructor->GetFunction());
+}
+
+CancelSignal::CancelSignal() :
+    ObjectWrap(),
+    state_(MAPNIK_MAKE_SHARED<node_mapnik::cancel_state>()) {}
+
+CancelSignal::~CancelSignal() {}
+
+Handle<Value> CancelSignal::New(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (!args.IsConstructCall())
+        return ThrowException(String::New("Cannot call constructor as function, you need to use 'new' keyword"));
+
+    CancelSignal* s = new CancelSignal();
+    s->Wrap(args.This());
+    return args.This();
+}
+
+// jobs already past their last check still finish normally
+Handle<Value> CancelSignal::cancel(const Arguments& args)
+{
+    HandleScope scope;
+    CancelSignal* s = node::ObjectWrap::Unwrap<CancelSignal>(args.This());
+    s->state_->cancelled = true;
+    return Undefined();
+}
+
+Handle<Value> CancelSignal::get_prop(Local<String> property,
+                                     const AccessorInfo& info)
+{
+    HandleScope scope;
+    CancelSignal* s = node::ObjectWrap::Unwrap<CancelSignal>(info.This());
+    std::string a = TOSTR(property);
+    if (a == "cancelled")
+        return scope.Close(Boolean::New(s->state_->cancelled));
+    return Undefined();
+}
@@ -0,0 +1,99 @@
+#ifndef __NODE_MAPNIK_CANCEL_SIGNAL_H__
+#define __NODE_MAPNIK_CANCEL_SIGNAL_H__
+
+#include <v8.h>
+#include <uv.h>
+#include <node_object_wrap.h>
+#include "mapnik3x_compatibility.hpp"
+
+// boost
+#include MAPNIK_SHARED_INCLUDE
+
+// stl
+#include <stdexcept>
+#include <string>
+
+using namespace v8;
+
+namespace node_mapnik {
+
+// thrown on a worker thread when a job is cancelled or past its deadline
+class job_cancelled : public std::runtime_error
+{
+public:
+    job_cancelled(std::string const& what, std::string const& code) :
+        std::runtime_error(what),
+        code_(code) {}
+    ~job_cancelled() throw() {}
+    // 'ECANCELED' or 'ETIMEDOUT', set as err.code in js
+    std::string const& code() const { return code_; }
+private:
+    std::string code_;
+};
+
+// shared between a CancelSignal and the jobs it was passed to. A plain flag
+// is enough: workers only need to see the cancel eventually.
+struct cancel_state
+{
+    volatile bool cancelled;
+    cancel_state() : cancelled(false) {}
+};
+
+typedef MAPNIK_SHARED_PTR<cancel_state> cancel_state_ptr;
+
+// the 'signal' and 'timeout' options of one async call. Workers call
+// check() between units of work (layers, tiles) and before starting.
+class cancel_token
+{
+public:
+    cancel_token() :
+        state_(),
+        deadline_(0) {}
+
+    bool active() const
+    {
+        return state_ || deadline_ > 0;
+    }
+
+    void check() const
+    {
+        if (state_ && state_->cancelled)
+        {
+            throw job_cancelled("operation was cancelled", "ECANCELED");
+        }
+        if (deadline_ > 0 && uv_hrtime() > deadline_)
+        {
+            throw job_cancelled("operation timed out", "ETIMEDOUT");
+        }
+    }
+
+    cancel_state_ptr state_;
+    uint64_t deadline_; // uv_hrtime() nanoseconds, 0 for none
+};
+
+// reads the optional 'signal' (mapnik.CancelSignal) and 'timeout'
+// (milliseconds from now) options
+bool parse_cancel_options(Local<Object> const& options,
+                          cancel_token & token,
+                          std::string & error_name);
+
+}
+
+class CancelSignal: public node::ObjectWrap {
+public:
+    static Persistent<FunctionTemplate> constructor;
+    static void Initialize(Handle<Object> target);
+    static Handle<Value> New(const Arguments &args);
+    static Handle<Value> cancel(const Arguments &args);
+    static Handle<Value> get_prop(Local<String> property,
+                                  const AccessorInfo& info);
+
+    CancelSignal();
+    inline node_mapnik::cancel_state_ptr get() { return state_; }
+
+private:
+    ~CancelSignal();
+    node_mapnik::cancel_state_ptr state_;
+};
+
+#endif // __NODE_MAPNIK_CANCEL_SIGNAL_H__
@@ -13,6 +13,8 @@
 #include "mapnik_grid_view.hpp"
 #include "js_grid_utils.hpp"
 #include "utils.hpp"
+#include "worker_pool.hpp"
+#include "job_metrics.hpp"
 
 // boost
 #include "boost/ptr_container/ptr_sequence_adapter.hpp"
@@ -170,7 +172,7 @@ Handle<Value> Grid::clear(const Arguments& args)
     closure->g = g;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Clear, (uv_after_work_cb)EIO_AfterClear);
+    node_mapnik::queue_work(&closure->request, EIO_Clear, (uv_after_work_cb)EIO_AfterClear, "grid-clear", node_mapnik::PRIORITY_HIGH);
     g->Ref();
     return Undefined();
 }
@@ -198,7 +200,7 @@ void Grid::EIO_AfterClear(uv_work_t* req)
     TryCatch try_catch;
     if (closure->error)
     {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     }
     else
@@ -476,7 +478,7 @@ Handle<Value> Grid::encode(const Arguments& args) // format, resolution
     closure->add_features = add_features;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
     // todo - reserve lines size?
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Encode, (uv_after_work_cb)EIO_AfterEncode);
+    node_mapnik::queue_work(&closure->request, EIO_Encode, (uv_after_work_cb)EIO_AfterEncode, node_mapnik::encode_operation(format));
     g->Ref();
     return Undefined();
 }
@@ -508,7 +510,7 @@ void Grid::EIO_AfterEncode(uv_work_t* req)
     TryCatch try_catch;
 
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     } else {
 
@@ -15,6 +15,8 @@
 #include "mapnik_grid.hpp"
 #include "js_grid_utils.hpp"
 #include "utils.hpp"
+#include "worker_pool.hpp"
+#include "job_metrics.hpp"
 
 // boost
 #include MAPNIK_MAKE_SHARED_INCLUDE
@@ -141,7 +143,7 @@ Handle<Value> GridView::isSolid(const Arguments& args)
     closure->pixel = 0;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_IsSolid, (uv_after_work_cb)EIO_AfterIsSolid);
+    node_mapnik::queue_work(&closure->request, EIO_IsSolid, (uv_after_work_cb)EIO_AfterIsSolid, "grid-is-solid", node_mapnik::PRIORITY_HIGH);
     g->Ref();
     return Undefined();
 }
@@ -179,7 +181,7 @@ void GridView::EIO_AfterIsSolid(uv_work_t* req)
     is_solid_grid_view_baton_t *closure = static_cast<is_solid_grid_view_baton_t *>(req->data);
     TryCatch try_catch;
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     }
     else
@@ -437,7 +439,7 @@ Handle<Value> GridView::encode(const Arguments& args)
     closure->resolution = resolution;
     closure->add_features = add_features;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Encode, (uv_after_work_cb)EIO_AfterEncode);
+    node_mapnik::queue_work(&closure->request, EIO_Encode, (uv_after_work_cb)EIO_AfterEncode, node_mapnik::encode_operation(format));
     g->Ref();
     return Undefined();
 }
@@ -470,7 +472,7 @@ void GridView::EIO_AfterEncode(uv_work_t* req)
     TryCatch try_catch;
 
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     }
     else
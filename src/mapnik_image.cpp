@@ -23,6 +23,9 @@
 #include "mapnik_color.hpp"
 
 #include "utils.hpp"
+#include "worker_pool.hpp"
+#include "job_metrics.hpp"
+#include "mapnik_cancel_signal.hpp"
 
 // boost
 #include MAPNIK_MAKE_SHARED_INCLUDE
@@ -272,7 +275,7 @@ Handle<Value> Image::clear(const Arguments& args)
     closure->im = im;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Clear, (uv_after_work_cb)EIO_AfterClear);
+    node_mapnik::queue_work(&closure->request, EIO_Clear, (uv_after_work_cb)EIO_AfterClear, "image-clear", node_mapnik::PRIORITY_HIGH);
     im->Ref();
     return Undefined();
 }
@@ -300,7 +303,7 @@ void Image::EIO_AfterClear(uv_work_t* req)
     TryCatch try_catch;
     if (closure->error)
     {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     }
     else
@@ -400,7 +403,7 @@ Handle<Value> Image::premultiply(const Arguments& args)
     closure->im = im;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Premultiply, (uv_after_work_cb)EIO_AfterMultiply);
+    node_mapnik::queue_work(&closure->request, EIO_Premultiply, (uv_after_work_cb)EIO_AfterMultiply, "image-premultiply", node_mapnik::PRIORITY_HIGH);
     im->Ref();
     return Undefined();
 }
@@ -427,7 +430,7 @@ void Image::EIO_AfterMultiply(uv_work_t* req)
     TryCatch try_catch;
     if (closure->error)
     {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     }
     else
@@ -472,7 +475,7 @@ Handle<Value> Image::demultiply(const Arguments& args)
     closure->im = im;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Demultiply, (uv_after_work_cb)EIO_AfterMultiply);
+    node_mapnik::queue_work(&closure->request, EIO_Demultiply, (uv_after_work_cb)EIO_AfterMultiply, "image-demultiply", node_mapnik::PRIORITY_HIGH);
     im->Ref();
     return Undefined();
 }
@@ -607,7 +610,7 @@ Handle<Value> Image::open(const Arguments& args)
     closure->filename = TOSTR(args[0]);
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Open, (uv_after_work_cb)EIO_AfterOpen);
+    node_mapnik::queue_work(&closure->request, EIO_Open, (uv_after_work_cb)EIO_AfterOpen, "image-open", node_mapnik::PRIORITY_HIGH);
     return Undefined();
 }
 
@@ -652,7 +655,7 @@ void Image::EIO_AfterOpen(uv_work_t* req)
     TryCatch try_catch;
     if (closure->error || !closure->im)
     {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     }
     else
@@ -745,7 +748,7 @@ Handle<Value> Image::fromBytes(const Arguments& args)
     closure->dataLength = node::Buffer::Length(obj);
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_FromBytes, (uv_after_work_cb)EIO_AfterFromBytes);
+    node_mapnik::queue_work(&closure->request, EIO_FromBytes, (uv_after_work_cb)EIO_AfterFromBytes, "image-from-bytes", node_mapnik::PRIORITY_HIGH);
     return Undefined();
 }
 
@@ -781,7 +784,7 @@ void Image::EIO_AfterFromBytes(uv_work_t* req)
     TryCatch try_catch;
     if (closure->error || !closure->im)
     {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     }
     else
@@ -866,8 +869,10 @@ typedef struct {
     Image* im;
     std::string format;
     palette_ptr palette;
+    node_mapnik::cancel_token cancel;
     bool error;
     std::string error_name;
+    std::string error_code;
     Persistent<Function> cb;
     std::string result;
 } encode_image_baton_t;
@@ -910,6 +915,10 @@ Handle<Value> Image::encode(const Arguments& args)
 
             palette = node::ObjectWrap::Unwrap<Palette>(obj)->palette();
         }
+
+        std::string error_name;
+        if (!node_mapnik::parse_cancel_options(options,cancel,error_name))
+            return ThrowException(Exception::TypeError(String::New(error_name.c_str())));
     }
 
     // ensure callback is a function
@@ -923,9 +932,10 @@ Handle<Value> Image::encode(const Arguments& args)
     closure->im = im;
     closure->format = format;
     closure->palette = palette;
+    closure->cancel = cancel;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Encode, (uv_after_work_cb)EIO_AfterEncode);
+    node_mapnik::queue_work(&closure->request, EIO_Encode, (uv_after_work_cb)EIO_AfterEncode, node_mapnik::encode_operation(format));
     im->Ref();
 
     return Undefined();
@@ -936,6 +946,9 @@ void Image::EIO_Encode(uv_work_t* req)
     encode_image_baton_t *closure = static_cast<encode_image_baton_t *>(req->data);
 
     try {
+        // encoding is one call into mapnik, so this only catches jobs that
+        // were cancelled or timed out while queued
+        closure->cancel.check();
         if (closure->palette.get())
         {
             closure->result = save_to_string(*(closure->im->this_), closure->format, *closure->palette);
@@ -945,6 +958,12 @@ void Image::EIO_Encode(uv_work_t* req)
             closure->result = save_to_string(*(closure->im->this_), closure->format);
         }
     }
+    catch (node_mapnik::job_cancelled const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+        closure->error_code = ex.code();
+    }
     catch (std::exception const& ex)
     {
         closure->error = true;
@@ -961,7 +980,7 @@ void Image::EIO_AfterEncode(uv_work_t* req)
     TryCatch try_catch;
 
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name, closure->error_code) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     }
     else
@@ -1166,7 +1185,7 @@ Handle<Value> Image::composite(const Arguments& args)
         closure->dy = dy;
         closure->error = false;
         closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-        uv_queue_work(uv_default_loop(), &closure->request, EIO_Composite, (uv_after_work_cb)EIO_AfterComposite);
+        node_mapnik::queue_work(&closure->request, EIO_Composite, (uv_after_work_cb)EIO_AfterComposite, "composite");
         closure->im1->Ref();
         closure->im2->Ref();
     }
@@ -1209,7 +1228,7 @@ void Image::EIO_AfterComposite(uv_work_t* req)
     TryCatch try_catch;
 
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     } else {
         Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(closure->im1->handle_) };
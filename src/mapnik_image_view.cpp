@@ -18,6 +18,8 @@
 #include "mapnik_color.hpp"
 #include "mapnik_palette.hpp"
 #include "utils.hpp"
+#include "worker_pool.hpp"
+#include "job_metrics.hpp"
 
 // boost
 #include MAPNIK_MAKE_SHARED_INCLUDE
@@ -127,7 +129,7 @@ Handle<Value> ImageView::isSolid(const Arguments& args)
     closure->pixel = 0;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_IsSolid, (uv_after_work_cb)EIO_AfterIsSolid);
+    node_mapnik::queue_work(&closure->request, EIO_IsSolid, (uv_after_work_cb)EIO_AfterIsSolid, "image-is-solid", node_mapnik::PRIORITY_HIGH);
     im->Ref();
     return Undefined();
 }
@@ -167,7 +169,7 @@ void ImageView::EIO_AfterIsSolid(uv_work_t* req)
     is_solid_image_view_baton_t *closure = static_cast<is_solid_image_view_baton_t *>(req->data);
     TryCatch try_catch;
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     }
     else
@@ -407,7 +409,7 @@ Handle<Value> ImageView::encode(const Arguments& args)
     closure->palette = palette;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Encode, (uv_after_work_cb)EIO_AfterEncode);
+    node_mapnik::queue_work(&closure->request, EIO_Encode, (uv_after_work_cb)EIO_AfterEncode, node_mapnik::encode_operation(format));
     im->Ref();
     return Undefined();
 }
@@ -443,7 +445,7 @@ void ImageView::EIO_AfterEncode(uv_work_t* req)
     TryCatch try_catch;
 
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     }
     else
@@ -10,6 +10,15 @@
 #include "vector_tile_processor.hpp"
 #include "vector_tile_backend_pbf.hpp"
 #include "mapnik_vector_tile.hpp"
+#include "metatile.hpp"
+#include "scratch_image.hpp"
+#include "worker_pool.hpp"
+#include "job_metrics.hpp"
+#include "mapnik_cancel_signal.hpp"
+#include "mapnik_tile_cache.hpp"
+#include "shared_query_datasource.hpp"
+#include "cancel_datasource.hpp"
+#include "render_stats.hpp"
 
 // node
 #include <node.h>
@@ -35,13 +44,17 @@
 #include <mapnik/save_map.hpp>          // for save_map, etc
 #include <mapnik/version.hpp>           // for MAPNIK_VERSION
 #include <mapnik/scale_denominator.hpp>
+#include <mapnik/projection.hpp>        // for projection
 
 // stl
+#include <algorithm>                    // for sort
 #include <exception>                    // for exception
 #include <iosfwd>                       // for ostringstream, ostream
 #include <iostream>                     // for clog
 #include <ostream>                      // for operator<<, basic_ostream, etc
+#include <set>                          // for set
 #include <sstream>                      // for basic_ostringstream, etc
+#include <vector>                       // for vector
 
 // boost
 #include <boost/foreach.hpp>            // for auto_any_base, etc
@@ -101,22 +114,44 @@ void Map::Initialize(Handle<Object> target) {
     ATTR(constructor, "maximumExtent", get_prop, set_prop);
     ATTR(constructor, "background", get_prop, set_prop);
     ATTR(constructor, "parameters", get_prop, set_prop);
+    ATTR(constructor, "renderQueueLimit", get_prop, set_prop);
+    ATTR(constructor, "renderQueueLength", get_prop, set_prop);
 
     target->Set(String::NewSymbol("Map"),constructor->GetFunction());
 }
 
+unsigned long Map::next_layers_stamp_ = 0;
+
 Map::Map(int width, int height) :
     ObjectWrap(),
     map_(MAPNIK_MAKE_SHARED<mapnik::Map>(width,height)),
-    in_use_(0) {}
+    in_use_(0),
+    render_queue_(),
+    render_queue_limit_(-1),
+    layers_stamp_(++next_layers_stamp_) {}
 
 Map::Map(int width, int height, std::string const& srs) :
     ObjectWrap(),
     map_(MAPNIK_MAKE_SHARED<mapnik::Map>(width,height,srs)),
-    in_use_(0) {}
+    in_use_(0),
+    render_queue_(),
+    render_queue_limit_(-1),
+    layers_stamp_(++next_layers_stamp_) {}
+
+Map::Map() :
+    ObjectWrap(),
+    map_(),
+    in_use_(0),
+    render_queue_(),
+    render_queue_limit_(-1),
+    layers_stamp_(++next_layers_stamp_) {}
 
 Map::~Map() { }
 
+void Map::layers_changed() {
+    layers_stamp_ = ++next_layers_stamp_;
+}
+
 void Map::acquire() {
     ++in_use_;
 }
@@ -129,6 +164,39 @@ int Map::active() const {
     return in_use_;
 }
 
+void Map::queue_render(uv_work_t* req, uv_work_cb work, uv_after_work_cb after, std::string const& op) {
+    queued_render job;
+    job.req = req;
+    job.work = work;
+    job.after = after;
+    job.op = op;
+    job.queued_at = uv_hrtime();
+    render_queue_.push_back(job);
+    dispatch_next();
+}
+
+void Map::dispatch_next() {
+    if (in_use_ != 0 || render_queue_.empty()) return;
+    queued_render job = render_queue_.front();
+    render_queue_.pop_front();
+    acquire();
+    node_mapnik::queue_work(job.req, job.work, job.after, job.op, node_mapnik::PRIORITY_NORMAL, job.queued_at);
+}
+
+mapnik::Map & Map::mutable_map() {
+    if (map_.use_count() > 1)
+    {
+        map_ = MAPNIK_MAKE_SHARED<mapnik::Map>(*map_);
+    }
+    return *map_;
+}
+
+bool Map::render_queue_full() const {
+    if (render_queue_limit_ < 0) return false;
+    if (in_use_ == 0 && render_queue_.empty()) return false;
+    return render_queue_.size() >= static_cast<std::size_t>(render_queue_limit_);
+}
+
 Handle<Value> Map::New(const Arguments& args)
 {
     HandleScope scope;
@@ -136,10 +204,13 @@ Handle<Value> Map::New(const Arguments& args)
     if (!args.IsConstructCall())
         return ThrowException(String::New("Cannot call constructor as function, you need to use 'new' keyword"));
 
-    // accept a reference or v8:External?
     if (args[0]->IsExternal())
     {
-        return ThrowException(String::New("No support yet for passing v8:External wrapper around C++ void*"));
+        Local<External> ext = Local<External>::Cast(args[0]);
+        void* ptr = ext->Value();
+        Map* m =  static_cast<Map*>(ptr);
+        m->Wrap(args.This());
+        return args.This();
     }
 
     if (args.Length() == 2)
@@ -171,6 +242,16 @@ Handle<Value> Map::New(const Arguments& args)
     return Undefined();
 }
 
+Handle<Value> Map::New(mapnik::Map const& map_ref)
+{
+    HandleScope scope;
+    Map* m = new Map();
+    m->map_ = MAPNIK_MAKE_SHARED<mapnik::Map>(map_ref);
+    Handle<Value> ext = External::New(m);
+    Handle<Object> obj = constructor->GetFunction()->NewInstance(1, &ext);
+    return scope.Close(obj);
+}
+
 Handle<Value> Map::get_prop(Local<String> property,
                             const AccessorInfo& info)
 {
@@ -216,6 +297,10 @@ Handle<Value> Map::get_prop(Local<String> property,
         return scope.Close(String::New(m->map_->srs().c_str()));
     else if(a == "bufferSize")
         return scope.Close(Integer::New(m->map_->buffer_size()));
+    else if(a == "renderQueueLimit")
+        return scope.Close(Integer::New(m->render_queue_limit_));
+    else if(a == "renderQueueLength")
+        return scope.Close(Integer::New(m->queued()));
     else if (a == "background") {
         boost::optional<mapnik::color> c = m->map_->background();
         if (c)
@@ -263,9 +348,12 @@ void Map::set_prop(Local<String> property,
                 double maxy = arr->Get(3)->NumberValue();
                 mapnik::box2d<double> box(minx,miny,maxx,maxy);
                 if(a == "extent")
-                    m->map_->zoom_to_box(box);
+                    m->mutable_map().zoom_to_box(box);
                 else
-                    m->map_->set_maximum_extent(box);
+                {
+                    m->mutable_map().set_maximum_extent(box);
+                    m->layers_changed();
+                }
             }
         }
     }
@@ -275,7 +363,8 @@ void Map::set_prop(Local<String> property,
             ThrowException(Exception::Error(
                                String::New("'srs' must be a string")));
         } else {
-            m->map_->set_srs(TOSTR(value));
+            m->mutable_map().set_srs(TOSTR(value));
+            m->layers_changed();
         }
     }
     else if (a == "bufferSize") {
@@ -283,7 +372,15 @@ void Map::set_prop(Local<String> property,
             ThrowException(Exception::Error(
                                String::New("Must provide an integer bufferSize")));
         } else {
-            m->map_->set_buffer_size(value->IntegerValue());
+            m->mutable_map().set_buffer_size(value->IntegerValue());
+        }
+    }
+    else if (a == "renderQueueLimit") {
+        if (!value->IsNumber() || value->IntegerValue() < -1) {
+            ThrowException(Exception::Error(
+                               String::New("Must provide an integer renderQueueLimit (-1 for no limit)")));
+        } else {
+            m->render_queue_limit_ = value->IntegerValue();
         }
     }
     else if (a == "width") {
@@ -291,7 +388,7 @@ void Map::set_prop(Local<String> property,
             ThrowException(Exception::Error(
                                String::New("Must provide an integer width")));
         } else {
-            m->map_->set_width(value->IntegerValue());
+            m->mutable_map().set_width(value->IntegerValue());
         }
     }
     else if (a == "height") {
@@ -299,7 +396,7 @@ void Map::set_prop(Local<String> property,
             ThrowException(Exception::Error(
                                String::New("Must provide an integer height")));
         } else {
-            m->map_->set_height(value->IntegerValue());
+            m->mutable_map().set_height(value->IntegerValue());
         }
     }
     else if (a == "background") {
@@ -311,7 +408,8 @@ void Map::set_prop(Local<String> property,
         if (obj->IsNull() || obj->IsUndefined() || !Color::constructor->HasInstance(obj))
             ThrowException(Exception::TypeError(String::New("mapnik.Color expected")));
         Color *c = node::ObjectWrap::Unwrap<Color>(obj);
-        m->map_->set_background(*c->get());
+        m->mutable_map().set_background(*c->get());
+        m->layers_changed();
     }
     else if (a == "parameters") {
 #if MAPNIK_VERSION >= 200100
@@ -346,7 +444,8 @@ void Map::set_prop(Local<String> property,
             }
             i++;
         }
-        m->map_->set_extra_parameters(params);
+        m->mutable_map().set_extra_parameters(params);
+        m->layers_changed();
 #endif
     }
 }
@@ -368,6 +467,7 @@ Handle<Value> Map::scaleDenominator(const Arguments& args)
 typedef struct {
     uv_work_t request;
     Map *m;
+    map_ptr map;
     std::map<std::string,mapnik::featureset_ptr> featuresets;
     int layer_idx;
     bool geo_coords;
@@ -503,13 +603,14 @@ Handle<Value> Map::abstractQueryPoint(const Arguments& args, bool geo_coords)
     query_map_baton_t *closure = new query_map_baton_t();
     closure->request.data = closure;
     closure->m = m;
+    closure->map = m->get();
     closure->x = x;
     closure->y = y;
     closure->layer_idx = static_cast<std::size_t>(layer_idx);
     closure->geo_coords = geo_coords;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_QueryMap, (uv_after_work_cb)EIO_AfterQueryMap);
+    node_mapnik::queue_work(&closure->request, EIO_QueryMap, (uv_after_work_cb)EIO_AfterQueryMap, "map-query", node_mapnik::PRIORITY_HIGH);
     m->Ref();
     return Undefined();
 }
@@ -520,19 +621,19 @@ void Map::EIO_QueryMap(uv_work_t* req)
 
     try
     {
-        std::vector<mapnik::layer> const& layers = closure->m->map_->layers();
+        std::vector<mapnik::layer> const& layers = closure->map->layers();
         if (closure->layer_idx >= 0)
         {
             mapnik::featureset_ptr fs;
             if (closure->geo_coords)
             {
-                fs = closure->m->map_->query_point(closure->layer_idx,
+                fs = closure->map->query_point(closure->layer_idx,
                                                    closure->x,
                                                    closure->y);
             }
             else
             {
-                fs = closure->m->map_->query_map_point(closure->layer_idx,
+                fs = closure->map->query_map_point(closure->layer_idx,
                                                        closure->x,
                                                        closure->y);
             }
@@ -548,13 +649,13 @@ void Map::EIO_QueryMap(uv_work_t* req)
                 mapnik::featureset_ptr fs;
                 if (closure->geo_coords)
                 {
-                    fs = closure->m->map_->query_point(idx,
+                    fs = closure->map->query_point(idx,
                                                        closure->x,
                                                        closure->y);
                 }
                 else
                 {
-                    fs = closure->m->map_->query_map_point(idx,
+                    fs = closure->map->query_map_point(idx,
                                                            closure->x,
                                                            closure->y);
                 }
@@ -579,7 +680,7 @@ void Map::EIO_AfterQueryMap(uv_work_t* req)
     TryCatch try_catch;
 
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     } else {
         std::size_t num_result = closure->featuresets.size();
@@ -644,7 +745,8 @@ Handle<Value> Map::add_layer(const Arguments &args) {
         return ThrowException(Exception::TypeError(String::New("mapnik.Layer expected")));
     Layer *l = node::ObjectWrap::Unwrap<Layer>(obj);
     Map* m = node::ObjectWrap::Unwrap<Map>(args.This());
-    m->map_->MAPNIK_ADD_LAYER(*l->get());
+    m->mutable_map().MAPNIK_ADD_LAYER(*l->get());
+    m->layers_changed();
     return Undefined();
 }
 
@@ -710,7 +812,8 @@ Handle<Value> Map::clear(const Arguments& args)
 {
     HandleScope scope;
     Map* m = node::ObjectWrap::Unwrap<Map>(args.This());
-    m->map_->remove_all();
+    m->mutable_map().remove_all();
+    m->layers_changed();
     return Undefined();
 }
 
@@ -727,7 +830,7 @@ Handle<Value> Map::resize(const Arguments& args)
                                   String::New("width and height must be integers")));
 
     Map* m = node::ObjectWrap::Unwrap<Map>(args.This());
-    m->map_->resize(args[0]->IntegerValue(),args[1]->IntegerValue());
+    m->mutable_map().resize(args[0]->IntegerValue(),args[1]->IntegerValue());
     return Undefined();
 }
 
@@ -735,6 +838,7 @@ Handle<Value> Map::resize(const Arguments& args)
 typedef struct {
     uv_work_t request;
     Map *m;
+    map_ptr map; // loaded aside and swapped in when the load succeeds
     std::string stylesheet;
     std::string base_path;
     bool strict;
@@ -799,10 +903,11 @@ Handle<Value> Map::load(const Arguments& args)
 
     closure->stylesheet = TOSTR(stylesheet);
     closure->m = m;
+    closure->map = MAPNIK_MAKE_SHARED<mapnik::Map>(*m->get());
     closure->strict = strict;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Load, (uv_after_work_cb)EIO_AfterLoad);
+    node_mapnik::queue_work(&closure->request, EIO_Load, (uv_after_work_cb)EIO_AfterLoad, "map-load");
     m->Ref();
     return Undefined();
 }
@@ -814,9 +919,9 @@ void Map::EIO_Load(uv_work_t* req)
     try
     {
 #if MAPNIK_VERSION >= 200200
-        mapnik::load_map(*closure->m->map_,closure->stylesheet,closure->strict,closure->base_path);
+        mapnik::load_map(*closure->map,closure->stylesheet,closure->strict,closure->base_path);
 #else
-        mapnik::load_map(*closure->m->map_,closure->stylesheet,closure->strict);
+        mapnik::load_map(*closure->map,closure->stylesheet,closure->strict);
 #endif
 
     }
@@ -832,11 +937,16 @@ void Map::EIO_AfterLoad(uv_work_t* req)
     HandleScope scope;
 
     load_xml_baton_t *closure = static_cast<load_xml_baton_t *>(req->data);
+    if (!closure->error)
+    {
+        closure->m->map_ = closure->map;
+        closure->m->layers_changed();
+    }
 
     TryCatch try_catch;
 
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     } else {
         Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(closure->m->handle_) };
@@ -901,12 +1011,13 @@ Handle<Value> Map::loadSync(const Arguments& args)
         }
     }
 
+    m->layers_changed();
     try
     {
 #if MAPNIK_VERSION >= 200200
-        mapnik::load_map(*m->map_,stylesheet,strict,base_path);
+        mapnik::load_map(m->mutable_map(),stylesheet,strict,base_path);
 #else
-        mapnik::load_map(*m->map_,stylesheet,strict);
+        mapnik::load_map(m->mutable_map(),stylesheet,strict);
 #endif
     }
     catch (std::exception const& ex)
@@ -967,9 +1078,10 @@ Handle<Value> Map::fromStringSync(const Arguments& args)
 
     std::string stylesheet = TOSTR(args[0]);
 
+    m->layers_changed();
     try
     {
-        mapnik::load_map_string(*m->map_,stylesheet,strict,base_path);
+        mapnik::load_map_string(m->mutable_map(),stylesheet,strict,base_path);
     }
     catch (std::exception const& ex)
     {
@@ -1034,10 +1146,11 @@ Handle<Value> Map::fromString(const Arguments& args)
 
     closure->stylesheet = TOSTR(stylesheet);
     closure->m = m;
+    closure->map = MAPNIK_MAKE_SHARED<mapnik::Map>(*m->get());
     closure->strict = strict;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_FromString, (uv_after_work_cb)EIO_AfterFromString);
+    node_mapnik::queue_work(&closure->request, EIO_FromString, (uv_after_work_cb)EIO_AfterFromString, "map-from-string");
     m->Ref();
     return Undefined();
 }
@@ -1048,7 +1161,7 @@ void Map::EIO_FromString(uv_work_t* req)
 
     try
     {
-        mapnik::load_map_string(*closure->m->map_,closure->stylesheet,closure->strict,closure->base_path);
+        mapnik::load_map_string(*closure->map,closure->stylesheet,closure->strict,closure->base_path);
     }
     catch (std::exception const& ex)
     {
@@ -1062,11 +1175,16 @@ void Map::EIO_AfterFromString(uv_work_t* req)
     HandleScope scope;
 
     load_xml_baton_t *closure = static_cast<load_xml_baton_t *>(req->data);
+    if (!closure->error)
+    {
+        closure->m->map_ = closure->map;
+        closure->m->layers_changed();
+    }
 
     TryCatch try_catch;
 
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     } else {
         Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(closure->m->handle_) };
@@ -1112,7 +1230,7 @@ Handle<Value> Map::zoomAll(const Arguments& args)
     Map* m = node::ObjectWrap::Unwrap<Map>(args.This());
     try
     {
-        m->map_->zoom_all();
+        m->mutable_map().zoom_all();
     }
     catch (std::exception const& ex)
     {
@@ -1154,21 +1272,40 @@ Handle<Value> Map::zoomToBox(const Arguments& args)
         maxy = args[3]->NumberValue();
     }
     mapnik::box2d<double> box(minx,miny,maxx,maxy);
-    m->map_->zoom_to_box(box);
+    m->mutable_map().zoom_to_box(box);
     return Undefined();
 }
 
+// a layer drawn into a grid and the attributes queried for its features
+struct grid_layer_t {
+    std::size_t idx;
+    std::set<std::string> fields;
+};
+
 struct image_baton_t {
     uv_work_t request;
     Map *m;
+    map_ptr map; // the map as it was when render was called
     Image *im;
     int buffer_size; // TODO - no effect until mapnik::request is used
     double scale_factor;
     double scale_denominator;
     unsigned offset_x;
     unsigned offset_y;
+    unsigned metatile;
+    node_mapnik::encode_options encoding;
+    image_ptr scratch; // render target when no Image is passed
+    std::string result;
+    TileCache * cache;
+    std::string cache_key;
+    bool cache_leader; // identical requests wait for this render
+    Grid * g; // rendered from the same queries as the image, if set
+    std::vector<grid_layer_t> grid_layers;
+    node_mapnik::cancel_token cancel;
+    node_mapnik::render_stats_ptr stats; // set when 'stats' was requested
     bool error;
     std::string error_name;
+    std::string error_code;
     Persistent<Function> cb;
     image_baton_t() :
       buffer_size(0),
@@ -1176,6 +1313,16 @@ struct image_baton_t {
       scale_denominator(0.0),
       offset_x(0),
       offset_y(0),
+      metatile(0),
+      encoding(),
+      scratch(),
+      result(),
+      cache(NULL),
+      cache_key(),
+      cache_leader(false),
+      g(NULL),
+      grid_layers(),
+      cancel(),
       error(false),
       error_name() {}
 };
@@ -1183,18 +1330,22 @@ struct image_baton_t {
 struct grid_baton_t {
     uv_work_t request;
     Map *m;
+    map_ptr map; // the map as it was when render was called
     Grid *g;
-    std::size_t layer_idx;
+    std::vector<grid_layer_t> layers; // in map order
     int buffer_size; // TODO - no effect until mapnik::request is used
     double scale_factor;
     double scale_denominator;
     unsigned offset_x;
     unsigned offset_y;
+    node_mapnik::cancel_token cancel;
+    node_mapnik::render_stats_ptr stats; // set when 'stats' was requested
     bool error;
     std::string error_name;
+    std::string error_code;
     Persistent<Function> cb;
     grid_baton_t() :
-      layer_idx(-1),
+      layers(),
       buffer_size(0),
       scale_factor(1.0),
       scale_denominator(0.0),
@@ -1207,6 +1358,7 @@ struct grid_baton_t {
 struct vector_tile_baton_t {
     uv_work_t request;
     Map *m;
+    map_ptr map; // the map as it was when render was called
     VectorTile *d;
     unsigned tolerance;
     unsigned path_multiplier;
@@ -1215,8 +1367,11 @@ struct vector_tile_baton_t {
     double scale_denominator;
     unsigned offset_x;
     unsigned offset_y;
+    node_mapnik::cancel_token cancel;
+    node_mapnik::render_stats_ptr stats; // set when 'stats' was requested
     bool error;
     std::string error_name;
+    std::string error_code;
     Persistent<Function> cb;
     vector_tile_baton_t() :
         tolerance(1),
@@ -1228,6 +1383,222 @@ struct vector_tile_baton_t {
         error(false) {}
 };
 
+// finds a layer by name or zero-based index for rendering to a grid
+static bool grid_layer_index(Local<Value> const& layer_id,
+                             std::vector<mapnik::layer> const& layers,
+                             std::size_t & layer_idx,
+                             std::string & error_name)
+{
+    if (layer_id->IsString()) {
+        std::string const & layer_name = TOSTR(layer_id);
+        for (std::size_t idx = 0; idx < layers.size(); ++idx)
+        {
+            if (layers[idx].name() == layer_name)
+            {
+                layer_idx = idx;
+                return true;
+            }
+        }
+        std::ostringstream s;
+        s << "Layer name '" << layer_name << "' not found";
+        error_name = s.str();
+        return false;
+    } else if (layer_id->IsNumber()) {
+        layer_idx = layer_id->IntegerValue();
+        std::size_t layer_num = layers.size();
+
+        if (layer_id->IntegerValue() < 0 || layer_idx >= layer_num) {
+            std::ostringstream s;
+            s << "Zero-based layer index '" << layer_id->IntegerValue() << "' not valid, ";
+            if (layer_num > 0)
+            {
+                s << "only '" << layer_num << "' layers exist in map";
+            }
+            else
+            {
+                s << "no layers found in map";
+            }
+            error_name = s.str();
+            return false;
+        }
+        return true;
+    }
+    error_name = "'layer' option required for grid rendering and must be either a layer name(string) or layer index (integer)";
+    return false;
+}
+
+static bool grid_layer_before(grid_layer_t const& a, grid_layer_t const& b)
+{
+    return a.idx < b.idx;
+}
+
+// reads the 'layer' or 'layers' and 'fields' options of a grid render.
+// The fields are only added to the grid once all of them are valid.
+static bool parse_grid_layers(Local<Object> const& options,
+                              Map * m,
+                              Grid * g,
+                              std::vector<grid_layer_t> & grid_layers,
+                              std::string & error_name)
+{
+    // grid requires special options for now
+    if (!options->Has(String::New("layer")) && !options->Has(String::New("layers"))) {
+        error_name = "'layer' option required for grid rendering and must be either a layer name(string) or layer index (integer)";
+        return false;
+    }
+
+    // layers without their own field list query the fields of the grid
+    std::set<std::string> grid_fields = g->get()->property_names();
+    if (options->Has(String::New("fields"))) {
+
+        Local<Value> param_val = options->Get(String::New("fields"));
+        if (!param_val->IsArray())
+        {
+            error_name = "option 'fields' must be an array of strings";
+            return false;
+        }
+        Local<Array> a = Local<Array>::Cast(param_val);
+        unsigned int i = 0;
+        unsigned int num_fields = a->Length();
+        while (i < num_fields) {
+            Local<Value> name = a->Get(i);
+            if (name->IsString()){
+                grid_fields.insert(TOSTR(name));
+            }
+            i++;
+        }
+    }
+    // every queried field is written out by grid.encode()
+    std::set<std::string> all_fields = grid_fields;
+
+    std::vector<mapnik::layer> const& layers = m->get()->layers();
+
+    if (options->Has(String::New("layers"))) {
+        // [name|index|{layer, fields}] drawn into the one grid
+        Local<Value> layers_val = options->Get(String::New("layers"));
+        if (!layers_val->IsArray() || Local<Array>::Cast(layers_val)->Length() == 0)
+        {
+            error_name = "option 'layers' must be a non-empty array of layer names, indexes or {layer, fields} objects";
+            return false;
+        }
+        Local<Array> a = Local<Array>::Cast(layers_val);
+        for (unsigned i = 0; i < a->Length(); ++i) {
+            Local<Value> entry = a->Get(i);
+            grid_layer_t gl;
+            gl.fields = grid_fields;
+            Local<Value> layer_id = entry;
+            Local<Value> fields_val;
+            if (entry->IsObject() && !entry->IsString() && !entry->IsNumber()) {
+                Local<Object> entry_obj = entry->ToObject();
+                layer_id = entry_obj->Get(String::New("layer"));
+                if (entry_obj->Has(String::New("fields")))
+                    fields_val = entry_obj->Get(String::New("fields"));
+            }
+            if (!grid_layer_index(layer_id,layers,gl.idx,error_name))
+                return false;
+            if (!fields_val.IsEmpty()) {
+                if (!fields_val->IsArray())
+                {
+                    error_name = "'fields' of a layer must be an array of strings";
+                    return false;
+                }
+                gl.fields.clear();
+                Local<Array> f = Local<Array>::Cast(fields_val);
+                for (unsigned k = 0; k < f->Length(); ++k) {
+                    Local<Value> name = f->Get(k);
+                    if (name->IsString()) {
+                        gl.fields.insert(TOSTR(name));
+                        all_fields.insert(TOSTR(name));
+                    }
+                }
+            }
+            BOOST_FOREACH ( grid_layer_t const& other, grid_layers )
+            {
+                if (other.idx == gl.idx) {
+                    std::ostringstream s;
+                    s << "Layer '" << layers[gl.idx].name() << "' requested more than once";
+                    error_name = s.str();
+                    return false;
+                }
+            }
+            grid_layers.push_back(gl);
+        }
+        // feature ids are only unique within a layer
+        if (grid_layers.size() > 1 && g->get()->get_key() == "__id__")
+        {
+            error_name = "several 'layers' cannot share a grid keyed by '__id__': feature ids repeat across layers, use a unique field as the grid key";
+            return false;
+        }
+        // later layers are drawn on top, as in the rendered image
+        std::sort(grid_layers.begin(),grid_layers.end(),grid_layer_before);
+    } else {
+        grid_layer_t gl;
+        gl.fields = grid_fields;
+        if (!grid_layer_index(options->Get(String::New("layer")),layers,gl.idx,error_name))
+            return false;
+        grid_layers.push_back(gl);
+    }
+
+    BOOST_FOREACH ( std::string const& name, all_fields )
+    {
+        g->get()->add_property_name(name);
+    }
+    return true;
+}
+
+// everything that affects the bytes of Map.render({format, palette}).
+// The palette is keyed by its colors: a freed palette's address can be
+// reused by one with other colors.
+static std::string tile_cache_key(Map * m,
+                                  image_baton_t const& closure)
+{
+    mapnik::Map const& map = *closure.map;
+    mapnik::box2d<double> const& extent = map.get_current_extent();
+    std::ostringstream s;
+    s.precision(17);
+    s << m->layers_stamp() << '|'
+      << map.width() << 'x' << map.height() << '|'
+      << extent.minx() << ',' << extent.miny() << ','
+      << extent.maxx() << ',' << extent.maxy() << '|';
+    // layer queries are clipped to it
+    if (map.maximum_extent())
+    {
+        mapnik::box2d<double> const& max_extent = *map.maximum_extent();
+        s << max_extent.minx() << ',' << max_extent.miny() << ','
+          << max_extent.maxx() << ',' << max_extent.maxy();
+    }
+    s << '|'
+      << map.srs() << '|'
+      << map.buffer_size() << ',' << closure.buffer_size << '|'
+      << closure.scale_factor << ',' << closure.scale_denominator << '|'
+      << closure.offset_x << ',' << closure.offset_y << '|'
+      << closure.encoding.format << '|';
+    if (closure.encoding.palette)
+    {
+        std::vector<mapnik::rgb> const& colors = closure.encoding.palette->palette();
+        std::vector<unsigned> const& alpha = closure.encoding.palette->alphaTable();
+        s << std::hex;
+        for (std::size_t i = 0; i < colors.size(); ++i)
+        {
+            s << static_cast<unsigned>(colors[i].r) << ','
+              << static_cast<unsigned>(colors[i].g) << ','
+              << static_cast<unsigned>(colors[i].b) << ','
+              << (i < alpha.size() ? alpha[i] : 0xff) << ';';
+        }
+        s << std::dec;
+    }
+    s << '|';
+    if (map.background())
+    {
+        s << map.background()->to_string();
+    }
+    s << '|';
+    if (map.background_image())
+    {
+        s << *map.background_image();
+    }
+    return s.str();
+}
+
 Handle<Value> Map::render(const Arguments& args)
 {
     HandleScope scope;
@@ -1251,13 +1622,12 @@ Handle<Value> Map::render(const Arguments& args)
 
     Map* m = node::ObjectWrap::Unwrap<Map>(args.This());
 
-    if (m->active() != 0) {
+    if (m->render_queue_full()) {
         std::ostringstream s;
-        s << "render: this map appears to be in use by "
-          << m->active()
-          << " other thread(s) which is not allowed."
-          << " You need to use a map pool to avoid sharing map objects between concurrent rendering";
-        std::clog << s.str() << "\n";
+        s << "render: the render queue of this map is full ("
+          << m->queued()
+          << " renders waiting), raise map.renderQueueLimit or use a mapnik.MapPool";
+        return ThrowException(Exception::Error(String::New(s.str().c_str())));
     }
 
     // parse options
@@ -1268,6 +1638,8 @@ Handle<Value> Map::render(const Arguments& args)
     double scale_denominator = 0.0;
     unsigned offset_x = 0;
     unsigned offset_y = 0;
+    node_mapnik::cancel_token cancel;
+    node_mapnik::render_stats_ptr stats;
 
     Local<Object> options = Object::New();
 
@@ -1324,6 +1696,11 @@ Handle<Value> Map::render(const Arguments& args)
 
             offset_y = bind_opt->IntegerValue();
         }
+
+        std::string error_name;
+        if (!node_mapnik::parse_cancel_options(options,cancel,error_name) ||
+            !node_mapnik::parse_stats_option(options,stats,error_name))
+            return ThrowException(Exception::TypeError(String::New(error_name.c_str())));
     }
 
     Local<Object> obj = args[0]->ToObject();
@@ -1332,117 +1709,103 @@ Handle<Value> Map::render(const Arguments& args)
 
     if (Image::constructor->HasInstance(obj)) {
 
+        Image * im = node::ObjectWrap::Unwrap<Image>(obj);
+
+        // split the rendered image into metatile x metatile encoded tiles
+        unsigned metatile = 0;
+        node_mapnik::encode_options encoding;
+        std::string error_name;
+        if (!node_mapnik::parse_metatile_option(options,im->get()->width(),im->get()->height(),metatile,error_name) ||
+            !node_mapnik::parse_encode_options(options,encoding,error_name))
+        {
+            return ThrowException(Exception::TypeError(String::New(error_name.c_str())));
+        }
+
+        if (metatile > 0 && stats)
+        {
+            return ThrowException(Exception::TypeError(String::New("'stats' cannot be combined with 'metatile'")));
+        }
+
+        // {grid} renders a grid of the same map from the same queries
+        Grid * g = NULL;
+        std::vector<grid_layer_t> grid_layers;
+        if (options->Has(String::New("grid")))
+        {
+            Local<Value> grid_opt = options->Get(String::New("grid"));
+            if (!grid_opt->IsObject() || !Grid::constructor->HasInstance(grid_opt->ToObject()))
+            {
+                return ThrowException(Exception::TypeError(String::New("'grid' must be a mapnik.Grid")));
+            }
+            if (metatile > 0)
+            {
+                return ThrowException(Exception::TypeError(String::New("'grid' cannot be combined with 'metatile'")));
+            }
+            g = node::ObjectWrap::Unwrap<Grid>(grid_opt->ToObject());
+            if (!parse_grid_layers(options,m,g,grid_layers,error_name))
+            {
+                return ThrowException(Exception::TypeError(String::New(error_name.c_str())));
+            }
+        }
+
         image_baton_t *closure = new image_baton_t();
         closure->request.data = closure;
         closure->m = m;
-        closure->im = node::ObjectWrap::Unwrap<Image>(obj);
+        closure->map = m->get();
+        closure->im = im;
         closure->im->_ref();
+        if (g)
+        {
+            closure->g = g;
+            closure->g->_ref();
+            closure->grid_layers = grid_layers;
+        }
         closure->buffer_size = buffer_size;
         closure->scale_factor = scale_factor;
         closure->scale_denominator = scale_denominator;
         closure->offset_x = offset_x;
         closure->offset_y = offset_y;
+        closure->cancel = cancel;
+        closure->stats = stats;
+        closure->metatile = metatile;
+        closure->encoding = encoding;
         closure->error = false;
         closure->cb = Persistent<Function>::New(Handle<Function>::Cast(args[args.Length()-1]));
-        uv_queue_work(uv_default_loop(), &closure->request, EIO_RenderImage, (uv_after_work_cb)EIO_AfterRenderImage);
+        m->queue_render(&closure->request, EIO_RenderImage, (uv_after_work_cb)EIO_AfterRenderImage, "render-image");
 
     } else if (Grid::constructor->HasInstance(obj)) {
 
         Grid * g = node::ObjectWrap::Unwrap<Grid>(obj);
 
-        std::size_t layer_idx = 0;
-
-        // grid requires special options for now
-        if (!options->Has(String::New("layer"))) {
-            return ThrowException(Exception::TypeError(
-                                      String::New("'layer' option required for grid rendering and must be either a layer name(string) or layer index (integer)")));
-        } else {
-
-            std::vector<mapnik::layer> const& layers = m->map_->layers();
-
-            Local<Value> layer_id = options->Get(String::New("layer"));
-            if (! (layer_id->IsString() || layer_id->IsNumber()) )
-                return ThrowException(Exception::TypeError(
-                                          String::New("'layer' option required for grid rendering and must be either a layer name(string) or layer index (integer)")));
-
-            if (layer_id->IsString()) {
-                bool found = false;
-                unsigned int idx(0);
-                std::string const & layer_name = TOSTR(layer_id);
-                BOOST_FOREACH ( mapnik::layer const& lyr, layers )
-                {
-                    if (lyr.name() == layer_name)
-                    {
-                        found = true;
-                        layer_idx = idx;
-                        break;
-                    }
-                    ++idx;
-                }
-                if (!found)
-                {
-                    std::ostringstream s;
-                    s << "Layer name '" << layer_name << "' not found";
-                    return ThrowException(Exception::TypeError(String::New(s.str().c_str())));
-                }
-            } else if (layer_id->IsNumber()) {
-                layer_idx = layer_id->IntegerValue();
-                std::size_t layer_num = layers.size();
-
-                if (layer_idx >= layer_num) {
-                    std::ostringstream s;
-                    s << "Zero-based layer index '" << layer_idx << "' not valid, ";
-                    if (layer_num > 0)
-                    {
-                        s << "only '" << layer_num << "' layers exist in map";
-                    }
-                    else
-                    {
-                        s << "no layers found in map";
-                    }
-                    return ThrowException(Exception::TypeError(String::New(s.str().c_str())));
-                }
-            } else {
-                return ThrowException(Exception::TypeError(String::New("layer id must be a string or index number")));
-            }
-        }
-
-        if (options->Has(String::New("fields"))) {
-
-            Local<Value> param_val = options->Get(String::New("fields"));
-            if (!param_val->IsArray())
-                return ThrowException(Exception::TypeError(
-                                          String::New("option 'fields' must be an array of strings")));
-            Local<Array> a = Local<Array>::Cast(param_val);
-            unsigned int i = 0;
-            unsigned int num_fields = a->Length();
-            while (i < num_fields) {
-                Local<Value> name = a->Get(i);
-                if (name->IsString()){
-                    g->get()->add_property_name(TOSTR(name));
-                }
-                i++;
-            }
-        }
+        std::vector<grid_layer_t> grid_layers;
+        std::string error_name;
+        if (!parse_grid_layers(options,m,g,grid_layers,error_name))
+            return ThrowException(Exception::TypeError(String::New(error_name.c_str())));
 
         grid_baton_t *closure = new grid_baton_t();
         closure->request.data = closure;
         closure->m = m;
+        closure->map = m->get();
         closure->g = g;
         closure->g->_ref();
-        closure->layer_idx = layer_idx;
+        closure->layers = grid_layers;
         closure->buffer_size = buffer_size;
         closure->scale_factor = scale_factor;
         closure->scale_denominator = scale_denominator;
         closure->offset_x = offset_x;
         closure->offset_y = offset_y;
+        closure->cancel = cancel;
+        closure->stats = stats;
         closure->error = false;
         closure->cb = Persistent<Function>::New(Handle<Function>::Cast(args[args.Length()-1]));
-        uv_queue_work(uv_default_loop(), &closure->request, EIO_RenderGrid, (uv_after_work_cb)EIO_AfterRenderGrid);
+        m->queue_render(&closure->request, EIO_RenderGrid, (uv_after_work_cb)EIO_AfterRenderGrid, "render-grid");
     } else if (VectorTile::constructor->HasInstance(obj)) {
 
-        vector_tile_baton_t *closure = new vector_tile_baton_t();
         VectorTile * vector_tile_obj = node::ObjectWrap::Unwrap<VectorTile>(obj);
+        if (const char * busy = vector_tile_obj->write_blocked())
+        {
+            return ThrowException(Exception::Error(String::New(busy)));
+        }
+        vector_tile_baton_t *closure = new vector_tile_baton_t();
 
         if (options->Has(String::New("tolerance"))) {
 
@@ -1467,21 +1830,89 @@ Handle<Value> Map::render(const Arguments& args)
 
         closure->request.data = closure;
         closure->m = m;
+        closure->map = m->get();
         closure->d = vector_tile_obj;
         closure->d->_ref();
+        closure->d->begin_write();
         closure->buffer_size = buffer_size;
         closure->scale_factor = scale_factor;
         closure->scale_denominator = scale_denominator;
         closure->offset_x = offset_x;
         closure->offset_y = offset_y;
+        closure->cancel = cancel;
+        closure->stats = stats;
         closure->error = false;
         closure->cb = Persistent<Function>::New(Handle<Function>::Cast(args[args.Length()-1]));
-        uv_queue_work(uv_default_loop(), &closure->request, EIO_RenderVectorTile, (uv_after_work_cb)EIO_AfterRenderVectorTile);
+        m->queue_render(&closure->request, EIO_RenderVectorTile, (uv_after_work_cb)EIO_AfterRenderVectorTile, "render-vtile");
+    } else if (obj->Has(String::New("format"))) {
+
+        // {format, palette} in place of an Image: render into a scratch
+        // image and encode it in the same job
+        node_mapnik::encode_options encoding;
+        std::string error_name;
+        if (!node_mapnik::parse_encode_options(obj,encoding,error_name))
+        {
+            return ThrowException(Exception::TypeError(String::New(error_name.c_str())));
+        }
+        if (options->Has(String::New("metatile")))
+        {
+            return ThrowException(Exception::TypeError(String::New("'metatile' requires a mapnik.Image to render into")));
+        }
+
+        TileCache * cache = NULL;
+        if (obj->Has(String::New("cache")))
+        {
+            Local<Value> cache_opt = obj->Get(String::New("cache"));
+            if (!cache_opt->IsObject() || !TileCache::constructor->HasInstance(cache_opt->ToObject()))
+            {
+                return ThrowException(Exception::TypeError(String::New("'cache' must be a mapnik.TileCache")));
+            }
+            cache = node::ObjectWrap::Unwrap<TileCache>(cache_opt->ToObject());
+            if (stats)
+            {
+                return ThrowException(Exception::TypeError(String::New("'stats' cannot be combined with 'cache'")));
+            }
+        }
+
+        image_baton_t *closure = new image_baton_t();
+        closure->request.data = closure;
+        closure->m = m;
+        closure->map = m->get();
+        closure->im = NULL;
+        closure->buffer_size = buffer_size;
+        closure->scale_factor = scale_factor;
+        closure->scale_denominator = scale_denominator;
+        closure->offset_x = offset_x;
+        closure->offset_y = offset_y;
+        closure->cancel = cancel;
+        closure->stats = stats;
+        closure->encoding = encoding;
+        closure->error = false;
+
+        if (cache)
+        {
+            closure->cache_key = tile_cache_key(m,*closure);
+            Handle<Function> cb = Handle<Function>::Cast(args[args.Length()-1]);
+            if (cache->serve(closure->cache_key,cb) || cache->join(closure->cache_key,cb))
+            {
+                delete closure;
+                return Undefined();
+            }
+            // a render that may be cancelled still fills the cache but
+            // nobody waits on it, its cancellation is not theirs
+            closure->cache = cache;
+            closure->cache_leader = !cancel.active();
+            cache->begin(closure->cache_key,closure->cache_leader);
+            cache->_ref();
+        }
+
+        closure->scratch = node_mapnik::acquire_scratch_image(closure->map->width(),closure->map->height());
+        closure->cb = Persistent<Function>::New(Handle<Function>::Cast(args[args.Length()-1]));
+        m->queue_render(&closure->request, EIO_RenderImage, (uv_after_work_cb)EIO_AfterRenderImage, "render-image");
     } else {
         return ThrowException(Exception::TypeError(String::New("renderable mapnik object expected")));
     }
 
-    m->acquire();
     m->Ref();
     return Undefined();
 }
@@ -1489,17 +1920,34 @@ Handle<Value> Map::render(const Arguments& args)
 void Map::EIO_RenderVectorTile(uv_work_t* req)
 {
     vector_tile_baton_t *closure = static_cast<vector_tile_baton_t *>(req->data);
+    if (closure->stats) closure->stats->started_at = uv_hrtime();
     try
     {
+        closure->cancel.check();
         typedef mapnik::vector::backend_pbf backend_type;
         typedef mapnik::vector::processor<backend_type> renderer_type;
         backend_type backend(closure->d->get_tile_nonconst(),
                              closure->path_multiplier);
-        mapnik::Map const& map = *closure->m->get();
+        mapnik::Map const& map = *closure->map;
+        // the processor only renders whole maps, so stats and cancel
+        // checks go on a copy whose layers carry wrapped datasources
+        boost::optional<mapnik::Map> instrumented;
+        if (closure->stats || closure->cancel.active())
+        {
+            instrumented = map;
+            if (closure->stats)
+            {
+                node_mapnik::instrument_layers(instrumented->layers(),*closure->stats);
+            }
+            if (closure->cancel.active())
+            {
+                node_mapnik::cancel_layers(instrumented->layers(),closure->cancel);
+            }
+        }
         mapnik::request m_req(map.width(),map.height(),map.get_current_extent());
         m_req.set_buffer_size(closure->buffer_size);
         renderer_type ren(backend,
-                          map,
+                          instrumented ? *instrumented : map,
                           m_req,
                           closure->scale_factor,
                           closure->offset_x,
@@ -1509,11 +1957,18 @@ void Map::EIO_RenderVectorTile(uv_work_t* req)
         closure->d->painted(ren.painted());
 
     }
+    catch (node_mapnik::job_cancelled const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+        closure->error_code = ex.code();
+    }
     catch (std::exception const& ex)
     {
         closure->error = true;
         closure->error_name = ex.what();
     }
+    if (closure->stats) closure->stats->finished_at = uv_hrtime();
 }
 
 void Map::EIO_AfterRenderVectorTile(uv_work_t* req)
@@ -1522,11 +1977,18 @@ void Map::EIO_AfterRenderVectorTile(uv_work_t* req)
 
     vector_tile_baton_t *closure = static_cast<vector_tile_baton_t *>(req->data);
 
+    // the map and tile are free again by the time the callback runs
+    closure->m->release();
+    closure->d->end_write();
+
     TryCatch try_catch;
 
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name, closure->error_code) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    } else if (closure->stats) {
+        Local<Value> argv[3] = { Local<Value>::New(Null()), Local<Value>::New(closure->d->handle_), node_mapnik::render_stats_object(*closure->stats) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 3, argv);
     } else {
         Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(closure->d->handle_) };
         closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
@@ -1536,53 +1998,170 @@ void Map::EIO_AfterRenderVectorTile(uv_work_t* req)
         node::FatalException(try_catch);
     }
 
-    closure->m->release();
+    closure->m->dispatch_next();
+
     closure->m->Unref();
     closure->d->_unref();
     closure->cb.Dispose();
     delete closure;
 }
 
-void Map::EIO_RenderGrid(uv_work_t* req)
+// feature_style_processor::apply over layers (the map's or copies of
+// them), checking the token before each layer so a cancelled or timed out
+// render stops without drawing the rest of the map, and timing each layer
+// when stats are collected
+template <typename Renderer>
+static void apply_layers(Renderer & ren,
+                         mapnik::Map const& map,
+                         std::vector<mapnik::layer> const& layers,
+                         double scale_factor,
+                         double scale_denom,
+                         node_mapnik::cancel_token const& cancel,
+                         node_mapnik::render_stats * stats)
 {
-
-    grid_baton_t *closure = static_cast<grid_baton_t *>(req->data);
-
-    std::vector<mapnik::layer> const& layers = closure->m->map_->layers();
-
-    try
+    mapnik::projection proj(map.srs(),true);
+    if (scale_denom <= 0.0)
     {
-        // copy property names
-        std::set<std::string> attributes = closure->g->get()->property_names();
-
-        // todo - make this a static constant
-        std::string known_id_key = "__id__";
-        if (attributes.find(known_id_key) != attributes.end())
+        scale_denom = mapnik::scale_denominator(map.scale(),proj.is_geographic());
+    }
+    scale_denom *= scale_factor;
+    ren.start_map_processing(map);
+    for (std::size_t i = 0; i < layers.size(); ++i)
+    {
+        cancel.check();
+        mapnik::layer const& lyr = layers[i];
+        if (lyr.visible(scale_denom))
         {
-            attributes.erase(known_id_key);
+            uint64_t start = stats ? uv_hrtime() : 0;
+            std::set<std::string> names;
+            ren.apply_to_layer(lyr,
+                               ren,
+                               proj,
+                               map.scale(),
+                               scale_denom,
+                               map.width(),
+                               map.height(),
+                               map.get_current_extent(),
+                               map.buffer_size(),
+                               names);
+            if (stats) stats->layers[i].time += uv_hrtime() - start;
         }
+    }
+    ren.end_map_processing(map);
+}
 
-        std::string join_field = closure->g->get()->get_key();
-        if (known_id_key != join_field &&
-            attributes.find(join_field) == attributes.end())
+// the attributes to query for a grid layer: its fields plus the grid key
+static std::set<std::string> grid_layer_attributes(grid_layer_t const& gl,
+                                                   std::string const& join_field)
+{
+    // todo - make this a static constant
+    std::string known_id_key = "__id__";
+    std::set<std::string> attributes = gl.fields;
+    attributes.erase(known_id_key);
+    if (known_id_key != join_field)
+    {
+        attributes.insert(join_field);
+    }
+    return attributes;
+}
+
+// grid_renderer::apply(layer, ...) for each of grid_layers (indexes into
+// layers), sharing one start/end of the map so they draw into one grid
+static void render_grid_layers(mapnik::grid & grid,
+                               mapnik::Map const& map,
+                               std::vector<mapnik::layer> const& layers,
+                               std::vector<grid_layer_t> const& grid_layers,
+                               double scale_factor,
+                               unsigned offset_x,
+                               unsigned offset_y,
+                               double scale_denom,
+                               node_mapnik::cancel_token const& cancel,
+                               node_mapnik::render_stats * stats)
+{
+    mapnik::grid_renderer<mapnik::grid> ren(map,
+                                            grid,
+                                            scale_factor,
+                                            offset_x,
+                                            offset_y);
+    mapnik::projection proj(map.srs(),true);
+    if (scale_denom <= 0.0)
+    {
+        scale_denom = mapnik::scale_denominator(map.scale(),proj.is_geographic());
+    }
+    scale_denom *= scale_factor;
+    ren.start_map_processing(map);
+    BOOST_FOREACH ( grid_layer_t const& gl, grid_layers )
+    {
+        cancel.check();
+        mapnik::layer const& layer = layers[gl.idx];
+        if (!layer.visible(scale_denom))
         {
-            attributes.insert(join_field);
+            continue;
         }
+        uint64_t start = stats ? uv_hrtime() : 0;
+        std::set<std::string> attributes = grid_layer_attributes(gl,grid.get_key());
+        ren.apply_to_layer(layer,
+                           ren,
+                           proj,
+                           map.scale(),
+                           scale_denom,
+                           map.width(),
+                           map.height(),
+                           map.get_current_extent(),
+                           map.buffer_size(),
+                           attributes);
+        if (stats) stats->layers[gl.idx].time += uv_hrtime() - start;
+    }
+    ren.end_map_processing(map);
+}
+
+void Map::EIO_RenderGrid(uv_work_t* req)
+{
 
-        mapnik::grid_renderer<mapnik::grid> ren(*closure->m->map_,
-                                                *closure->g->get(),
-                                                closure->scale_factor,
-                                                closure->offset_x,
-                                                closure->offset_y);
-        mapnik::layer const& layer = layers[closure->layer_idx];
-        ren.apply(layer,attributes,closure->scale_denominator);
+    grid_baton_t *closure = static_cast<grid_baton_t *>(req->data);
+    if (closure->stats) closure->stats->started_at = uv_hrtime();
 
+    try
+    {
+        closure->cancel.check();
+        mapnik::Map const& map = *closure->map;
+        bool wrapped = closure->stats || closure->cancel.active();
+        std::vector<mapnik::layer> layers;
+        if (wrapped)
+        {
+            layers = map.layers();
+            if (closure->stats)
+            {
+                node_mapnik::instrument_layers(layers,*closure->stats);
+            }
+            if (closure->cancel.active())
+            {
+                node_mapnik::cancel_layers(layers,closure->cancel);
+            }
+        }
+        render_grid_layers(*closure->g->get(),
+                           map,
+                           wrapped ? layers : map.layers(),
+                           closure->layers,
+                           closure->scale_factor,
+                           closure->offset_x,
+                           closure->offset_y,
+                           closure->scale_denominator,
+                           closure->cancel,
+                           closure->stats.get());
+    }
+    catch (node_mapnik::job_cancelled const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+        closure->error_code = ex.code();
     }
     catch (std::exception const& ex)
     {
         closure->error = true;
         closure->error_name = ex.what();
     }
+    if (closure->stats) closure->stats->finished_at = uv_hrtime();
 }
 
 
@@ -1592,13 +2171,19 @@ void Map::EIO_AfterRenderGrid(uv_work_t* req)
 
     grid_baton_t *closure = static_cast<grid_baton_t *>(req->data);
 
+    // the map is free again by the time the callback runs
+    closure->m->release();
+
     TryCatch try_catch;
 
     if (closure->error) {
         // TODO - add more attributes
         // https://developer.mozilla.org/en/JavaScript/Reference/Global_Objects/Error
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name, closure->error_code) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    } else if (closure->stats) {
+        Local<Value> argv[3] = { Local<Value>::New(Null()), Local<Value>::New(closure->g->handle_), node_mapnik::render_stats_object(*closure->stats) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 3, argv);
     } else {
         Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(closure->g->handle_) };
         closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
@@ -1608,7 +2193,8 @@ void Map::EIO_AfterRenderGrid(uv_work_t* req)
         node::FatalException(try_catch);
     }
 
-    closure->m->release();
+    closure->m->dispatch_next();
+
     closure->m->Unref();
     closure->g->_unref();
     closure->cb.Dispose();
@@ -1618,21 +2204,97 @@ void Map::EIO_AfterRenderGrid(uv_work_t* req)
 void Map::EIO_RenderImage(uv_work_t* req)
 {
     image_baton_t *closure = static_cast<image_baton_t *>(req->data);
+    if (closure->stats) closure->stats->started_at = uv_hrtime();
 
     try
     {
-        mapnik::agg_renderer<mapnik::image_32> ren(*closure->m->map_,
-                                                   *closure->im->get(),
+        closure->cancel.check();
+        if (closure->scratch)
+        {
+            // left over from the previous render that used it
+            closure->scratch->clear();
+        }
+        mapnik::image_32 & image = closure->scratch ? *closure->scratch : *closure->im->get();
+        mapnik::agg_renderer<mapnik::image_32> ren(*closure->map,
+                                                   image,
                                                    closure->scale_factor,
                                                    closure->offset_x,
                                                    closure->offset_y);
-        ren.apply(closure->scale_denominator);
+        mapnik::Map const& map = *closure->map;
+        if (closure->stats || closure->g || closure->cancel.active())
+        {
+            std::vector<mapnik::layer> layers(map.layers());
+            if (closure->stats)
+            {
+                node_mapnik::instrument_layers(layers,*closure->stats);
+            }
+            if (closure->cancel.active())
+            {
+                node_mapnik::cancel_layers(layers,closure->cancel);
+            }
+            if (closure->g)
+            {
+                // the layers drawn into the grid query their datasource
+                // once for both renderers
+                BOOST_FOREACH ( grid_layer_t const& gl, closure->grid_layers )
+                {
+                    mapnik::layer & lyr = layers[gl.idx];
+                    if (lyr.datasource())
+                    {
+                        std::set<std::string> attributes = grid_layer_attributes(gl,closure->g->get()->get_key());
+                        lyr.set_datasource(MAPNIK_MAKE_SHARED<node_mapnik::shared_query_datasource>(lyr.datasource(),attributes));
+                    }
+                }
+            }
+            apply_layers(ren,
+                         map,
+                         layers,
+                         closure->scale_factor,
+                         closure->scale_denominator,
+                         closure->cancel,
+                         closure->stats.get());
+            if (closure->g)
+            {
+                render_grid_layers(*closure->g->get(),
+                                   map,
+                                   layers,
+                                   closure->grid_layers,
+                                   closure->scale_factor,
+                                   closure->offset_x,
+                                   closure->offset_y,
+                                   closure->scale_denominator,
+                                   closure->cancel,
+                                   closure->stats.get());
+            }
+        }
+        else
+        {
+            ren.apply(closure->scale_denominator);
+        }
+        if (closure->scratch)
+        {
+            if (closure->encoding.palette.get())
+            {
+                closure->result = save_to_string(image, closure->encoding.format, *closure->encoding.palette);
+            }
+            else
+            {
+                closure->result = save_to_string(image, closure->encoding.format);
+            }
+        }
+    }
+    catch (node_mapnik::job_cancelled const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+        closure->error_code = ex.code();
     }
     catch (std::exception const& ex)
     {
         closure->error = true;
         closure->error_name = ex.what();
     }
+    if (closure->stats) closure->stats->finished_at = uv_hrtime();
 }
 
 void Map::EIO_AfterRenderImage(uv_work_t* req)
@@ -1641,23 +2303,62 @@ void Map::EIO_AfterRenderImage(uv_work_t* req)
 
     image_baton_t *closure = static_cast<image_baton_t *>(req->data);
 
+    // the map is free again by the time the callback runs
+    closure->m->release();
+
     TryCatch try_catch;
 
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name, closure->error_code) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    } else if (closure->metatile > 0) {
+        node_mapnik::queue_metatile_encode(closure->im, closure->metatile, closure->encoding, closure->cb);
     } else {
-        Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(closure->im->handle_) };
-        closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+        // (err, image|buffer, [grid], [stats])
+        Local<Value> argv[4];
+        int argc = 0;
+        argv[argc++] = Local<Value>::New(Null());
+        if (closure->scratch) {
+            #if NODE_VERSION_AT_LEAST(0, 11, 0)
+            argv[argc++] = Local<Value>::New(node::Buffer::New((char*)closure->result.data(),closure->result.size()));
+            #else
+            argv[argc++] = Local<Value>::New(node::Buffer::New((char*)closure->result.data(),closure->result.size())->handle_);
+            #endif
+        } else {
+            argv[argc++] = Local<Value>::New(closure->im->handle_);
+        }
+        if (closure->g) {
+            argv[argc++] = Local<Value>::New(closure->g->handle_);
+        }
+        if (closure->stats) {
+            argv[argc++] = node_mapnik::render_stats_object(*closure->stats);
+        }
+        closure->cb->Call(Context::GetCurrent()->Global(), argc, argv);
     }
 
     if (try_catch.HasCaught()) {
         node::FatalException(try_catch);
     }
 
-    closure->m->release();
+    if (closure->cache)
+    {
+        if (closure->error)
+        {
+            closure->cache->fail(closure->cache_key, closure->cache_leader, closure->error_name, closure->error_code);
+        }
+        else
+        {
+            closure->cache->finish(closure->cache_key, closure->cache_leader, closure->result);
+        }
+        closure->cache->_unref();
+    }
+
+    closure->m->dispatch_next();
+
     closure->m->Unref();
-    closure->im->_unref();
+    if (closure->scratch) node_mapnik::release_scratch_image(closure->scratch);
+    if (closure->im) closure->im->_unref();
+    if (closure->g) closure->g->_unref();
     closure->cb.Dispose();
     delete closure;
 }
@@ -1665,6 +2366,7 @@ void Map::EIO_AfterRenderImage(uv_work_t* req)
 typedef struct {
     uv_work_t request;
     Map *m;
+    map_ptr map; // the map as it was when renderFile was called
     std::string format;
     std::string output;
     palette_ptr palette;
@@ -1747,6 +2449,14 @@ Handle<Value> Map::renderFile(const Arguments& args)
     Map* m = node::ObjectWrap::Unwrap<Map>(args.This());
     std::string output = TOSTR(args[0]);
 
+    if (m->render_queue_full()) {
+        std::ostringstream s;
+        s << "renderFile: the render queue of this map is full ("
+          << m->queued()
+          << " renders waiting), raise map.renderQueueLimit or use a mapnik.MapPool";
+        return ThrowException(Exception::Error(String::New(s.str().c_str())));
+    }
+
     //maybe do this in the async part?
     if (format.empty()) {
         format = mapnik::guess_type(output);
@@ -1777,6 +2487,7 @@ Handle<Value> Map::renderFile(const Arguments& args)
     closure->request.data = closure;
 
     closure->m = m;
+    closure->map = m->get();
     closure->scale_factor = scale_factor;
     closure->scale_denominator = scale_denominator;
     closure->error = false;
@@ -1786,7 +2497,7 @@ Handle<Value> Map::renderFile(const Arguments& args)
     closure->palette = palette;
     closure->output = output;
 
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_RenderFile, (uv_after_work_cb)EIO_AfterRenderFile);
+    m->queue_render(&closure->request, EIO_RenderFile, (uv_after_work_cb)EIO_AfterRenderFile, "render-file");
     m->Ref();
 
     return Undefined();
@@ -1804,12 +2515,12 @@ void Map::EIO_RenderFile(uv_work_t* req)
 #if defined(HAVE_CAIRO)
 #if MAPNIK_VERSION > 200200
             // https://github.com/mapnik/mapnik/issues/1930
-            mapnik::save_to_cairo_file(*closure->m->map_,closure->output,closure->format,closure->scale_factor,closure->scale_denominator);
+            mapnik::save_to_cairo_file(*closure->map,closure->output,closure->format,closure->scale_factor,closure->scale_denominator);
 #else
 #if MAPNIK_VERSION >= 200100
-            mapnik::save_to_cairo_file(*closure->m->map_,closure->output,closure->format,closure->scale_factor);
+            mapnik::save_to_cairo_file(*closure->map,closure->output,closure->format,closure->scale_factor);
 #else
-            mapnik::save_to_cairo_file(*closure->m->map_,closure->output,closure->format);
+            mapnik::save_to_cairo_file(*closure->map,closure->output,closure->format);
 #endif
 #endif
 #else
@@ -1817,8 +2528,8 @@ void Map::EIO_RenderFile(uv_work_t* req)
         }
         else
         {
-            mapnik::image_32 im(closure->m->map_->width(),closure->m->map_->height());
-            mapnik::agg_renderer<mapnik::image_32> ren(*closure->m->map_,im,closure->scale_factor);
+            mapnik::image_32 im(closure->map->width(),closure->map->height());
+            mapnik::agg_renderer<mapnik::image_32> ren(*closure->map,im,closure->scale_factor);
             ren.apply(closure->scale_denominator);
 
             if (closure->palette.get()) {
@@ -1841,10 +2552,13 @@ void Map::EIO_AfterRenderFile(uv_work_t* req)
 
     render_file_baton_t *closure = static_cast<render_file_baton_t *>(req->data);
 
+    // the map is free again by the time the callback runs
+    closure->m->release();
+
     TryCatch try_catch;
 
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(),1, argv);
     } else {
         Local<Value> argv[1] = { Local<Value>::New(Null()) };
@@ -1855,7 +2569,8 @@ void Map::EIO_AfterRenderFile(uv_work_t* req)
         node::FatalException(try_catch);
     }
 
-    closure->m->release();
+    closure->m->dispatch_next();
+
     closure->m->Unref();
     closure->cb.Dispose();
     delete closure;
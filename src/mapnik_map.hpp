@@ -8,6 +8,10 @@
 // boost
 #include MAPNIK_SHARED_INCLUDE
 
+// stl
+#include <deque>
+#include <string>
+
 
 using namespace v8;
 
@@ -21,6 +25,8 @@ public:
     static Persistent<FunctionTemplate> constructor;
     static void Initialize(Handle<Object> target);
     static Handle<Value> New(const Arguments &args);
+    // wraps a copy of map_ref: styles and layers are copied, datasources shared
+    static Handle<Value> New(mapnik::Map const& map_ref);
 
     static Handle<Value> loadSync(const Arguments &args);
     static Handle<Value> load(const Arguments &args);
@@ -76,19 +82,51 @@ public:
 
     Map(int width, int height);
     Map(int width, int height, std::string const& srs);
+    Map();
 
     void acquire();
     void release();
     int active() const;
+    // renders on a map run one at a time: a render queued while another is
+    // in flight waits until dispatch_next() finds the map free again
+    void queue_render(uv_work_t* req, uv_work_cb work, uv_after_work_cb after, std::string const& op);
+    void dispatch_next();
+    bool render_queue_full() const;
+    std::size_t queued() const { return render_queue_.size(); }
+    // changes whenever the layers, styles, srs, background, maximum extent or
+    // parameters may have changed. Maps with the same stamp differ at most in
+    // size, extent and buffer size.
+    void layers_changed();
+    unsigned long layers_stamp() const { return layers_stamp_; }
+    // maps cloned from the same template share a stamp until they change
+    void set_layers_stamp(unsigned long stamp) { layers_stamp_ = stamp; }
+    static unsigned long new_layers_stamp() { return ++next_layers_stamp_; }
     void _ref() { Ref(); }
     void _unref() { Unref(); }
 
     inline map_ptr get() { return map_; }
+    // the map to change in place. Async jobs keep the map_ptr they were
+    // started with, so while one holds it the change goes to a copy.
+    mapnik::Map & mutable_map();
+    // shares map instead of holding a copy; the first change copies it
+    void share(map_ptr const& map) { map_ = map; }
 
 private:
+    struct queued_render {
+        uv_work_t* req;
+        uv_work_cb work;
+        uv_after_work_cb after;
+        std::string op;
+        uint64_t queued_at; // counted in the job's queue wait
+    };
+
     ~Map();
     map_ptr map_;
     int in_use_;
+    std::deque<queued_render> render_queue_;
+    int render_queue_limit_; // renders allowed to wait, -1 for no limit
+    unsigned long layers_stamp_;
+    static unsigned long next_layers_stamp_;
 };
 
 #endif
@@ -0,0 +1,317 @@
+#include "mapnik_map_pool.hpp"
+#include "mapnik_map.hpp"
+#include "worker_pool.hpp"
+#include "utils.hpp"
+
+// node
+#include <node.h>
+
+// mapnik
+#include <mapnik/map.hpp>               // for Map
+#include <mapnik/load_map.hpp>          // for load_map
+#include <mapnik/version.hpp>           // for MAPNIK_VERSION
+
+// boost
+#include MAPNIK_MAKE_SHARED_INCLUDE
+#include <boost/foreach.hpp>
+
+// stl
+#include <algorithm>
+#include <exception>
+#include <sstream>
+
+Persistent<FunctionTemplate> MapPool::constructor;
+
+void MapPool::Initialize(Handle<Object> target) {
+
+    HandleScope scope;
+
+    constructor = Persistent<FunctionTemplate>::New(FunctionTemplate::New(MapPool::New));
+    constructor->InstanceTemplate()->SetInternalFieldCount(1);
+    constructor->SetClassName(String::NewSymbol("MapPool"));
+
+    NODE_SET_PROTOTYPE_METHOD(constructor, "acquire", acquire);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "release", release);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "stats", stats);
+
+    target->Set(String::NewSymbol("MapPool"),constructor->GetFunction());
+}
+
+MapPool::MapPool(std::size_t size, map_ptr const& map) :
+    ObjectWrap(),
+    size_(size),
+    template_(map),
+    layers_stamp_(Map::new_layers_stamp()),
+    maps_(),
+    idle_(),
+    waiting_() {}
+
+MapPool::~MapPool()
+{
+    BOOST_FOREACH ( Map * m, maps_ )
+    {
+        m->_unref();
+    }
+    for (std::size_t i = 0; i < waiting_.size(); ++i)
+    {
+        waiting_[i].Dispose();
+    }
+}
+
+Handle<Value> MapPool::New(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (!args.IsConstructCall())
+        return ThrowException(String::New("Cannot call constructor as function, you need to use 'new' keyword"));
+
+    if (args.Length() < 2 || !args[0]->IsNumber() || args[0]->IntegerValue() < 1)
+        return ThrowException(Exception::TypeError(
+                                  String::New("first argument must be the number of maps in the pool")));
+
+    if (!args[1]->IsString())
+        return ThrowException(Exception::TypeError(
+                                  String::New("second argument must be a path to a mapnik stylesheet")));
+
+    std::size_t size = args[0]->IntegerValue();
+    std::string stylesheet = TOSTR(args[1]);
+    unsigned width = 256;
+    unsigned height = 256;
+    bool strict = false;
+    std::string base_path;
+
+    if (args.Length() > 2)
+    {
+        if (!args[2]->IsObject())
+            return ThrowException(Exception::TypeError(
+                                      String::New("optional third argument must be an options object")));
+
+        Local<Object> options = args[2]->ToObject();
+
+        if (options->Has(String::New("width")))
+        {
+            Local<Value> param_val = options->Get(String::New("width"));
+            if (!param_val->IsNumber())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'width' must be an integer")));
+            width = param_val->IntegerValue();
+        }
+
+        if (options->Has(String::New("height")))
+        {
+            Local<Value> param_val = options->Get(String::New("height"));
+            if (!param_val->IsNumber())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'height' must be an integer")));
+            height = param_val->IntegerValue();
+        }
+
+        if (options->Has(String::New("strict")))
+        {
+            Local<Value> param_val = options->Get(String::New("strict"));
+            if (!param_val->IsBoolean())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'strict' must be a Boolean")));
+            strict = param_val->BooleanValue();
+        }
+
+        if (options->Has(String::New("base")))
+        {
+            Local<Value> param_val = options->Get(String::New("base"));
+            if (!param_val->IsString())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'base' must be a string representing a filesystem path")));
+            base_path = TOSTR(param_val);
+        }
+    }
+
+    try
+    {
+        map_ptr map = MAPNIK_MAKE_SHARED<mapnik::Map>(width,height);
+#if MAPNIK_VERSION >= 200200
+        mapnik::load_map(*map,stylesheet,strict,base_path);
+#else
+        mapnik::load_map(*map,stylesheet,strict);
+#endif
+        MapPool* p = new MapPool(size,map);
+        p->Wrap(args.This());
+        return args.This();
+    }
+    catch (std::exception const& ex)
+    {
+        return ThrowException(Exception::Error(
+                                  String::New(ex.what())));
+    }
+    return Undefined();
+}
+
+// an idle map, a new clone while the pool is not full, or NULL
+Map * MapPool::checkout()
+{
+    if (!idle_.empty())
+    {
+        Map * m = idle_.front();
+        idle_.pop_front();
+        return m;
+    }
+    if (maps_.size() < size_)
+    {
+        Local<Object> obj = Map::New(*template_)->ToObject();
+        Map * m = node::ObjectWrap::Unwrap<Map>(obj);
+        m->set_layers_stamp(layers_stamp_);
+        m->_ref();
+        maps_.push_back(m);
+        return m;
+    }
+    return NULL;
+}
+
+typedef struct {
+    MapPool * p;
+    Map * m;
+    Persistent<Function> cb;
+} hand_out_baton_t;
+
+// calls cb with m on a later tick, also when m was idle
+void MapPool::hand_out(Map * m, Handle<Function> cb)
+{
+    hand_out_baton_t *closure = new hand_out_baton_t();
+    closure->p = this;
+    closure->m = m;
+    closure->cb = Persistent<Function>::New(cb);
+    node_mapnik::defer(AfterHandOut, closure);
+    Ref();
+}
+
+void MapPool::AfterHandOut(void * data)
+{
+    HandleScope scope;
+
+    hand_out_baton_t *closure = static_cast<hand_out_baton_t *>(data);
+
+    TryCatch try_catch;
+
+    Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(closure->m->handle_) };
+    closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    closure->p->Unref();
+    closure->cb.Dispose();
+    delete closure;
+}
+
+bool MapPool::owns(Map * m) const
+{
+    return std::find(maps_.begin(), maps_.end(), m) != maps_.end();
+}
+
+Handle<Value> MapPool::acquire(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[args.Length()-1]->IsFunction())
+        return ThrowException(Exception::TypeError(
+                                  String::New("last argument must be a callback function")));
+
+    MapPool* p = node::ObjectWrap::Unwrap<MapPool>(args.This());
+    Local<Function> cb = Local<Function>::Cast(args[args.Length()-1]);
+
+    Map * m = p->checkout();
+    if (m)
+    {
+        p->hand_out(m, cb);
+    }
+    else
+    {
+        // called back from release() once a map is free
+        p->waiting_.push_back(Persistent<Function>::New(cb));
+    }
+    return Undefined();
+}
+
+Handle<Value> MapPool::release(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || !args[0]->IsObject())
+        return ThrowException(Exception::TypeError(
+                                  String::New("mapnik.Map expected as first arg")));
+
+    Local<Object> obj = args[0]->ToObject();
+    if (obj->IsNull() || obj->IsUndefined() || !Map::constructor->HasInstance(obj))
+        return ThrowException(Exception::TypeError(String::New("mapnik.Map expected as first arg")));
+
+    MapPool* p = node::ObjectWrap::Unwrap<MapPool>(args.This());
+    Map * m = node::ObjectWrap::Unwrap<Map>(obj);
+
+    if (!p->owns(m))
+        return ThrowException(Exception::TypeError(String::New("map was not acquired from this pool")));
+
+    if (std::find(p->idle_.begin(), p->idle_.end(), m) != p->idle_.end())
+        return ThrowException(Exception::Error(String::New("map has already been released")));
+
+    if (m->active() != 0 || m->queued() != 0)
+    {
+        std::ostringstream s;
+        s << "map is still in use by " << (m->active() + m->queued()) << " render(s) and cannot be released yet";
+        return ThrowException(Exception::Error(String::New(s.str().c_str())));
+    }
+
+    // the next user starts from the stylesheet as loaded, whatever was
+    // changed on the map
+    if (m->layers_stamp() == p->layers_stamp_)
+    {
+        // only size, extent or buffer size can differ: reset them on the
+        // map's own copy instead of copying the template again on the next
+        // change
+        mapnik::Map const& loaded = *p->template_;
+        if (m->get() != p->template_)
+        {
+            mapnik::Map & map = m->mutable_map();
+            if (map.width() != loaded.width() || map.height() != loaded.height())
+            {
+                map.resize(loaded.width(), loaded.height());
+            }
+            if (!(map.get_current_extent() == loaded.get_current_extent()))
+            {
+                map.zoom_to_box(loaded.get_current_extent());
+            }
+            map.set_buffer_size(loaded.buffer_size());
+        }
+    }
+    else
+    {
+        // the template is shared until the map changes
+        m->share(p->template_);
+        m->set_layers_stamp(p->layers_stamp_);
+    }
+
+    if (!p->waiting_.empty())
+    {
+        Persistent<Function> cb = p->waiting_.front();
+        p->waiting_.pop_front();
+        p->hand_out(m, cb);
+        cb.Dispose();
+    }
+    else
+    {
+        p->idle_.push_back(m);
+    }
+    return Undefined();
+}
+
+Handle<Value> MapPool::stats(const Arguments& args)
+{
+    HandleScope scope;
+
+    MapPool* p = node::ObjectWrap::Unwrap<MapPool>(args.This());
+    Local<Object> stats = Object::New();
+    stats->Set(String::NewSymbol("size"), Number::New(p->size_));
+    stats->Set(String::NewSymbol("created"), Number::New(p->maps_.size()));
+    stats->Set(String::NewSymbol("idle"), Number::New(p->idle_.size()));
+    stats->Set(String::NewSymbol("waiting"), Number::New(p->waiting_.size()));
+    return scope.Close(stats);
+}
@@ -0,0 +1,47 @@
+#ifndef __NODE_MAPNIK_MAP_POOL_H__
+#define __NODE_MAPNIK_MAP_POOL_H__
+
+#include <v8.h>
+#include <node_object_wrap.h>
+#include "mapnik3x_compatibility.hpp"
+#include "mapnik_map.hpp"               // for map_ptr
+
+// stl
+#include <deque>
+#include <vector>
+
+using namespace v8;
+
+class Map;
+
+// a fixed number of maps cloned from one loaded stylesheet. Clones copy the
+// styles and layers of the template but share its datasources and fonts,
+// so the stylesheet is parsed and the datasources opened only once.
+class MapPool: public node::ObjectWrap {
+public:
+    static Persistent<FunctionTemplate> constructor;
+    static void Initialize(Handle<Object> target);
+    static Handle<Value> New(const Arguments &args);
+
+    static Handle<Value> acquire(const Arguments &args);
+    static Handle<Value> release(const Arguments &args);
+    static Handle<Value> stats(const Arguments &args);
+
+    MapPool(std::size_t size, map_ptr const& map);
+
+private:
+    ~MapPool();
+    Map * checkout();
+    void hand_out(Map * m, Handle<Function> cb);
+    static void AfterHandOut(void * data);
+    bool owns(Map * m) const;
+
+    std::size_t size_;
+    map_ptr template_;
+    unsigned long layers_stamp_; // given to every clone of template_
+    std::vector<Map *> maps_;
+    std::deque<Map *> idle_;
+    std::deque<Persistent<Function> > waiting_;
+};
+
+#endif
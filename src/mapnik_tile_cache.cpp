@@ -0,0 +1,250 @@
+#include "mapnik_tile_cache.hpp"
+#include "worker_pool.hpp"
+#include "job_metrics.hpp"
+#include "utils.hpp"
+
+// node
+#include <node.h>
+#include <node_buffer.h>
+#include <node_version.h>
+
+Persistent<FunctionTemplate> TileCache::constructor;
+
+void TileCache::Initialize(Handle<Object> target) {
+
+    HandleScope scope;
+
+    constructor = Persistent<FunctionTemplate>::New(FunctionTemplate::New(TileCache::New));
+    constructor->InstanceTemplate()->SetInternalFieldCount(1);
+    constructor->SetClassName(String::NewSymbol("TileCache"));
+
+    NODE_SET_PROTOTYPE_METHOD(constructor, "stats", stats);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "clear", clear);
+
+    target->Set(String::NewSymbol("TileCache"),constructor->GetFunction());
+}
+
+TileCache::TileCache(std::size_t max_bytes) :
+    ObjectWrap(),
+    max_bytes_(max_bytes),
+    bytes_(0),
+    lru_(),
+    index_(),
+    inflight_(),
+    hits_(0),
+    misses_(0),
+    evictions_(0),
+    coalesced_(0) {}
+
+TileCache::~TileCache()
+{
+    // renders in flight hold a reference, so nobody can be waiting here
+}
+
+Handle<Value> TileCache::New(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (!args.IsConstructCall())
+        return ThrowException(String::New("Cannot call constructor as function, you need to use 'new' keyword"));
+
+    if (args.Length() < 1 || !args[0]->IsNumber() || args[0]->NumberValue() < 1)
+        return ThrowException(Exception::TypeError(
+                                  String::New("first argument must be the maximum number of bytes to cache")));
+
+    TileCache* c = new TileCache(static_cast<std::size_t>(args[0]->NumberValue()));
+    c->Wrap(args.This());
+    return args.This();
+}
+
+typedef struct {
+    std::string data;
+    Persistent<Function> cb;
+} serve_baton_t;
+
+bool TileCache::serve(std::string const& key, Handle<Function> cb)
+{
+    std::map<std::string, entry_list::iterator>::iterator itr = index_.find(key);
+    if (itr == index_.end())
+    {
+        return false;
+    }
+    // move to the front
+    lru_.splice(lru_.begin(), lru_, itr->second);
+    ++hits_;
+    serve_baton_t *closure = new serve_baton_t();
+    closure->data = itr->second->data;
+    closure->cb = Persistent<Function>::New(cb);
+    // a hit calls back asynchronously like a render does, but it has
+    // no work for the pool and is not a job in mapnik.metrics()
+    node_mapnik::defer(AfterServe, closure);
+    return true;
+}
+
+void TileCache::AfterServe(void * data)
+{
+    HandleScope scope;
+
+    serve_baton_t *closure = static_cast<serve_baton_t *>(data);
+
+    TryCatch try_catch;
+
+    #if NODE_VERSION_AT_LEAST(0, 11, 0)
+    Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(node::Buffer::New((char*)closure->data.data(),closure->data.size())) };
+    #else
+    Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(node::Buffer::New((char*)closure->data.data(),closure->data.size())->handle_) };
+    #endif
+    closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    closure->cb.Dispose();
+    delete closure;
+}
+
+bool TileCache::join(std::string const& key, Handle<Function> cb)
+{
+    std::map<std::string, waiter_list>::iterator itr = inflight_.find(key);
+    if (itr == inflight_.end())
+    {
+        return false;
+    }
+    ++coalesced_;
+    itr->second.push_back(Persistent<Function>::New(cb));
+    return true;
+}
+
+void TileCache::begin(std::string const& key, bool leader)
+{
+    ++misses_;
+    if (leader)
+    {
+        inflight_[key];
+    }
+}
+
+void TileCache::finish(std::string const& key,
+                       bool leader,
+                       std::string const& data)
+{
+    store(key, data);
+    if (!leader)
+    {
+        return;
+    }
+    std::map<std::string, waiter_list>::iterator itr = inflight_.find(key);
+    if (itr == inflight_.end())
+    {
+        return;
+    }
+    waiter_list waiters;
+    waiters.swap(itr->second);
+    inflight_.erase(itr);
+    for (std::size_t i = 0; i < waiters.size(); ++i)
+    {
+        TryCatch try_catch;
+        #if NODE_VERSION_AT_LEAST(0, 11, 0)
+        Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(node::Buffer::New((char*)data.data(),data.size())) };
+        #else
+        Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(node::Buffer::New((char*)data.data(),data.size())->handle_) };
+        #endif
+        waiters[i]->Call(Context::GetCurrent()->Global(), 2, argv);
+        if (try_catch.HasCaught()) {
+            node::FatalException(try_catch);
+        }
+        waiters[i].Dispose();
+    }
+}
+
+void TileCache::fail(std::string const& key,
+                     bool leader,
+                     std::string const& message,
+                     std::string const& code)
+{
+    if (!leader)
+    {
+        return;
+    }
+    std::map<std::string, waiter_list>::iterator itr = inflight_.find(key);
+    if (itr == inflight_.end())
+    {
+        return;
+    }
+    waiter_list waiters;
+    waiters.swap(itr->second);
+    inflight_.erase(itr);
+    for (std::size_t i = 0; i < waiters.size(); ++i)
+    {
+        TryCatch try_catch;
+        Local<Value> argv[1] = { node_mapnik::job_error(message, code) };
+        waiters[i]->Call(Context::GetCurrent()->Global(), 1, argv);
+        if (try_catch.HasCaught()) {
+            node::FatalException(try_catch);
+        }
+        waiters[i].Dispose();
+    }
+}
+
+void TileCache::store(std::string const& key,
+                      std::string const& data)
+{
+    if (index_.find(key) != index_.end())
+    {
+        return;
+    }
+    entry e;
+    e.key = key;
+    e.data = data;
+    std::size_t size = cost(e);
+    if (size > max_bytes_)
+    {
+        return;
+    }
+    while (bytes_ + size > max_bytes_)
+    {
+        drop_lru();
+    }
+    lru_.push_front(e);
+    index_[key] = lru_.begin();
+    bytes_ += size;
+}
+
+void TileCache::drop_lru()
+{
+    entry const& e = lru_.back();
+    bytes_ -= cost(e);
+    index_.erase(e.key);
+    lru_.pop_back();
+    ++evictions_;
+}
+
+Handle<Value> TileCache::stats(const Arguments& args)
+{
+    HandleScope scope;
+
+    TileCache* c = node::ObjectWrap::Unwrap<TileCache>(args.This());
+    Local<Object> stats = Object::New();
+    stats->Set(String::NewSymbol("hits"), Number::New(c->hits_));
+    stats->Set(String::NewSymbol("misses"), Number::New(c->misses_));
+    stats->Set(String::NewSymbol("evictions"), Number::New(c->evictions_));
+    stats->Set(String::NewSymbol("coalesced"), Number::New(c->coalesced_));
+    stats->Set(String::NewSymbol("count"), Number::New(c->lru_.size()));
+    stats->Set(String::NewSymbol("bytes"), Number::New(c->bytes_));
+    stats->Set(String::NewSymbol("maxBytes"), Number::New(c->max_bytes_));
+    stats->Set(String::NewSymbol("inflight"), Number::New(c->inflight_.size()));
+    return scope.Close(stats);
+}
+
+// drops the cached tiles; renders in flight still call back their waiters
+Handle<Value> TileCache::clear(const Arguments& args)
+{
+    HandleScope scope;
+
+    TileCache* c = node::ObjectWrap::Unwrap<TileCache>(args.This());
+    c->lru_.clear();
+    c->index_.clear();
+    c->bytes_ = 0;
+    return Undefined();
+}
@@ -0,0 +1,74 @@
+#ifndef __NODE_MAPNIK_TILE_CACHE_H__
+#define __NODE_MAPNIK_TILE_CACHE_H__
+
+#include <v8.h>
+#include <uv.h>
+#include <node_object_wrap.h>
+#include "mapnik3x_compatibility.hpp"
+
+// stl
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace v8;
+
+// encoded tiles from Map.render({format, cache}), keyed by everything that
+// goes into the render, evicted least recently used first once the cached
+// bytes exceed the budget. Identical renders requested while one is in
+// flight wait for its result instead of rendering again.
+class TileCache: public node::ObjectWrap {
+public:
+    static Persistent<FunctionTemplate> constructor;
+    static void Initialize(Handle<Object> target);
+    static Handle<Value> New(const Arguments &args);
+    static Handle<Value> stats(const Arguments &args);
+    static Handle<Value> clear(const Arguments &args);
+    static void AfterServe(void * data);
+
+    explicit TileCache(std::size_t max_bytes);
+
+    // calls cb(null, buffer) on a later tick if key is cached
+    bool serve(std::string const& key, Handle<Function> cb);
+    // calls cb with the result of the render of key in flight, if any
+    bool join(std::string const& key, Handle<Function> cb);
+    // counts a miss; a leader's render is joined by identical requests
+    void begin(std::string const& key, bool leader);
+    // stores a finished render and calls back everyone who joined it
+    void finish(std::string const& key,
+                bool leader,
+                std::string const& data);
+    void fail(std::string const& key,
+              bool leader,
+              std::string const& message,
+              std::string const& code);
+    void _ref() { Ref(); }
+    void _unref() { Unref(); }
+
+private:
+    struct entry {
+        std::string key;
+        std::string data;
+    };
+    typedef std::list<entry> entry_list;
+    typedef std::vector<Persistent<Function> > waiter_list;
+
+    ~TileCache();
+    void store(std::string const& key,
+               std::string const& data);
+    void drop_lru();
+    static std::size_t cost(entry const& e) { return e.key.size() + e.data.size(); }
+
+    std::size_t max_bytes_;
+    std::size_t bytes_;
+    entry_list lru_; // most recently used first
+    std::map<std::string, entry_list::iterator> index_;
+    std::map<std::string, waiter_list> inflight_;
+    unsigned long hits_;
+    unsigned long misses_;
+    unsigned long evictions_;
+    unsigned long coalesced_;
+};
+
+#endif
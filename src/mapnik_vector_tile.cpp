@@ -31,12 +31,17 @@
 #include <mapnik/graphics.hpp>
 #include <mapnik/feature.hpp>
 #include <mapnik/projection.hpp>
+#include <mapnik/well_known_srs.hpp>   // for lonlat2merc, merc2lonlat
 #include <mapnik/datasource.hpp>
+#include <mapnik/memory_datasource.hpp>
+#include <mapnik/query.hpp>
+#include <mapnik/feature_factory.hpp>
 #include <mapnik/agg_renderer.hpp>      // for agg_renderer
 #include <mapnik/grid/grid.hpp>         // for hit_grid, grid
 #include <mapnik/grid/grid_renderer.hpp>  // for grid_renderer
 #include <mapnik/box2d.hpp>
 #include <mapnik/scale_denominator.hpp>
+#include <mapnik/image_util.hpp>       // for save_to_string
 
 #ifdef HAVE_CAIRO
 #include <mapnik/cairo_renderer.hpp>
@@ -54,7 +59,21 @@
 #include <string>                       // for string, char_traits, etc
 #include <exception>                    // for exception
 #include <vector>                       // for vector
+#include <limits>                       // for numeric_limits
+#include <memory>                       // for auto_ptr
+#include <cstdio>                       // for snprintf
+#include <cstdlib>                      // for strtod
+#include <algorithm>                    // for stable_sort
 #include "pbf.hpp"
+#include "query_index.hpp"
+#include "compression.hpp"
+#include "metatile.hpp"
+#include "scratch_image.hpp"
+#include "worker_pool.hpp"
+#include "job_metrics.hpp"
+#include "mapnik_cancel_signal.hpp"
+#include "render_stats.hpp"
+#include "cancel_datasource.hpp"
 
 template <typename PathType>
 bool _hit_test(PathType & path, double x, double y, double tol)
@@ -131,6 +150,59 @@ bool _hit_test(PathType & path, double x, double y, double tol)
     return false;
 }
 
+// like _hit_test but returns the distance to the hit path, or -1 for no hit
+template <typename PathType>
+double _hit_distance(PathType & path, double x, double y, double tol)
+{
+    double x0 = 0;
+    double y0 = 0;
+    path.rewind(0);
+    MAPNIK_GEOM_TYPE geom_type = static_cast<MAPNIK_GEOM_TYPE>(path.type());
+    switch(geom_type)
+    {
+    case MAPNIK_POINT:
+    {
+        unsigned command = path.vertex(&x0, &y0);
+        if (command == mapnik::SEG_END) return -1;
+        double distance = mapnik::distance(x, y, x0, y0);
+        return distance <= tol ? distance : -1;
+    }
+    case MAPNIK_POLYGON:
+    {
+        return _hit_test(path,x,y,tol) ? 0 : -1;
+    }
+    case MAPNIK_LINESTRING:
+    {
+        double x1 = 0;
+        double y1 = 0;
+        double min_distance = -1;
+        unsigned command = path.vertex(&x0, &y0);
+        if (command == mapnik::SEG_END) return -1;
+        while (mapnik::SEG_END != (command = path.vertex(&x1, &y1)))
+        {
+            if (command == mapnik::SEG_CLOSE) continue;
+            if (command == mapnik::SEG_MOVETO)
+            {
+                x0 = x1;
+                y0 = y1;
+                continue;
+            }
+            double distance = mapnik::point_to_segment_distance(x,y,x0,y0,x1,y1);
+            if (distance < tol && (min_distance < 0 || distance < min_distance))
+            {
+                min_distance = distance;
+            }
+            x0 = x1;
+            y0 = y1;
+        }
+        return min_distance;
+    }
+    default:
+        return -1;
+    }
+    return -1;
+}
+
 Persistent<FunctionTemplate> VectorTile::constructor;
 
 void VectorTile::Initialize(Handle<Object> target) {
@@ -139,6 +211,7 @@ void VectorTile::Initialize(Handle<Object> target) {
     constructor->InstanceTemplate()->SetInternalFieldCount(1);
     constructor->SetClassName(String::NewSymbol("VectorTile"));
     NODE_SET_PROTOTYPE_METHOD(constructor, "render", render);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "renderMany", renderMany);
     NODE_SET_PROTOTYPE_METHOD(constructor, "setData", setData);
     NODE_SET_PROTOTYPE_METHOD(constructor, "setDataSync", setDataSync);
     NODE_SET_PROTOTYPE_METHOD(constructor, "getData", getData);
@@ -146,8 +219,11 @@ void VectorTile::Initialize(Handle<Object> target) {
     NODE_SET_PROTOTYPE_METHOD(constructor, "parseSync", parseSync);
     NODE_SET_PROTOTYPE_METHOD(constructor, "addData", addData);
     NODE_SET_PROTOTYPE_METHOD(constructor, "composite", composite);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "compositeSync", compositeSync);
     NODE_SET_PROTOTYPE_METHOD(constructor, "query", query);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "queryMany", queryMany);
     NODE_SET_PROTOTYPE_METHOD(constructor, "names", names);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "info", info);
     NODE_SET_PROTOTYPE_METHOD(constructor, "toJSON", toJSON);
     NODE_SET_PROTOTYPE_METHOD(constructor, "toGeoJSON", toGeoJSON);
 #ifdef PROTOBUF_FULL
@@ -162,6 +238,7 @@ void VectorTile::Initialize(Handle<Object> target) {
     NODE_SET_PROTOTYPE_METHOD(constructor, "clearSync", clear);
     NODE_SET_PROTOTYPE_METHOD(constructor, "isSolid", isSolid);
     NODE_SET_PROTOTYPE_METHOD(constructor, "isSolidSync", isSolidSync);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "cacheStats", cacheStats);
     target->Set(String::NewSymbol("VectorTile"),constructor->GetFunction());
 }
 
@@ -173,12 +250,80 @@ VectorTile::VectorTile(int z, int x, int y, unsigned w, unsigned h) :
     buffer_(),
     status_(VectorTile::LAZY_DONE),
     tiledata_(),
+    borrowed_buffer_(),
+    borrowed_data_(NULL),
+    borrowed_size_(0),
+    layer_index_(),
+    decoded_layers_(),
+    layer_index_valid_(false),
+    name_index_(),
+    match_cache_(),
+    ds_cache_(),
+    query_index_(),
+    ds_cache_hits_(0),
+    ds_cache_misses_(0),
+    readers_(0),
+    writing_(false),
     width_(w),
     height_(h),
     painted_(false),
-    byte_size_(0) {}
+    byte_size_(0)
+{
+    uv_mutex_init(&layer_mutex_);
+}
+
+VectorTile::~VectorTile()
+{
+    release_buffer();
+    uv_mutex_destroy(&layer_mutex_);
+}
+
+const char * VectorTile::read_blocked() const
+{
+    if (writing_)
+    {
+        return "VectorTile is busy: it cannot be used while an async call is changing it";
+    }
+    return NULL;
+}
+
+const char * VectorTile::write_blocked() const
+{
+    if (writing_ || readers_ > 0)
+    {
+        return "VectorTile is busy: it cannot be changed while async calls are using it";
+    }
+    return NULL;
+}
+
+void VectorTile::borrow_buffer(Handle<Object> obj)
+{
+    release_buffer();
+    buffer_.clear();
+    borrowed_buffer_ = Persistent<Object>::New(obj);
+    borrowed_data_ = node::Buffer::Data(obj);
+    borrowed_size_ = node::Buffer::Length(obj);
+}
+
+void VectorTile::release_buffer()
+{
+    if (!borrowed_buffer_.IsEmpty())
+    {
+        borrowed_buffer_.Dispose();
+        borrowed_buffer_.Clear();
+    }
+    borrowed_data_ = NULL;
+    borrowed_size_ = 0;
+}
 
-VectorTile::~VectorTile() { }
+void VectorTile::detach_buffer()
+{
+    if (borrowed_data_)
+    {
+        buffer_.assign(borrowed_data_,borrowed_size_);
+    }
+    release_buffer();
+}
 
 Handle<Value> VectorTile::New(const Arguments& args)
 {
@@ -211,7 +356,7 @@ Handle<Value> VectorTile::New(const Arguments& args)
 std::vector<std::string> VectorTile::lazy_names()
 {
     std::vector<std::string> names;
-    pbf::message item(buffer_.data(),buffer_.size());
+    pbf::message item(raw_data(),raw_size());
     while (item.next()) {
         if (item.tag == 3) {
             uint64_t len = item.varint();
@@ -231,6 +376,352 @@ std::vector<std::string> VectorTile::lazy_names()
     return names;
 }
 
+void VectorTile::index_layers()
+{
+    clear_layer_index();
+    try
+    {
+        pbf::message item(raw_data(),raw_size());
+        while (item.next()) {
+            if (item.tag == 3) {
+                uint64_t len = item.varint();
+                layer_offset entry;
+                entry.offset = item.getData() - raw_data();
+                entry.length = static_cast<std::size_t>(len);
+                pbf::message layermsg(item.getData(),entry.length);
+                while (layermsg.next()) {
+                    if (layermsg.tag == 1) {
+                        entry.name = layermsg.string();
+                    } else {
+                        layermsg.skip();
+                    }
+                }
+                item.skipBytes(len);
+                layer_index_.push_back(entry);
+            } else {
+                item.skip();
+            }
+        }
+    }
+    catch (std::exception const&)
+    {
+        // not a valid tile: leave the index unusable so that
+        // callers fall back to parse_proto() and report the error
+        clear_layer_index();
+        index_names();
+        return;
+    }
+    decoded_layers_.resize(layer_index_.size());
+    layer_index_valid_ = true;
+    index_names();
+}
+
+void VectorTile::clear_layer_index()
+{
+    layer_index_.clear();
+    decoded_layers_.clear();
+    layer_index_valid_ = false;
+}
+
+std::size_t VectorTile::layers_size() const
+{
+    if (lazy())
+    {
+        return layer_index_.size();
+    }
+    return tiledata_.layers_size();
+}
+
+std::string const& VectorTile::layer_name(std::size_t idx) const
+{
+    if (lazy())
+    {
+        return layer_index_[idx].name;
+    }
+    return tiledata_.layers(idx).name();
+}
+
+// for layers owned by the tile data
+struct null_deleter
+{
+    void operator()(void const*) const {}
+};
+
+VectorTile::layer_ptr VectorTile::get_layer(std::size_t idx)
+{
+    if (!lazy())
+    {
+        return layer_ptr(tiledata_.mutable_layers(idx), null_deleter());
+    }
+    // layers may be requested concurrently from several render jobs
+    uv_mutex_lock(&layer_mutex_);
+    layer_ptr layer = decoded_layers_[idx];
+    if (!layer)
+    {
+        layer_offset const& entry = layer_index_[idx];
+        layer_ptr decoded = MAPNIK_MAKE_SHARED<mapnik::vector::tile_layer>();
+        if (!decoded->ParseFromArray(raw_data() + entry.offset, entry.length))
+        {
+            uv_mutex_unlock(&layer_mutex_);
+            throw std::runtime_error("could not parse layer '" + entry.name + "' as protobuf");
+        }
+        decoded_layers_[idx] = decoded;
+        layer = decoded;
+    }
+    uv_mutex_unlock(&layer_mutex_);
+    return layer;
+}
+
+static const std::vector<std::size_t> no_layers;
+
+void VectorTile::index_names()
+{
+    name_index_.clear();
+    std::size_t layer_num = layers_size();
+    for (std::size_t i=0; i < layer_num; ++i)
+    {
+        name_index_[layer_name(i)].push_back(i);
+    }
+    uv_mutex_lock(&layer_mutex_);
+    match_cache_.clear();
+    ds_cache_.assign(layer_num, cached_datasource());
+    query_index_.assign(layer_num, query_index_ptr());
+    uv_mutex_unlock(&layer_mutex_);
+}
+
+std::vector<std::size_t> const& VectorTile::layers_named(std::string const& name) const
+{
+    layer_name_index::const_iterator itr = name_index_.find(name);
+    if (itr == name_index_.end())
+    {
+        return no_layers;
+    }
+    return itr->second;
+}
+
+static void append_varint(std::string & out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+void VectorTile::write_layers(std::vector<std::string> const& names, std::string & out) const
+{
+    bool raw = lazy();
+    if (!raw && status_ != LAZY_DONE)
+    {
+        // neither the layer index nor the parsed data describe the tile,
+        // and parsing here would change a tile other jobs may be reading
+        throw std::runtime_error("cannot select layers of a tile that is not indexed or parsed: call parse() first");
+    }
+    std::vector<std::size_t> selected;
+    BOOST_FOREACH ( std::string const& name, names )
+    {
+        std::vector<std::size_t> const& idxs = layers_named(name);
+        selected.insert(selected.end(), idxs.begin(), idxs.end());
+    }
+    std::sort(selected.begin(), selected.end());
+    selected.erase(std::unique(selected.begin(), selected.end()), selected.end());
+    std::string encoded;
+    BOOST_FOREACH ( std::size_t idx, selected )
+    {
+        // field 3 (layers), wire type 2 (length delimited)
+        out.push_back(static_cast<char>((3 << 3) | 2));
+        if (raw)
+        {
+            layer_offset const& entry = layer_index_[idx];
+            append_varint(out, entry.length);
+            out.append(raw_data() + entry.offset, entry.length);
+        }
+        else
+        {
+            encoded.clear();
+            if (!tiledata_.layers(idx).SerializeToString(&encoded))
+            {
+                throw std::runtime_error("could not serialize layer " + tiledata_.layers(idx).name());
+            }
+            append_varint(out, encoded.size());
+            out.append(encoded);
+        }
+    }
+}
+
+int VectorTile::find_layer(std::string const& name) const
+{
+    std::vector<std::size_t> const& idxs = layers_named(name);
+    if (idxs.empty())
+    {
+        return -1;
+    }
+    return idxs.front();
+}
+
+VectorTile::layer_matches VectorTile::matched_layers(unsigned long map_stamp,
+                                                     std::vector<mapnik::layer> const& layers)
+{
+    uv_mutex_lock(&layer_mutex_);
+    std::map<unsigned long, layer_matches>::const_iterator itr = match_cache_.find(map_stamp);
+    if (itr != match_cache_.end())
+    {
+        layer_matches matches = itr->second;
+        uv_mutex_unlock(&layer_mutex_);
+        return matches;
+    }
+    uv_mutex_unlock(&layer_mutex_);
+
+    layer_matches matches;
+    for (std::size_t i=0; i < layers.size(); ++i)
+    {
+        BOOST_FOREACH ( std::size_t j, layers_named(layers[i].name()) )
+        {
+            matches.push_back(std::make_pair(i,j));
+        }
+    }
+
+    uv_mutex_lock(&layer_mutex_);
+    // a tile is usually rendered against a handful of styles
+    if (match_cache_.size() >= 16)
+    {
+        match_cache_.clear();
+    }
+    match_cache_[map_stamp] = matches;
+    uv_mutex_unlock(&layer_mutex_);
+    return matches;
+}
+
+// decodes all features of a layer once so that
+// they can be reused by every following render
+static void decode_features(mapnik::vector::tile_layer const& layer,
+                            VectorTile * d,
+                            std::vector<mapnik::feature_ptr> & features)
+{
+    mapnik::vector::tile_datasource ds(layer,
+                                       d->x_,
+                                       d->y_,
+                                       d->z_,
+                                       d->width());
+    double max_coord = std::numeric_limits<double>::max();
+    mapnik::query q(mapnik::box2d<double>(-max_coord,-max_coord,max_coord,max_coord));
+    mapnik::featureset_ptr fs = ds.features(q);
+    if (fs)
+    {
+        mapnik::feature_ptr feature;
+        while ((feature = fs->next()))
+        {
+            features.push_back(feature);
+        }
+    }
+}
+
+static VectorTile::datasource_ptr decode_layer_features(mapnik::vector::tile_layer const& layer,
+                                                        VectorTile * d)
+{
+    std::vector<mapnik::feature_ptr> features;
+    decode_features(layer,d,features);
+    MAPNIK_SHARED_PTR<mapnik::memory_datasource> mem = MAPNIK_MAKE_SHARED<mapnik::memory_datasource>();
+    BOOST_FOREACH ( mapnik::feature_ptr const& feature, features )
+    {
+        mem->push(feature);
+    }
+    return mem;
+}
+
+// deep copy, so that callers can not modify features shared by an index
+static mapnik::feature_ptr copy_feature(node_mapnik::query_index const& index, std::size_t idx)
+{
+    mapnik::feature_ptr const& feature = index.feature(idx);
+    mapnik::feature_ptr copy = mapnik::feature_factory::create(feature->context(),feature->id());
+    mapnik::feature_impl::iterator itr = feature->begin();
+    mapnik::feature_impl::iterator end = feature->end();
+    for ( ;itr!=end; ++itr)
+    {
+        copy->put(MAPNIK_GET<0>(*itr),MAPNIK_GET<1>(*itr));
+    }
+    for (std::size_t p = index.paths_begin(idx); p < index.paths_end(idx); ++p)
+    {
+        node_mapnik::query_index::path_cursor geom = index.path(p);
+        std::auto_ptr<mapnik::geometry_type> path(new mapnik::geometry_type(
+                                                      static_cast<MAPNIK_GEOM_TYPE>(geom.type())));
+        double x = 0;
+        double y = 0;
+        unsigned command;
+        while (mapnik::SEG_END != (command = geom.vertex(&x,&y)))
+        {
+            path->push_vertex(x,y,static_cast<mapnik::CommandType>(command));
+        }
+        copy->add_geometry(path.release());
+    }
+    return copy;
+}
+
+VectorTile::query_index_ptr VectorTile::get_query_index(std::size_t idx)
+{
+    uv_mutex_lock(&layer_mutex_);
+    query_index_ptr index = query_index_[idx];
+    uv_mutex_unlock(&layer_mutex_);
+    if (!index)
+    {
+        std::vector<mapnik::feature_ptr> features;
+        decode_features(*get_layer(idx),this,features);
+        index = MAPNIK_MAKE_SHARED<node_mapnik::query_index>(features);
+        uv_mutex_lock(&layer_mutex_);
+        // another thread may have built it in the meantime
+        if (query_index_[idx]) index = query_index_[idx];
+        else query_index_[idx] = index;
+        uv_mutex_unlock(&layer_mutex_);
+    }
+    return index;
+}
+
+VectorTile::datasource_ptr VectorTile::borrow_datasource(std::size_t idx)
+{
+    uv_mutex_lock(&layer_mutex_);
+    cached_datasource & entry = ds_cache_[idx];
+    if (entry.in_use)
+    {
+        // features keep iteration state so they cannot be shared
+        // between concurrent renders: caller decodes its own copy
+        ++ds_cache_misses_;
+        uv_mutex_unlock(&layer_mutex_);
+        return datasource_ptr();
+    }
+    entry.in_use = true;
+    datasource_ptr ds = entry.ds;
+    if (ds) ++ds_cache_hits_;
+    else ++ds_cache_misses_;
+    uv_mutex_unlock(&layer_mutex_);
+    if (!ds)
+    {
+        try
+        {
+            ds = decode_layer_features(*get_layer(idx),this);
+        }
+        catch (std::exception const&)
+        {
+            return_datasource(idx);
+            throw;
+        }
+        uv_mutex_lock(&layer_mutex_);
+        ds_cache_[idx].ds = ds;
+        uv_mutex_unlock(&layer_mutex_);
+    }
+    return ds;
+}
+
+void VectorTile::return_datasource(std::size_t idx)
+{
+    uv_mutex_lock(&layer_mutex_);
+    if (idx < ds_cache_.size())
+    {
+        ds_cache_[idx].in_use = false;
+    }
+    uv_mutex_unlock(&layer_mutex_);
+}
+
 void VectorTile::parse_proto()
 {
     switch (status_)
@@ -243,14 +734,15 @@ void VectorTile::parse_proto()
     case LAZY_SET:
     {
         status_ = LAZY_DONE;
-        std::size_t bytes = buffer_.size();
+        std::size_t bytes = raw_size();
         if (bytes == 0)
         {
             throw std::runtime_error("cannot parse 0 length buffer as protobuf");
         }
-        if (tiledata_.ParseFromArray(buffer_.data(), bytes))
+        if (tiledata_.ParseFromArray(raw_data(), bytes))
         {
             painted(true);
+            clear_layer_index();
         }
         else
         {
@@ -261,19 +753,20 @@ void VectorTile::parse_proto()
     case LAZY_MERGE:
     {
         status_ = LAZY_DONE;
-        std::size_t bytes = buffer_.size();
+        std::size_t bytes = raw_size();
         if (bytes == 0)
         {
             throw std::runtime_error("cannot parse 0 length buffer as protobuf");
         }
         unsigned remaining = bytes - byte_size_;
-        const char * data = buffer_.data() + byte_size_;
+        const char * data = raw_data() + byte_size_;
         google::protobuf::io::CodedInputStream input(
               reinterpret_cast<const google::protobuf::uint8*>(
                   data), remaining);
         if (tiledata_.MergeFromCodedStream(&input))
         {
             painted(true);
+            clear_layer_index();
         }
         else
         {
@@ -284,131 +777,200 @@ void VectorTile::parse_proto()
     }
 }
 
-Handle<Value> VectorTile::composite(const Arguments& args)
+struct vector_tile_composite_baton_t {
+    uv_work_t request;
+    VectorTile* d;
+    std::vector<VectorTile*> vtiles;
+    unsigned path_multiplier;
+    int buffer_size;
+    double scale_factor;
+    unsigned offset_x;
+    unsigned offset_y;
+    unsigned tolerance;
+    double scale_denominator;
+    node_mapnik::cancel_token cancel;
+    bool error;
+    std::string error_name;
+    std::string error_code;
+    Persistent<Function> cb;
+    vector_tile_composite_baton_t() :
+        request(),
+        d(NULL),
+        vtiles(),
+        path_multiplier(16),
+        buffer_size(256),
+        scale_factor(1.0),
+        offset_x(0),
+        offset_y(0),
+        tolerance(1),
+        scale_denominator(0.0),
+        cancel(),
+        error(false) {}
+};
+
+// validates the tiles array and options object passed to composite/compositeSync
+// and stores them on the baton. Returns false and sets error_name on bad input.
+static bool composite_parse_args(Arguments const& args,
+                                 bool has_callback,
+                                 vector_tile_composite_baton_t & closure)
 {
-    HandleScope scope;
     if (args.Length() < 1 || !args[0]->IsArray()) {
-        return ThrowException(Exception::TypeError(
-                                  String::New("must provide an array of VectorTile objects and an optional options object")));
+        closure.error_name = "must provide an array of VectorTile objects and an optional options object";
+        return false;
     }
     Local<Array> vtiles = Local<Array>::Cast(args[0]);
     unsigned num_tiles = vtiles->Length();
     if (num_tiles < 1) {
-        return ThrowException(Exception::TypeError(
-                                  String::New("must provide an array with at least one VectorTile object and an optional options object")));
+        closure.error_name = "must provide an array with at least one VectorTile object and an optional options object";
+        return false;
     }
 
     // options needed for re-rendering tiles
     // unclear yet to what extent these need to be user
     // driven, but we expose here to avoid hardcoding
-    unsigned path_multiplier = 16;
-    int buffer_size = 256;
-    double scale_factor = 1.0;
-    unsigned offset_x = 0;
-    unsigned offset_y = 0;
-    unsigned tolerance = 1;
-    double scale_denominator = 0.0;
-    // not options yet, likely should never be....
-    mapnik::box2d<double> max_extent(-20037508.34,-20037508.34,20037508.34,20037508.34);
-    std::string merc_srs("+init=epsg:3857");
-
-    Local<Object> options = Object::New();
-
-    if (args.Length() > 1) {
+    int num_args = has_callback ? args.Length() - 1 : args.Length();
+    if (num_args > 1) {
         // options object
         if (!args[1]->IsObject())
         {
-            return ThrowException(Exception::TypeError(
-                                      String::New("optional second argument must be an options object")));
+            closure.error_name = "optional second argument must be an options object";
+            return false;
         }
-        options = args[1]->ToObject();
+        Local<Object> options = args[1]->ToObject();
         if (options->Has(String::New("path_multiplier"))) {
 
             Local<Value> param_val = options->Get(String::New("path_multiplier"));
             if (!param_val->IsNumber())
             {
-                return ThrowException(Exception::TypeError(
-                                          String::New("option 'path_multiplier' must be an unsigned integer")));
+                closure.error_name = "option 'path_multiplier' must be an unsigned integer";
+                return false;
             }
-            path_multiplier = param_val->NumberValue();
+            closure.path_multiplier = param_val->NumberValue();
         }
         if (options->Has(String::NewSymbol("tolerance")))
         {
             Local<Value> tol = options->Get(String::New("tolerance"));
             if (!tol->IsNumber())
             {
-                return ThrowException(Exception::TypeError(String::New("tolerance value must be a number")));
+                closure.error_name = "tolerance value must be a number";
+                return false;
             }
-            tolerance = tol->NumberValue();
+            closure.tolerance = tol->NumberValue();
         }
         if (options->Has(String::New("buffer_size"))) {
             Local<Value> bind_opt = options->Get(String::New("buffer_size"));
             if (!bind_opt->IsNumber())
             {
-                return ThrowException(Exception::TypeError(
-                                          String::New("optional arg 'buffer_size' must be a number")));
+                closure.error_name = "optional arg 'buffer_size' must be a number";
+                return false;
             }
-            buffer_size = bind_opt->IntegerValue();
+            closure.buffer_size = bind_opt->IntegerValue();
         }
         if (options->Has(String::New("scale"))) {
             Local<Value> bind_opt = options->Get(String::New("scale"));
             if (!bind_opt->IsNumber())
             {
-                return ThrowException(Exception::TypeError(
-                                        String::New("optional arg 'scale' must be a number")));
+                closure.error_name = "optional arg 'scale' must be a number";
+                return false;
             }
-            scale_factor = bind_opt->NumberValue();
+            closure.scale_factor = bind_opt->NumberValue();
         }
         if (options->Has(String::NewSymbol("scale_denominator")))
         {
             Local<Value> bind_opt = options->Get(String::New("scale_denominator"));
             if (!bind_opt->IsNumber())
             {
-                return ThrowException(Exception::TypeError(
-                                        String::New("optional arg 'scale_denominator' must be a number")));
+                closure.error_name = "optional arg 'scale_denominator' must be a number";
+                return false;
             }
-            scale_denominator = bind_opt->NumberValue();
+            closure.scale_denominator = bind_opt->NumberValue();
         }
         if (options->Has(String::New("offset_x"))) {
             Local<Value> bind_opt = options->Get(String::New("offset_x"));
             if (!bind_opt->IsNumber())
             {
-                return ThrowException(Exception::TypeError(
-                                          String::New("optional arg 'offset_x' must be a number")));
+                closure.error_name = "optional arg 'offset_x' must be a number";
+                return false;
             }
-            offset_x = bind_opt->IntegerValue();
+            closure.offset_x = bind_opt->IntegerValue();
         }
         if (options->Has(String::New("offset_y"))) {
             Local<Value> bind_opt = options->Get(String::New("offset_y"));
             if (!bind_opt->IsNumber())
             {
-                return ThrowException(Exception::TypeError(
-                                          String::New("optional arg 'offset_y' must be a number")));
+                closure.error_name = "optional arg 'offset_y' must be a number";
+                return false;
             }
-            offset_y = bind_opt->IntegerValue();
+            closure.offset_y = bind_opt->IntegerValue();
+        }
+        if (!node_mapnik::parse_cancel_options(options,closure.cancel,closure.error_name))
+        {
+            return false;
         }
     }
 
-    VectorTile* target_vt = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    closure.vtiles.reserve(num_tiles);
     for (unsigned i=0;i < num_tiles;++i) {
         Local<Value> val = vtiles->Get(i);
         if (!val->IsObject()) {
-            return ThrowException(Exception::TypeError(
-                                      String::New("must provide an array of VectorTile objects")));
+            closure.error_name = "must provide an array of VectorTile objects";
+            return false;
         }
         Local<Object> tile_obj = val->ToObject();
         if (tile_obj->IsNull() || tile_obj->IsUndefined() || !VectorTile::constructor->HasInstance(tile_obj)) {
-            return ThrowException(Exception::TypeError(
-                                      String::New("must provide an array of VectorTile objects")));
+            closure.error_name = "must provide an array of VectorTile objects";
+            return false;
         }
-        VectorTile* vt = node::ObjectWrap::Unwrap<VectorTile>(tile_obj);
+        closure.vtiles.push_back(node::ObjectWrap::Unwrap<VectorTile>(tile_obj));
+    }
+    return true;
+}
+
+static void add_tile_layers(mapnik::Map & map,
+                            mapnik::vector::tile const& tiledata,
+                            VectorTile * vt,
+                            mapnik::request const& m_req,
+                            std::string const& merc_srs)
+{
+    for (int i=0; i < tiledata.layers_size(); ++i)
+    {
+        mapnik::vector::tile_layer const& layer = tiledata.layers(i);
+        mapnik::layer lyr(layer.name(),merc_srs);
+        MAPNIK_SHARED_PTR<mapnik::vector::tile_datasource> ds = MAPNIK_MAKE_SHARED<
+                                        mapnik::vector::tile_datasource>(
+                                            layer,
+                                            vt->x_,
+                                            vt->y_,
+                                            vt->z_,
+                                            vt->width()
+                                            );
+        ds->set_envelope(m_req.get_buffered_extent());
+        lyr.set_datasource(ds);
+        map.MAPNIK_ADD_LAYER(lyr);
+    }
+}
+
+// does the actual compositing: safe to call from the threadpool
+// as long as the target and input tiles are kept alive by the caller
+static void composite_tiles(vector_tile_composite_baton_t & closure)
+{
+    // not options yet, likely should never be....
+    mapnik::box2d<double> max_extent(-20037508.34,-20037508.34,20037508.34,20037508.34);
+    std::string merc_srs("+init=epsg:3857");
+
+    VectorTile* target_vt = closure.d;
+    // appended to the target only once every tile is done, so a cancelled
+    // composite leaves the target as it was
+    std::string merged;
+    BOOST_FOREACH ( VectorTile * vt, closure.vtiles )
+    {
+        closure.cancel.check();
         // TODO - handle name clashes
         if (target_vt->z_ == vt->z_ &&
             target_vt->x_ == vt->x_ &&
             target_vt->y_ == vt->y_)
         {
-            target_vt->buffer_.append(vt->buffer_.data(),vt->buffer_.size());
-            target_vt->status_ = VectorTile::LAZY_MERGE;
+            merged.append(vt->raw_data(),vt->raw_size());
         }
         else
         {
@@ -417,8 +979,8 @@ Handle<Value> VectorTile::composite(const Arguments& args)
             typedef mapnik::vector::processor<backend_type> renderer_type;
             mapnik::vector::tile new_tiledata;
             backend_type backend(new_tiledata,
-                                    path_multiplier);
-            
+                                    closure.path_multiplier);
+
             // get mercator extent of target tile
             mapnik::vector::spherical_mercator merc(target_vt->width());
             double minx,miny,maxx,maxy;
@@ -426,104 +988,196 @@ Handle<Value> VectorTile::composite(const Arguments& args)
             mapnik::box2d<double> map_extent(minx,miny,maxx,maxy);
             // create request
             mapnik::request m_req(target_vt->width(),target_vt->height(),map_extent);
-            m_req.set_buffer_size(buffer_size);
+            m_req.set_buffer_size(closure.buffer_size);
             // create map
             mapnik::Map map(target_vt->width(),target_vt->height(),merc_srs);
             map.set_maximum_extent(max_extent);
             // ensure data is in tile object
-            if (vt->status_ == LAZY_DONE) // tile is already parsed, we're good
+            // if tile is not pre-parsed then parse into new object to avoid mutating input
+            mapnik::vector::tile parsed_tiledata;
+            mapnik::vector::tile const* tiledata = NULL;
+            if (vt->status_ == VectorTile::LAZY_DONE) // tile is already parsed, we're good
+            {
+                tiledata = &vt->get_tile();
+            }
+            else if (vt->raw_size() > 1) // throw instead?
             {
-                mapnik::vector::tile const& tiledata = vt->get_tile();
-                unsigned num_layers = tiledata.layers_size();
-                if (num_layers > 0)
+                if (parsed_tiledata.ParseFromArray(vt->raw_data(), vt->raw_size()))
                 {
-                    for (int i=0; i < tiledata.layers_size(); ++i)
-                    {
-                        mapnik::vector::tile_layer const& layer = tiledata.layers(i);
-                        mapnik::layer lyr(layer.name(),merc_srs);
-                        MAPNIK_SHARED_PTR<mapnik::vector::tile_datasource> ds = MAPNIK_MAKE_SHARED<
-                                                        mapnik::vector::tile_datasource>(
-                                                            layer,
-                                                            vt->x_,
-                                                            vt->y_,
-                                                            vt->z_,
-                                                            vt->width()
-                                                            );
-                        ds->set_envelope(m_req.get_buffered_extent());
-                        lyr.set_datasource(ds);
-                        map.MAPNIK_ADD_LAYER(lyr);
-                    }
-                    renderer_type ren(backend,
-                                      map,
-                                      m_req,
-                                      scale_factor,
-                                      offset_x,
-                                      offset_y,
-                                      tolerance);
-                    ren.apply(scale_denominator);
+                    tiledata = &parsed_tiledata;
                 }
+                // throw here?
             }
-            else // tile is not pre-parsed so parse into new object to avoid mutating input
+            if (tiledata && tiledata->layers_size() > 0)
             {
-                std::size_t bytes = vt->buffer_.size();
-                if (bytes > 1) // throw instead?
-                {
-                    mapnik::vector::tile tiledata;
-                    if (tiledata.ParseFromArray(vt->buffer_.data(), bytes))
-                    {
-                        unsigned num_layers = tiledata.layers_size();
-                        if (num_layers > 0)
-                        {
-                            for (int i=0; i < tiledata.layers_size(); ++i)
-                            {
-                                mapnik::vector::tile_layer const& layer = tiledata.layers(i);
-                                mapnik::layer lyr(layer.name(),merc_srs);
-                                MAPNIK_SHARED_PTR<mapnik::vector::tile_datasource> ds = MAPNIK_MAKE_SHARED<
-                                                                mapnik::vector::tile_datasource>(
-                                                                    layer,
-                                                                    vt->x_,
-                                                                    vt->y_,
-                                                                    vt->z_,
-                                                                    vt->width()
-                                                                    );
-                                ds->set_envelope(m_req.get_buffered_extent());
-                                lyr.set_datasource(ds);
-                                map.MAPNIK_ADD_LAYER(lyr);
-                            }
-                            renderer_type ren(backend,
-                                              map,
-                                              m_req,
-                                              scale_factor,
-                                              offset_x,
-                                              offset_y,
-                                              tolerance);
-                            ren.apply(scale_denominator);
-                        }
-                    }
-                    else
-                    {
-                        // throw here?
-                    }
-                }
+                add_tile_layers(map,*tiledata,vt,m_req,merc_srs);
+                renderer_type ren(backend,
+                                  map,
+                                  m_req,
+                                  closure.scale_factor,
+                                  closure.offset_x,
+                                  closure.offset_y,
+                                  closure.tolerance);
+                ren.apply(closure.scale_denominator);
             }
             std::string new_message;
             if (!new_tiledata.SerializeToString(&new_message))
             {
-                return ThrowException(Exception::Error(
-                          String::New("could not serialize new data for vt")));
+                throw std::runtime_error("could not serialize new data for vt");
             }
-            target_vt->buffer_.append(new_message.data(),new_message.size());
-            target_vt->status_ = VectorTile::LAZY_MERGE;
+            merged.append(new_message.data(),new_message.size());
+        }
+    }
+    target_vt->buffer_.append(merged);
+    target_vt->status_ = VectorTile::LAZY_MERGE;
+    target_vt->index_layers();
+}
+
+// a composite changes its target and reads every other tile passed in
+static const char * composite_blocked(vector_tile_composite_baton_t const& closure)
+{
+    if (const char * busy = closure.d->write_blocked())
+    {
+        return busy;
+    }
+    BOOST_FOREACH ( VectorTile * vt, closure.vtiles )
+    {
+        if (vt == closure.d) continue;
+        if (const char * busy = vt->read_blocked())
+        {
+            return busy;
         }
     }
+    return NULL;
+}
+
+Handle<Value> VectorTile::compositeSync(const Arguments& args)
+{
+    HandleScope scope;
+    vector_tile_composite_baton_t closure;
+    if (!composite_parse_args(args,false,closure))
+    {
+        return ThrowException(Exception::TypeError(
+                                  String::New(closure.error_name.c_str())));
+    }
+    closure.d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = composite_blocked(closure))
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
+    // the target is appended to, so it needs its own copy of borrowed bytes
+    closure.d->detach_buffer();
+    try
+    {
+        composite_tiles(closure);
+    }
+    catch (node_mapnik::job_cancelled const& ex)
+    {
+        return ThrowException(node_mapnik::job_error(ex.what(), ex.code()));
+    }
+    catch (std::exception const& ex)
+    {
+        return ThrowException(Exception::Error(
+                                  String::New(ex.what())));
+    }
     return scope.Close(Undefined());
 }
 
+Handle<Value> VectorTile::composite(const Arguments& args)
+{
+    HandleScope scope;
+    if (args.Length() == 0 || !args[args.Length()-1]->IsFunction()) {
+        return compositeSync(args);
+    }
+    Local<Value> callback = args[args.Length()-1];
+    vector_tile_composite_baton_t *closure = new vector_tile_composite_baton_t();
+    if (!composite_parse_args(args,true,*closure))
+    {
+        Local<Value> err = Exception::TypeError(String::New(closure->error_name.c_str()));
+        delete closure;
+        return ThrowException(err);
+    }
+    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    closure->d = d;
+    if (const char * busy = composite_blocked(*closure))
+    {
+        delete closure;
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
+    closure->request.data = closure;
+    d->detach_buffer();
+    closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
+    node_mapnik::queue_work(&closure->request, EIO_Composite, (uv_after_work_cb)EIO_AfterComposite, "vtile-composite");
+    d->Ref();
+    d->begin_write();
+    BOOST_FOREACH ( VectorTile * vt, closure->vtiles )
+    {
+        vt->_ref();
+        if (vt != d) vt->begin_read();
+    }
+    return Undefined();
+}
+
+void VectorTile::EIO_Composite(uv_work_t* req)
+{
+    vector_tile_composite_baton_t *closure = static_cast<vector_tile_composite_baton_t *>(req->data);
+    try
+    {
+        composite_tiles(*closure);
+    }
+    catch (node_mapnik::job_cancelled const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+        closure->error_code = ex.code();
+    }
+    catch (std::exception const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+    }
+}
+
+void VectorTile::EIO_AfterComposite(uv_work_t* req)
+{
+    HandleScope scope;
+    vector_tile_composite_baton_t *closure = static_cast<vector_tile_composite_baton_t *>(req->data);
+    closure->d->end_write();
+    BOOST_FOREACH ( VectorTile * vt, closure->vtiles )
+    {
+        if (vt != closure->d) vt->end_read();
+    }
+    TryCatch try_catch;
+    if (closure->error) {
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name, closure->error_code) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    }
+    else
+    {
+        Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(closure->d->handle_) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+    }
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+    BOOST_FOREACH ( VectorTile * vt, closure->vtiles )
+    {
+        vt->_unref();
+    }
+    closure->d->Unref();
+    closure->cb.Dispose();
+    delete closure;
+}
+
 #ifdef PROTOBUF_FULL
 Handle<Value> VectorTile::toString(const Arguments& args)
 {
     HandleScope scope;
     VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = d->read_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
     mapnik::vector::tile const& tiledata = d->get_tile();
     return scope.Close(String::New(tiledata.DebugString().c_str()));
 }
@@ -533,8 +1187,22 @@ Handle<Value> VectorTile::names(const Arguments& args)
 {
     HandleScope scope;
     VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
-    int raw_size = d->buffer_.size();
-    if (d->byte_size_ <= raw_size)
+    if (const char * busy = d->read_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
+    int raw_size = d->raw_size();
+    if (d->lazy())
+    {
+        std::size_t layer_num = d->layers_size();
+        Local<Array> arr = Array::New(layer_num);
+        for (std::size_t i=0; i < layer_num; ++i)
+        {
+            arr->Set(i, String::New(d->layer_name(i).c_str()));
+        }
+        return scope.Close(arr);
+    }
+    else if (d->byte_size_ <= raw_size)
     {
         std::vector<std::string> names = d->lazy_names();
         Local<Array> arr = Array::New(names.size());
@@ -578,6 +1246,26 @@ Handle<Value> VectorTile::painted(const Arguments& args)
     return scope.Close(Boolean::New(d->painted()));
 }
 
+Handle<Value> VectorTile::cacheStats(const Arguments& args)
+{
+    HandleScope scope;
+    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    uv_mutex_lock(&d->layer_mutex_);
+    unsigned hits = d->ds_cache_hits_;
+    unsigned misses = d->ds_cache_misses_;
+    unsigned cached = 0;
+    BOOST_FOREACH ( cached_datasource const& entry, d->ds_cache_ )
+    {
+        if (entry.ds) ++cached;
+    }
+    uv_mutex_unlock(&d->layer_mutex_);
+    Local<Object> stats = Object::New();
+    stats->Set(String::NewSymbol("hits"), Integer::NewFromUnsigned(hits));
+    stats->Set(String::NewSymbol("misses"), Integer::NewFromUnsigned(misses));
+    stats->Set(String::NewSymbol("layers"), Integer::NewFromUnsigned(cached));
+    return scope.Close(stats);
+}
+
 Handle<Value> VectorTile::query(const Arguments& args)
 {
     HandleScope scope;
@@ -620,96 +1308,44 @@ Handle<Value> VectorTile::query(const Arguments& args)
     double lat = args[1]->NumberValue();
     Local<Array> arr = Array::New();
     try  {
-        mapnik::projection wgs84("+init=epsg:4326");
-        mapnik::projection merc("+init=epsg:3857");
-        mapnik::proj_transform tr(wgs84,merc);
         double x = lon;
         double y = lat;
-        double z = 0;
-        if (!tr.forward(x,y,z))
+        // proj4 refused the poles and beyond, mapnik::lonlat2merc does not check
+        if (!(lat > -90.0 && lat < 90.0) || !mapnik::lonlat2merc(&x,&y,1))
         {
             return ThrowException(Exception::Error(
                                       String::New("could not reproject lon/lat to mercator")));
         }
         VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
-        mapnik::vector::tile const& tiledata = d->get_tile();
-        mapnik::coord2d pt(x,y);
-        unsigned idx = 0;
-        if (!layer_name.empty())
+        if (const char * busy = d->read_blocked())
         {
-                int tile_layer_idx = -1;
-                for (int j=0; j < tiledata.layers_size(); ++j)
-                {
-                    mapnik::vector::tile_layer const& layer = tiledata.layers(j);
-                    if (layer_name == layer.name())
-                    {
-                        tile_layer_idx = j;
-                        break;
-                    }
-                }
-                if (tile_layer_idx > -1)
-                {
-                    mapnik::vector::tile_layer const& layer = tiledata.layers(tile_layer_idx);
-                    MAPNIK_SHARED_PTR<mapnik::vector::tile_datasource> ds = MAPNIK_MAKE_SHARED<
-                                                mapnik::vector::tile_datasource>(
-                                                    layer,
-                                                    d->x_,
-                                                    d->y_,
-                                                    d->z_,
-                                                    d->width()
-                                                    );
-                    mapnik::featureset_ptr fs = ds->features_at_point(pt,tolerance);
-                    if (fs)
-                    {
-                        mapnik::feature_ptr feature;
-                        while ((feature = fs->next()))
-                        {
-                            bool hit = false;
-                            BOOST_FOREACH ( mapnik::geometry_type const& geom, feature->paths() )
-                            {
-                               if (_hit_test(geom,x,y,tolerance))
-                               {
-                                   hit = true;
-                                   break;
-                               }
-                            }
-                            if (hit) arr->Set(idx++,Feature::New(feature));
-                        }
-                    }
-                }
+            return ThrowException(Exception::Error(String::New(busy)));
         }
-        else
+        std::size_t tile_layers_size = d->layers_size();
+        mapnik::box2d<double> query_box(x - tolerance, y - tolerance, x + tolerance, y + tolerance);
+        std::vector<std::size_t> candidates;
+        unsigned idx = 0;
+        for (std::size_t i=0; i < tile_layers_size; ++i)
         {
-            for (int i=0; i < tiledata.layers_size(); ++i)
+            if (!layer_name.empty() && layer_name != d->layer_name(i)) continue;
+            // only features whose bbox is near the point are hit tested
+            VectorTile::query_index_ptr index = d->get_query_index(i);
+            index->query(query_box,candidates);
+            BOOST_FOREACH ( std::size_t c, candidates )
             {
-                mapnik::vector::tile_layer const& layer = tiledata.layers(i);
-                MAPNIK_SHARED_PTR<mapnik::vector::tile_datasource> ds = MAPNIK_MAKE_SHARED<
-                                            mapnik::vector::tile_datasource>(
-                                                layer,
-                                                d->x_,
-                                                d->y_,
-                                                d->z_,
-                                                d->width()
-                                                );
-                mapnik::featureset_ptr fs = ds->features_at_point(pt,tolerance);
-                if (fs)
+                for (std::size_t p = index->paths_begin(c); p < index->paths_end(c); ++p)
                 {
-                    mapnik::feature_ptr feature;
-                    while ((feature = fs->next()))
-                    {
-                        bool hit = false;
-                        BOOST_FOREACH ( mapnik::geometry_type const& geom, feature->paths() )
-                        {
-                           if (_hit_test(geom,x,y,tolerance))
-                           {
-                               hit = true;
-                               break;
-                           }
-                        }
-                        if (hit) arr->Set(idx++,Feature::New(feature));
-                    }
+                   node_mapnik::query_index::path_cursor geom = index->path(p);
+                   if (_hit_test(geom,x,y,tolerance))
+                   {
+                       // indexed features are reused: hand out a copy
+                       arr->Set(idx++,Feature::New(copy_feature(*index,c)));
+                       break;
+                   }
                 }
             }
+            // like before only the first layer of that name is queried
+            if (!layer_name.empty()) break;
         }
     }
     catch (std::exception const& ex)
@@ -720,202 +1356,503 @@ Handle<Value> VectorTile::query(const Arguments& args)
     return scope.Close(arr);
 }
 
-Handle<Value> VectorTile::toJSON(const Arguments& args)
+struct query_many_hit {
+    unsigned layer;
+    mapnik::value_integer id;
+    double distance;
+};
+
+static bool query_many_hit_closer(query_many_hit const& a, query_many_hit const& b)
 {
-    HandleScope scope;
-    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
-    mapnik::vector::tile const& tiledata = d->get_tile();
-    Local<Array> arr = Array::New(tiledata.layers_size());
-    for (int i=0; i < tiledata.layers_size(); ++i)
+    return a.distance < b.distance;
+}
+
+struct vector_tile_query_many_baton_t {
+    uv_work_t request;
+    VectorTile* d;
+    std::vector<double> coords;
+    double tolerance;
+    std::string layer_name;
+    std::vector<std::vector<query_many_hit> > hits;
+    bool error;
+    std::string error_name;
+    Persistent<Function> cb;
+    vector_tile_query_many_baton_t() :
+        request(),
+        d(NULL),
+        coords(),
+        tolerance(0.0),
+        layer_name(),
+        hits(),
+        error(false) {}
+};
+
+// coords are interleaved lon,lat pairs, reprojected together in one pass
+static void query_many(vector_tile_query_many_baton_t * closure)
+{
+    VectorTile* d = closure->d;
+    std::vector<double> & coords = closure->coords;
+    std::size_t num_points = coords.size() / 2;
+    std::vector<double> xs(num_points);
+    std::vector<double> ys(num_points);
+    for (std::size_t p = 0; p < num_points; ++p)
     {
-        mapnik::vector::tile_layer const& layer = tiledata.layers(i);
-        Local<Object> layer_obj = Object::New();
-        layer_obj->Set(String::NewSymbol("name"), String::New(layer.name().c_str()));
-        layer_obj->Set(String::NewSymbol("extent"), Integer::New(layer.extent()));
-        layer_obj->Set(String::NewSymbol("version"), Integer::New(layer.version()));
-
-        Local<Array> f_arr = Array::New(layer.features_size());
-        for (int j=0; j < layer.features_size(); ++j)
-        {
-            Local<Object> feature_obj = Object::New();
-            mapnik::vector::tile_feature const& f = layer.features(j);
-            feature_obj->Set(String::NewSymbol("id"),Number::New(f.id()));
-            feature_obj->Set(String::NewSymbol("type"),Integer::New(f.type()));
-            Local<Array> g_arr = Array::New();
-            for (int k = 0; k < f.geometry_size();++k)
-            {
-                g_arr->Set(k,Number::New(f.geometry(k)));
-            }
-            feature_obj->Set(String::NewSymbol("geometry"),g_arr);
-            Local<Object> att_obj = Object::New();
-            for (int m = 0; m < f.tags_size(); m += 2)
-            {
-                std::size_t key_name = f.tags(m);
-                std::size_t key_value = f.tags(m + 1);
-                if (key_name < static_cast<std::size_t>(layer.keys_size())
-                    && key_value < static_cast<std::size_t>(layer.values_size()))
+        xs[p] = coords[p * 2];
+        ys[p] = coords[p * 2 + 1];
+    }
+    if (num_points > 0)
+    {
+        mapnik::lonlat2merc(&xs[0],&ys[0],static_cast<int>(num_points));
+    }
+    double tolerance = closure->tolerance;
+    closure->hits.assign(num_points, std::vector<query_many_hit>());
+    std::vector<std::size_t> candidates;
+    std::size_t tile_layers_size = d->layers_size();
+    for (std::size_t i=0; i < tile_layers_size; ++i)
+    {
+        if (!closure->layer_name.empty() && closure->layer_name != d->layer_name(i)) continue;
+        VectorTile::query_index_ptr index = d->get_query_index(i);
+        for (std::size_t p = 0; p < num_points; ++p)
+        {
+            double x = xs[p];
+            double y = ys[p];
+            index->query(mapnik::box2d<double>(x - tolerance, y - tolerance, x + tolerance, y + tolerance),candidates);
+            BOOST_FOREACH ( std::size_t c, candidates )
+            {
+                double min_distance = -1;
+                for (std::size_t path = index->paths_begin(c); path < index->paths_end(c); ++path)
                 {
-                    std::string const& name = layer.keys(key_name);
-                    mapnik::vector::tile_value const& value = layer.values(key_value);
-                    if (value.has_string_value())
-                    {
-                        att_obj->Set(String::NewSymbol(name.c_str()), String::New(value.string_value().c_str()));
-                    }
-                    else if (value.has_int_value())
-                    {
-                        att_obj->Set(String::NewSymbol(name.c_str()), Number::New(value.int_value()));
-                    }
-                    else if (value.has_double_value())
-                    {
-                        att_obj->Set(String::NewSymbol(name.c_str()), Number::New(value.double_value()));
-                    }
-                    else if (value.has_float_value())
-                    {
-                        att_obj->Set(String::NewSymbol(name.c_str()), Number::New(value.float_value()));
-                    }
-                    else if (value.has_bool_value())
-                    {
-                        att_obj->Set(String::NewSymbol(name.c_str()), Boolean::New(value.bool_value()));
-                    }
-                    else if (value.has_sint_value())
-                    {
-                        att_obj->Set(String::NewSymbol(name.c_str()), Number::New(value.sint_value()));
-                    }
-                    else if (value.has_uint_value())
-                    {
-                        att_obj->Set(String::NewSymbol(name.c_str()), Number::New(value.uint_value()));
-                    }
-                    else
+                    node_mapnik::query_index::path_cursor geom = index->path(path);
+                    double distance = _hit_distance(geom,x,y,tolerance);
+                    if (distance >= 0 && (min_distance < 0 || distance < min_distance))
                     {
-                        att_obj->Set(String::NewSymbol(name.c_str()), Undefined());
+                        min_distance = distance;
                     }
                 }
-                feature_obj->Set(String::NewSymbol("properties"),att_obj);
+                if (min_distance >= 0)
+                {
+                    query_many_hit hit;
+                    hit.layer = static_cast<unsigned>(i);
+                    hit.id = index->feature(c)->id();
+                    hit.distance = min_distance;
+                    closure->hits[p].push_back(hit);
+                }
             }
-
-            f_arr->Set(j,feature_obj);
         }
-        layer_obj->Set(String::NewSymbol("features"), f_arr);
-        arr->Set(i, layer_obj);
+        if (!closure->layer_name.empty()) break;
+    }
+    for (std::size_t p = 0; p < num_points; ++p)
+    {
+        std::stable_sort(closure->hits[p].begin(),closure->hits[p].end(),query_many_hit_closer);
     }
-    return scope.Close(arr);
 }
 
-static void layer_to_geojson(mapnik::vector::tile_layer const& layer,
-                             Local<Array> f_arr,
-                             unsigned x,
-                             unsigned y,
-                             unsigned z,
-                             unsigned width,
-                             unsigned idx0)
+static Local<Array> query_many_result(vector_tile_query_many_baton_t * closure)
 {
-    mapnik::projection wgs84("+init=epsg:4326");
-    mapnik::projection merc("+init=epsg:3857");
-    mapnik::proj_transform tr(merc,wgs84);
-    double zc = 0;
-    double resolution = mapnik::EARTH_CIRCUMFERENCE/(1 << z);
-    double tile_x_ = -0.5 * mapnik::EARTH_CIRCUMFERENCE + x * resolution;
-    double tile_y_ =  0.5 * mapnik::EARTH_CIRCUMFERENCE - y * resolution;
-    for (int j=0; j < layer.features_size(); ++j)
+    std::size_t num_points = closure->hits.size();
+    Local<Array> result = Array::New(num_points);
+    for (std::size_t p = 0; p < num_points; ++p)
     {
-        double scale_ = (static_cast<double>(layer.extent()) / width) * static_cast<double>(width)/resolution;
-        Local<Object> feature_obj = Object::New();
-        feature_obj->Set(String::NewSymbol("type"),String::New("Feature"));
-        Local<Object> geometry = Object::New();
-        mapnik::vector::tile_feature const& f = layer.features(j);
-        unsigned int g_type = f.type();
-        Local<String> js_type = String::New("Unknown");
-        switch (g_type)
-        {
-        case MAPNIK_POINT:
+        std::vector<query_many_hit> const& hits = closure->hits[p];
+        Local<Array> point_hits = Array::New(hits.size());
+        for (std::size_t h = 0; h < hits.size(); ++h)
         {
-            js_type = String::New("Point");
-            break;
+            Local<Object> hit = Object::New();
+            hit->Set(String::NewSymbol("layer"), Integer::NewFromUnsigned(hits[h].layer));
+            hit->Set(String::NewSymbol("id"), Number::New(hits[h].id));
+            hit->Set(String::NewSymbol("distance"), Number::New(hits[h].distance));
+            point_hits->Set(h,hit);
         }
-        case MAPNIK_LINESTRING:
+        result->Set(p,point_hits);
+    }
+    return result;
+}
+
+Handle<Value> VectorTile::queryMany(const Arguments& args)
+{
+    HandleScope scope;
+    if (args.Length() < 1 || !args[0]->IsObject())
+    {
+        return ThrowException(Exception::TypeError(
+                                  String::New("expects a Float64Array or array of lon,lat pairs as first argument")));
+    }
+    bool has_callback = args[args.Length()-1]->IsFunction();
+    std::vector<double> coords;
+    Local<Object> lonlats = args[0]->ToObject();
+    if (lonlats->HasIndexedPropertiesInExternalArrayData())
+    {
+        if (lonlats->GetIndexedPropertiesExternalArrayDataType() != kExternalDoubleArray)
         {
-            js_type = String::New("LineString");
-            break;
+            return ThrowException(Exception::TypeError(
+                                      String::New("typed array of lon,lat pairs must be a Float64Array")));
         }
-        case MAPNIK_POLYGON:
+        double const* data = static_cast<double const*>(lonlats->GetIndexedPropertiesExternalArrayData());
+        int length = lonlats->GetIndexedPropertiesExternalArrayDataLength();
+        coords.assign(data, data + length);
+    }
+    else if (args[0]->IsArray())
+    {
+        Local<Array> arr = Local<Array>::Cast(args[0]);
+        unsigned length = arr->Length();
+        coords.reserve(length);
+        for (unsigned i = 0; i < length; ++i)
         {
-            js_type = String::New("Polygon");
-            break;
+            Local<Value> val = arr->Get(i);
+            if (!val->IsNumber())
+            {
+                return ThrowException(Exception::TypeError(
+                                          String::New("lon,lat values must be numbers")));
+            }
+            coords.push_back(val->NumberValue());
         }
-        default:
+    }
+    else
+    {
+        return ThrowException(Exception::TypeError(
+                                  String::New("expects a Float64Array or array of lon,lat pairs as first argument")));
+    }
+    if (coords.size() % 2 != 0)
+    {
+        return ThrowException(Exception::TypeError(
+                                  String::New("lon,lat array must have an even number of values")));
+    }
+    for (std::size_t i = 1; i < coords.size(); i += 2)
+    {
+        if (!(coords[i] > -90.0 && coords[i] < 90.0))
         {
-            break;
-        }
+            return ThrowException(Exception::Error(
+                                      String::New("could not reproject lon/lat to mercator")));
         }
-        geometry->Set(String::NewSymbol("type"),js_type);
-        Local<Array> g_arr = Array::New();
-        if (g_type == MAPNIK_POLYGON)
+    }
+    double tolerance = 0.0; // meters
+    std::string layer_name("");
+    if (args.Length() > 1 && !args[1]->IsFunction())
+    {
+        if (!args[1]->IsObject())
         {
-            Local<Array> enclosing_array = Array::New(1);
-            enclosing_array->Set(0,g_arr);
-            geometry->Set(String::NewSymbol("coordinates"),enclosing_array);
+            return ThrowException(Exception::TypeError(String::New("optional second argument must be an options object")));
         }
-        else
+        Local<Object> options = args[1]->ToObject();
+        if (options->Has(String::NewSymbol("tolerance")))
         {
-            geometry->Set(String::NewSymbol("coordinates"),g_arr);
+            Local<Value> tol = options->Get(String::New("tolerance"));
+            if (!tol->IsNumber())
+            {
+                return ThrowException(Exception::TypeError(String::New("tolerance value must be a number")));
+            }
+            tolerance = tol->NumberValue();
         }
-        int cmd = -1;
-        const int cmd_bits = 3;
-        unsigned length = 0;
-        double x1 = tile_x_;
-        double y1 = tile_y_;
-        unsigned idx = 0;
-        for (int k = 0; k < f.geometry_size();)
+        if (options->Has(String::NewSymbol("layer")))
         {
-            if (!length) {
-                unsigned cmd_length = f.geometry(k++);
-                cmd = cmd_length & ((1 << cmd_bits) - 1);
-                length = cmd_length >> cmd_bits;
+            Local<Value> layer_id = options->Get(String::New("layer"));
+            if (!layer_id->IsString())
+            {
+                return ThrowException(Exception::TypeError(String::New("layer value must be a string")));
             }
-            if (length > 0) {
-                length--;
-                if (cmd == mapnik::SEG_MOVETO || cmd == mapnik::SEG_LINETO)
+            layer_name = TOSTR(layer_id);
+        }
+    }
+
+    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = d->read_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
+    vector_tile_query_many_baton_t *closure = new vector_tile_query_many_baton_t();
+    closure->request.data = closure;
+    closure->d = d;
+    closure->coords.swap(coords);
+    closure->tolerance = tolerance;
+    closure->layer_name = layer_name;
+    if (has_callback)
+    {
+        Local<Value> callback = args[args.Length()-1];
+        closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
+        node_mapnik::queue_work(&closure->request, EIO_QueryMany, (uv_after_work_cb)EIO_AfterQueryMany, "vtile-query", node_mapnik::PRIORITY_HIGH);
+        d->Ref();
+        d->begin_read();
+        return Undefined();
+    }
+    try
+    {
+        query_many(closure);
+    }
+    catch (std::exception const& ex)
+    {
+        delete closure;
+        return ThrowException(Exception::Error(
+                                  String::New(ex.what())));
+    }
+    Local<Array> result = query_many_result(closure);
+    delete closure;
+    return scope.Close(result);
+}
+
+void VectorTile::EIO_QueryMany(uv_work_t* req)
+{
+    vector_tile_query_many_baton_t *closure = static_cast<vector_tile_query_many_baton_t *>(req->data);
+    try
+    {
+        query_many(closure);
+    }
+    catch (std::exception const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+    }
+}
+
+void VectorTile::EIO_AfterQueryMany(uv_work_t* req)
+{
+    HandleScope scope;
+    vector_tile_query_many_baton_t *closure = static_cast<vector_tile_query_many_baton_t *>(req->data);
+    closure->d->end_read();
+    TryCatch try_catch;
+    if (closure->error) {
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    }
+    else
+    {
+        Local<Value> argv[2] = { Local<Value>::New(Null()), query_many_result(closure) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+    }
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+    closure->d->Unref();
+    closure->cb.Dispose();
+    delete closure;
+}
+
+Handle<Value> VectorTile::toJSON(const Arguments& args)
+{
+    HandleScope scope;
+    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = d->read_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
+    std::size_t layer_num = d->layers_size();
+    Local<Array> arr = Array::New(layer_num);
+    try
+    {
+        for (std::size_t i=0; i < layer_num; ++i)
+        {
+            VectorTile::layer_ptr layer_data = d->get_layer(i);
+            mapnik::vector::tile_layer const& layer = *layer_data;
+            Local<Object> layer_obj = Object::New();
+            layer_obj->Set(String::NewSymbol("name"), String::New(layer.name().c_str()));
+            layer_obj->Set(String::NewSymbol("extent"), Integer::New(layer.extent()));
+            layer_obj->Set(String::NewSymbol("version"), Integer::New(layer.version()));
+
+            Local<Array> f_arr = Array::New(layer.features_size());
+            for (int j=0; j < layer.features_size(); ++j)
+            {
+                Local<Object> feature_obj = Object::New();
+                mapnik::vector::tile_feature const& f = layer.features(j);
+                feature_obj->Set(String::NewSymbol("id"),Number::New(f.id()));
+                feature_obj->Set(String::NewSymbol("type"),Integer::New(f.type()));
+                Local<Array> g_arr = Array::New();
+                for (int k = 0; k < f.geometry_size();++k)
                 {
-                    int32_t dx = f.geometry(k++);
-                    int32_t dy = f.geometry(k++);
-                    dx = ((dx >> 1) ^ (-(dx & 1)));
-                    dy = ((dy >> 1) ^ (-(dy & 1)));
-                    x1 += (static_cast<double>(dx) / scale_);
-                    y1 -= (static_cast<double>(dy) / scale_);
-                    double x2 = x1;
-                    double y2 = y1;
-                    if (tr.forward(x2,y2,zc))
+                    g_arr->Set(k,Number::New(f.geometry(k)));
+                }
+                feature_obj->Set(String::NewSymbol("geometry"),g_arr);
+                Local<Object> att_obj = Object::New();
+                for (int m = 0; m < f.tags_size(); m += 2)
+                {
+                    std::size_t key_name = f.tags(m);
+                    std::size_t key_value = f.tags(m + 1);
+                    if (key_name < static_cast<std::size_t>(layer.keys_size())
+                        && key_value < static_cast<std::size_t>(layer.values_size()))
                     {
-                        if (g_type == MAPNIK_POINT)
+                        std::string const& name = layer.keys(key_name);
+                        mapnik::vector::tile_value const& value = layer.values(key_value);
+                        if (value.has_string_value())
+                        {
+                            att_obj->Set(String::NewSymbol(name.c_str()), String::New(value.string_value().c_str()));
+                        }
+                        else if (value.has_int_value())
+                        {
+                            att_obj->Set(String::NewSymbol(name.c_str()), Number::New(value.int_value()));
+                        }
+                        else if (value.has_double_value())
+                        {
+                            att_obj->Set(String::NewSymbol(name.c_str()), Number::New(value.double_value()));
+                        }
+                        else if (value.has_float_value())
                         {
-                            g_arr->Set(0,Number::New(x2));
-                            g_arr->Set(1,Number::New(y2));
+                            att_obj->Set(String::NewSymbol(name.c_str()), Number::New(value.float_value()));
+                        }
+                        else if (value.has_bool_value())
+                        {
+                            att_obj->Set(String::NewSymbol(name.c_str()), Boolean::New(value.bool_value()));
+                        }
+                        else if (value.has_sint_value())
+                        {
+                            att_obj->Set(String::NewSymbol(name.c_str()), Number::New(value.sint_value()));
+                        }
+                        else if (value.has_uint_value())
+                        {
+                            att_obj->Set(String::NewSymbol(name.c_str()), Number::New(value.uint_value()));
                         }
                         else
                         {
-                            Local<Array> v_arr = Array::New(2);
-                            v_arr->Set(0,Number::New(x2));
-                            v_arr->Set(1,Number::New(y2));
-                            g_arr->Set(idx++,v_arr);
+                            att_obj->Set(String::NewSymbol(name.c_str()), Undefined());
                         }
                     }
-                    else
-                    {
-                        std::clog << "could not project\n";
-                    }
-                }
-                else if (cmd == (mapnik::SEG_CLOSE & ((1 << cmd_bits) - 1)))
-                {
-                    if (g_arr->Length() > 0) g_arr->Set(idx++,Local<Array>::Cast(g_arr->Get(0)));
+                    feature_obj->Set(String::NewSymbol("properties"),att_obj);
                 }
-                else
+
+                f_arr->Set(j,feature_obj);
+            }
+            layer_obj->Set(String::NewSymbol("features"), f_arr);
+            arr->Set(i, layer_obj);
+        }
+    }
+    catch (std::exception const& ex)
+    {
+        return ThrowException(Exception::Error(
+                                  String::New(ex.what())));
+    }
+    return scope.Close(arr);
+}
+
+// decodes the geometry commands of a feature into
+// lon/lat coordinates, repeating the first vertex on close
+static void decode_lonlat_coords(mapnik::vector::tile_feature const& f,
+                                 double tile_x_,
+                                 double tile_y_,
+                                 double scale_,
+                                 std::vector<double> & xs,
+                                 std::vector<double> & ys)
+{
+    xs.clear();
+    ys.clear();
+    int cmd = -1;
+    const int cmd_bits = 3;
+    unsigned length = 0;
+    double x1 = tile_x_;
+    double y1 = tile_y_;
+    for (int k = 0; k < f.geometry_size();)
+    {
+        if (!length) {
+            unsigned cmd_length = f.geometry(k++);
+            cmd = cmd_length & ((1 << cmd_bits) - 1);
+            length = cmd_length >> cmd_bits;
+        }
+        if (length > 0) {
+            length--;
+            if (cmd == mapnik::SEG_MOVETO || cmd == mapnik::SEG_LINETO)
+            {
+                int32_t dx = f.geometry(k++);
+                int32_t dy = f.geometry(k++);
+                dx = ((dx >> 1) ^ (-(dx & 1)));
+                dy = ((dy >> 1) ^ (-(dy & 1)));
+                x1 += (static_cast<double>(dx) / scale_);
+                y1 -= (static_cast<double>(dy) / scale_);
+                xs.push_back(x1);
+                ys.push_back(y1);
+            }
+            else if (cmd == (mapnik::SEG_CLOSE & ((1 << cmd_bits) - 1)))
+            {
+                if (!xs.empty())
                 {
-                    std::stringstream msg;
-                    msg << "Unknown command type (layer_to_geojson): "
-                        << cmd;
-                    throw std::runtime_error(msg.str());
+                    xs.push_back(xs.front());
+                    ys.push_back(ys.front());
                 }
             }
+            else
+            {
+                std::stringstream msg;
+                msg << "Unknown command type (layer_to_geojson): "
+                    << cmd;
+                throw std::runtime_error(msg.str());
+            }
+        }
+    }
+    // reproject all vertices in one pass
+    if (!xs.empty())
+    {
+        mapnik::merc2lonlat(&xs[0],&ys[0],static_cast<int>(xs.size()));
+    }
+}
+
+static void layer_to_geojson(mapnik::vector::tile_layer const& layer,
+                             Local<Array> f_arr,
+                             unsigned x,
+                             unsigned y,
+                             unsigned z,
+                             unsigned width,
+                             unsigned idx0)
+{
+    double resolution = mapnik::EARTH_CIRCUMFERENCE/(1 << z);
+    double tile_x_ = -0.5 * mapnik::EARTH_CIRCUMFERENCE + x * resolution;
+    double tile_y_ =  0.5 * mapnik::EARTH_CIRCUMFERENCE - y * resolution;
+    std::vector<double> xs;
+    std::vector<double> ys;
+    for (int j=0; j < layer.features_size(); ++j)
+    {
+        double scale_ = (static_cast<double>(layer.extent()) / width) * static_cast<double>(width)/resolution;
+        Local<Object> feature_obj = Object::New();
+        feature_obj->Set(String::NewSymbol("type"),String::New("Feature"));
+        Local<Object> geometry = Object::New();
+        mapnik::vector::tile_feature const& f = layer.features(j);
+        unsigned int g_type = f.type();
+        Local<String> js_type = String::New("Unknown");
+        switch (g_type)
+        {
+        case MAPNIK_POINT:
+        {
+            js_type = String::New("Point");
+            break;
+        }
+        case MAPNIK_LINESTRING:
+        {
+            js_type = String::New("LineString");
+            break;
+        }
+        case MAPNIK_POLYGON:
+        {
+            js_type = String::New("Polygon");
+            break;
+        }
+        default:
+        {
+            break;
+        }
+        }
+        geometry->Set(String::NewSymbol("type"),js_type);
+        Local<Array> g_arr = Array::New();
+        if (g_type == MAPNIK_POLYGON)
+        {
+            Local<Array> enclosing_array = Array::New(1);
+            enclosing_array->Set(0,g_arr);
+            geometry->Set(String::NewSymbol("coordinates"),enclosing_array);
+        }
+        else
+        {
+            geometry->Set(String::NewSymbol("coordinates"),g_arr);
+        }
+        decode_lonlat_coords(f,tile_x_,tile_y_,scale_,xs,ys);
+        if (g_type == MAPNIK_POINT)
+        {
+            if (!xs.empty())
+            {
+                g_arr->Set(0,Number::New(xs.back()));
+                g_arr->Set(1,Number::New(ys.back()));
+            }
+        }
+        else
+        {
+            for (std::size_t i = 0; i < xs.size(); ++i)
+            {
+                Local<Array> v_arr = Array::New(2);
+                v_arr->Set(0,Number::New(xs[i]));
+                v_arr->Set(1,Number::New(ys[i]));
+                g_arr->Set(i,v_arr);
+            }
         }
         feature_obj->Set(String::NewSymbol("geometry"),geometry);
         Local<Object> att_obj = Object::New();
@@ -968,70 +1905,330 @@ static void layer_to_geojson(mapnik::vector::tile_layer const& layer,
     }
 }
 
-Handle<Value> VectorTile::toGeoJSON(const Arguments& args)
+// matches JSON.stringify of the object output: null for nan and inf, and
+// the fewest digits that read back as the same double
+static void geojson_append_number(std::string & out, double val)
 {
-    HandleScope scope;
-    if (args.Length() < 1)
-        return ThrowException(Exception::Error(
-                                  String::New("first argument must be either a layer name (string) or layer index (integer)")));
-    Local<Value> layer_id = args[0];
-    if (! (layer_id->IsString() || layer_id->IsNumber()) )
-        return ThrowException(Exception::TypeError(
-                                  String::New("'layer' argument must be either a layer name (string) or layer index (integer)")));
-
-    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
-    mapnik::vector::tile const& tiledata = d->get_tile();
-    std::size_t layer_num = tiledata.layers_size();
-    int layer_idx = -1;
-    bool all_array = false;
-    bool all_flattened = false;
-
-    if (layer_id->IsString()) {
-        std::string layer_name = TOSTR(layer_id);
-        if (layer_name == "__array__")
+    if (val != val ||
+        val > std::numeric_limits<double>::max() ||
+        val < -std::numeric_limits<double>::max())
+    {
+        out += "null";
+        return;
+    }
+    char buf[32];
+    int len = 0;
+    for (int precision = 15; precision <= 17; ++precision)
+    {
+        len = snprintf(buf, sizeof(buf), "%.*g", precision, val);
+        if (std::strtod(buf, NULL) == val)
         {
-            all_array = true;
+            break;
         }
-        else if (layer_name == "__all__")
+    }
+    out.append(buf, len);
+}
+
+static void geojson_append_string(std::string & out, std::string const& val)
+{
+    out += '"';
+    for (std::string::const_iterator itr = val.begin(); itr != val.end(); ++itr)
+    {
+        unsigned char c = static_cast<unsigned char>(*itr);
+        switch (c)
         {
-            all_flattened = true;
-        }
-        else
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\b': out += "\\b"; break;
+        case '\f': out += "\\f"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
         {
-            bool found = false;
-            unsigned int idx(0);
-            for (unsigned i=0; i < layer_num; ++i)
+            if (c < 0x20)
             {
-                mapnik::vector::tile_layer const& layer = tiledata.layers(i);
-                if (layer.name() == layer_name)
-                {
-                    found = true;
-                    layer_idx = idx;
-                    break;
-                }
-                ++idx;
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
             }
-            if (!found)
+            else
             {
-                std::ostringstream s;
-                s << "Layer name '" << layer_name << "' not found";
-                return ThrowException(Exception::TypeError(String::New(s.str().c_str())));
+                out += *itr;
             }
         }
+        }
     }
-    else if (layer_id->IsNumber())
+    out += '"';
+}
+
+template <typename T>
+static void geojson_append_integer(std::string & out, T val)
+{
+    std::ostringstream s;
+    s << val;
+    out += s.str();
+}
+
+// writes the same features as layer_to_geojson, but as GeoJSON text
+// so that it can run off the main thread without touching V8
+static void layer_to_geojson_string(mapnik::vector::tile_layer const& layer,
+                                    std::string & out,
+                                    unsigned x,
+                                    unsigned y,
+                                    unsigned z,
+                                    unsigned width,
+                                    bool first)
+{
+    double resolution = mapnik::EARTH_CIRCUMFERENCE/(1 << z);
+    double tile_x_ = -0.5 * mapnik::EARTH_CIRCUMFERENCE + x * resolution;
+    double tile_y_ =  0.5 * mapnik::EARTH_CIRCUMFERENCE - y * resolution;
+    double scale_ = (static_cast<double>(layer.extent()) / width) * static_cast<double>(width)/resolution;
+    std::vector<double> xs;
+    std::vector<double> ys;
+    for (int j=0; j < layer.features_size(); ++j)
     {
-        layer_idx = layer_id->IntegerValue();
-        if (layer_idx < 0) {
-            std::ostringstream s;
-            s << "Zero-based layer index '" << layer_idx << "' not valid"
-              << " must be a positive integer";
-            if (layer_num > 0)
-            {
-                s << "only '" << layer_num << "' layers exist in map";
-            }
-            else
-            {
+        mapnik::vector::tile_feature const& f = layer.features(j);
+        unsigned int g_type = f.type();
+        if (!first) out += ',';
+        first = false;
+        out += "{\"type\":\"Feature\",\"geometry\":{\"type\":";
+        switch (g_type)
+        {
+        case MAPNIK_POINT:
+        {
+            out += "\"Point\"";
+            break;
+        }
+        case MAPNIK_LINESTRING:
+        {
+            out += "\"LineString\"";
+            break;
+        }
+        case MAPNIK_POLYGON:
+        {
+            out += "\"Polygon\"";
+            break;
+        }
+        default:
+        {
+            out += "\"Unknown\"";
+            break;
+        }
+        }
+        decode_lonlat_coords(f,tile_x_,tile_y_,scale_,xs,ys);
+        out += ",\"coordinates\":";
+        if (g_type == MAPNIK_POINT)
+        {
+            // like layer_to_geojson only the last point is kept
+            out += '[';
+            if (!xs.empty())
+            {
+                geojson_append_number(out, xs.back());
+                out += ',';
+                geojson_append_number(out, ys.back());
+            }
+            out += ']';
+        }
+        else
+        {
+            if (g_type == MAPNIK_POLYGON) out += '[';
+            out += '[';
+            for (std::size_t i = 0; i < xs.size(); ++i)
+            {
+                if (i > 0) out += ',';
+                out += '[';
+                geojson_append_number(out, xs[i]);
+                out += ',';
+                geojson_append_number(out, ys[i]);
+                out += ']';
+            }
+            out += ']';
+            if (g_type == MAPNIK_POLYGON) out += ']';
+        }
+        out += "},\"properties\":{";
+        bool first_prop = true;
+        for (int m = 0; m < f.tags_size(); m += 2)
+        {
+            std::size_t key_name = f.tags(m);
+            std::size_t key_value = f.tags(m + 1);
+            if (key_name < static_cast<std::size_t>(layer.keys_size())
+                && key_value < static_cast<std::size_t>(layer.values_size()))
+            {
+                mapnik::vector::tile_value const& value = layer.values(key_value);
+                if (!(value.has_string_value() ||
+                      value.has_int_value() ||
+                      value.has_double_value() ||
+                      value.has_float_value() ||
+                      value.has_bool_value() ||
+                      value.has_sint_value() ||
+                      value.has_uint_value()))
+                {
+                    // undefined values are dropped by JSON.stringify too
+                    continue;
+                }
+                if (!first_prop) out += ',';
+                first_prop = false;
+                geojson_append_string(out, layer.keys(key_name));
+                out += ':';
+                if (value.has_string_value())
+                {
+                    geojson_append_string(out, value.string_value());
+                }
+                else if (value.has_int_value())
+                {
+                    geojson_append_integer(out, value.int_value());
+                }
+                else if (value.has_double_value())
+                {
+                    geojson_append_number(out, value.double_value());
+                }
+                else if (value.has_float_value())
+                {
+                    geojson_append_number(out, value.float_value());
+                }
+                else if (value.has_bool_value())
+                {
+                    out += value.bool_value() ? "true" : "false";
+                }
+                else if (value.has_sint_value())
+                {
+                    geojson_append_integer(out, value.sint_value());
+                }
+                else if (value.has_uint_value())
+                {
+                    geojson_append_integer(out, value.uint_value());
+                }
+            }
+        }
+        out += "}}";
+    }
+}
+
+static void write_geojson(VectorTile * d,
+                          int layer_idx,
+                          bool all_array,
+                          bool all_flattened,
+                          std::string & out)
+{
+    std::size_t layer_num = d->layers_size();
+    if (all_array)
+    {
+        out += '[';
+        for (std::size_t i=0; i < layer_num; ++i)
+        {
+            VectorTile::layer_ptr layer_data = d->get_layer(i);
+            mapnik::vector::tile_layer const& layer = *layer_data;
+            if (i > 0) out += ',';
+            out += "{\"type\":\"FeatureCollection\",\"features\":[";
+            layer_to_geojson_string(layer,out,d->x_,d->y_,d->z_,d->width(),true);
+            out += "],\"name\":";
+            geojson_append_string(out, layer.name());
+            out += '}';
+        }
+        out += ']';
+    }
+    else if (all_flattened)
+    {
+        out += "{\"type\":\"FeatureCollection\",\"features\":[";
+        bool first = true;
+        for (std::size_t i=0; i < layer_num; ++i)
+        {
+            VectorTile::layer_ptr layer_data = d->get_layer(i);
+            mapnik::vector::tile_layer const& layer = *layer_data;
+            layer_to_geojson_string(layer,out,d->x_,d->y_,d->z_,d->width(),first);
+            if (layer.features_size() > 0) first = false;
+        }
+        out += "]}";
+    }
+    else
+    {
+        VectorTile::layer_ptr layer_data = d->get_layer(layer_idx);
+        mapnik::vector::tile_layer const& layer = *layer_data;
+        out += "{\"type\":\"FeatureCollection\",\"features\":[";
+        layer_to_geojson_string(layer,out,d->x_,d->y_,d->z_,d->width(),true);
+        out += "],\"name\":";
+        geojson_append_string(out, layer.name());
+        out += '}';
+    }
+}
+
+struct vector_tile_geojson_baton_t {
+    uv_work_t request;
+    VectorTile* d;
+    int layer_idx;
+    bool all_array;
+    bool all_flattened;
+    bool to_buffer;
+    bool error;
+    std::string error_name;
+    std::string result;
+    Persistent<Function> cb;
+    vector_tile_geojson_baton_t() :
+        request(),
+        d(NULL),
+        layer_idx(-1),
+        all_array(false),
+        all_flattened(false),
+        to_buffer(false),
+        error(false) {}
+};
+
+Handle<Value> VectorTile::toGeoJSON(const Arguments& args)
+{
+    HandleScope scope;
+    if (args.Length() < 1)
+        return ThrowException(Exception::Error(
+                                  String::New("first argument must be either a layer name (string) or layer index (integer)")));
+    Local<Value> layer_id = args[0];
+    if (! (layer_id->IsString() || layer_id->IsNumber()) )
+        return ThrowException(Exception::TypeError(
+                                  String::New("'layer' argument must be either a layer name (string) or layer index (integer)")));
+
+    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = d->read_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
+    std::size_t layer_num = d->layers_size();
+    int layer_idx = -1;
+    bool all_array = false;
+    bool all_flattened = false;
+
+    if (layer_id->IsString()) {
+        std::string layer_name = TOSTR(layer_id);
+        if (layer_name == "__array__")
+        {
+            all_array = true;
+        }
+        else if (layer_name == "__all__")
+        {
+            all_flattened = true;
+        }
+        else
+        {
+            layer_idx = d->find_layer(layer_name);
+            if (layer_idx < 0)
+            {
+                std::ostringstream s;
+                s << "Layer name '" << layer_name << "' not found";
+                return ThrowException(Exception::TypeError(String::New(s.str().c_str())));
+            }
+        }
+    }
+    else if (layer_id->IsNumber())
+    {
+        layer_idx = layer_id->IntegerValue();
+        if (layer_idx < 0) {
+            std::ostringstream s;
+            s << "Zero-based layer index '" << layer_idx << "' not valid"
+              << " must be a positive integer";
+            if (layer_num > 0)
+            {
+                s << "only '" << layer_num << "' layers exist in map";
+            }
+            else
+            {
                 s << "no layers found in map";
             }
             return ThrowException(Exception::TypeError(String::New(s.str().c_str())));
@@ -1052,8 +2249,69 @@ Handle<Value> VectorTile::toGeoJSON(const Arguments& args)
         return ThrowException(Exception::TypeError(String::New("layer id must be a string or index number")));
     }
 
+    // text output: {format:'string'} or {format:'buffer'}, always text when async
+    bool has_callback = args[args.Length()-1]->IsFunction();
+    bool to_string = has_callback;
+    bool to_buffer = false;
+    if (args.Length() > 1 && !args[1]->IsFunction())
+    {
+        if (!args[1]->IsObject())
+        {
+            return ThrowException(Exception::TypeError(String::New("optional second argument must be an options object")));
+        }
+        Local<Object> options = args[1]->ToObject();
+        if (options->Has(String::NewSymbol("format")))
+        {
+            Local<Value> format = options->Get(String::New("format"));
+            std::string format_name;
+            if (format->IsString()) format_name = TOSTR(format);
+            if (format_name == "string")
+            {
+                to_string = true;
+            }
+            else if (format_name == "buffer")
+            {
+                to_string = true;
+                to_buffer = true;
+            }
+            else if (format_name != "object" || has_callback)
+            {
+                return ThrowException(Exception::TypeError(
+                                          String::New(has_callback ? "'format' option must be either 'string' or 'buffer' when called with a callback"
+                                                                   : "'format' option must be one of 'object', 'string' or 'buffer'")));
+            }
+        }
+    }
+
+    if (has_callback)
+    {
+        Local<Value> callback = args[args.Length()-1];
+        vector_tile_geojson_baton_t *closure = new vector_tile_geojson_baton_t();
+        closure->request.data = closure;
+        closure->d = d;
+        closure->layer_idx = layer_idx;
+        closure->all_array = all_array;
+        closure->all_flattened = all_flattened;
+        closure->to_buffer = to_buffer;
+        closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
+        node_mapnik::queue_work(&closure->request, EIO_ToGeoJSON, (uv_after_work_cb)EIO_AfterToGeoJSON, "vtile-to-geojson");
+        d->Ref();
+        d->begin_read();
+        return Undefined();
+    }
+
     try
     {
+        if (to_string)
+        {
+            std::string result;
+            write_geojson(d,layer_idx,all_array,all_flattened,result);
+            if (to_buffer)
+            {
+                return scope.Close(node::Buffer::New((char*)result.data(),result.size())->handle_);
+            }
+            return scope.Close(String::New(result.data(),result.size()));
+        }
         if (all_array)
         {
             Local<Array> layer_arr = Array::New(layer_num);
@@ -1063,7 +2321,8 @@ Handle<Value> VectorTile::toGeoJSON(const Arguments& args)
                 layer_obj->Set(String::NewSymbol("type"), String::New("FeatureCollection"));
                 Local<Array> f_arr = Array::New();
                 layer_obj->Set(String::NewSymbol("features"), f_arr);
-                mapnik::vector::tile_layer const& layer = tiledata.layers(i);
+                VectorTile::layer_ptr layer_data = d->get_layer(i);
+                mapnik::vector::tile_layer const& layer = *layer_data;
                 layer_obj->Set(String::NewSymbol("name"), String::New(layer.name().c_str()));
                 layer_to_geojson(layer,f_arr,d->x_,d->y_,d->z_,d->width_,0);
                 layer_arr->Set(i,layer_obj);
@@ -1080,81 +2339,681 @@ Handle<Value> VectorTile::toGeoJSON(const Arguments& args)
             {
                 for (unsigned i=0;i<layer_num;++i)
                 {
-                    mapnik::vector::tile_layer const& layer = tiledata.layers(i);
+                    VectorTile::layer_ptr layer_data = d->get_layer(i);
+                    mapnik::vector::tile_layer const& layer = *layer_data;
                     layer_to_geojson(layer,f_arr,d->x_,d->y_,d->z_,d->width_,f_arr->Length());
                 }
                 return scope.Close(layer_obj);
             }
             else
             {
-                mapnik::vector::tile_layer const& layer = tiledata.layers(layer_idx);
+                VectorTile::layer_ptr layer_data = d->get_layer(layer_idx);
+                mapnik::vector::tile_layer const& layer = *layer_data;
                 layer_obj->Set(String::NewSymbol("name"), String::New(layer.name().c_str()));
                 layer_to_geojson(layer,f_arr,d->x_,d->y_,d->z_,d->width_,0);
                 return scope.Close(layer_obj);
             }
         }
-    }
-    catch (std::exception const& ex)
-    {
-        return ThrowException(Exception::Error(
-                                  String::New(ex.what())));
-    }
-}
-
-Handle<Value> VectorTile::parseSync(const Arguments& args)
-{
-    HandleScope scope;
-    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
-    try
-    {
-        d->parse_proto();
-    }
-    catch (std::exception const& ex)
-    {
+    }
+    catch (std::exception const& ex)
+    {
+        return ThrowException(Exception::Error(
+                                  String::New(ex.what())));
+    }
+}
+
+void VectorTile::EIO_ToGeoJSON(uv_work_t* req)
+{
+    vector_tile_geojson_baton_t *closure = static_cast<vector_tile_geojson_baton_t *>(req->data);
+    try
+    {
+        write_geojson(closure->d,closure->layer_idx,closure->all_array,closure->all_flattened,closure->result);
+    }
+    catch (std::exception const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+    }
+}
+
+void VectorTile::EIO_AfterToGeoJSON(uv_work_t* req)
+{
+    HandleScope scope;
+    vector_tile_geojson_baton_t *closure = static_cast<vector_tile_geojson_baton_t *>(req->data);
+    closure->d->end_read();
+    TryCatch try_catch;
+    if (closure->error) {
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    }
+    else
+    {
+        Local<Value> result;
+        if (closure->to_buffer)
+        {
+            result = Local<Value>::New(node::Buffer::New((char*)closure->result.data(),closure->result.size())->handle_);
+        }
+        else
+        {
+            result = String::New(closure->result.data(),closure->result.size());
+        }
+        Local<Value> argv[2] = { Local<Value>::New(Null()), result };
+        closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+    }
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+    closure->d->Unref();
+    closure->cb.Dispose();
+    delete closure;
+}
+
+Handle<Value> VectorTile::parseSync(const Arguments& args)
+{
+    HandleScope scope;
+    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = d->write_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
+    try
+    {
+        d->parse_proto();
+    }
+    catch (std::exception const& ex)
+    {
+        return ThrowException(Exception::Error(
+                                  String::New(ex.what())));
+    }
+    return Undefined();
+}
+
+typedef struct {
+    uv_work_t request;
+    VectorTile* d;
+    bool error;
+    std::string error_name;
+    Persistent<Function> cb;
+} vector_tile_parse_baton_t;
+
+Handle<Value> VectorTile::parse(const Arguments& args)
+{
+    HandleScope scope;
+    if (args.Length() == 0) {
+        return parseSync(args);
+    }
+
+    // ensure callback is a function
+    Local<Value> callback = args[args.Length()-1];
+    if (!args[args.Length()-1]->IsFunction())
+        return ThrowException(Exception::TypeError(
+                                  String::New("last argument must be a callback function")));
+
+    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = d->write_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
+    vector_tile_parse_baton_t *closure = new vector_tile_parse_baton_t();
+    closure->request.data = closure;
+    closure->d = d;
+    closure->error = false;
+    closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
+    node_mapnik::queue_work(&closure->request, EIO_Parse, (uv_after_work_cb)EIO_AfterParse, "vtile-parse", node_mapnik::PRIORITY_HIGH);
+    d->Ref();
+    d->begin_write();
+    return Undefined();
+}
+
+void VectorTile::EIO_Parse(uv_work_t* req)
+{
+    vector_tile_parse_baton_t *closure = static_cast<vector_tile_parse_baton_t *>(req->data);
+    try
+    {
+        closure->d->parse_proto();
+    }
+    catch (std::exception const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+    }
+}
+
+void VectorTile::EIO_AfterParse(uv_work_t* req)
+{
+    HandleScope scope;
+    vector_tile_parse_baton_t *closure = static_cast<vector_tile_parse_baton_t *>(req->data);
+    closure->d->end_write();
+    TryCatch try_catch;
+    if (closure->error) {
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    }
+    else
+    {
+        Local<Value> argv[1] = { Local<Value>::New(Null()) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    }
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+    closure->d->Unref();
+    closure->cb.Dispose();
+    delete closure;
+}
+
+Handle<Value> VectorTile::addData(const Arguments& args)
+{
+    HandleScope scope;
+    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = d->write_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
+    if (args.Length() < 1 || !args[0]->IsObject())
+        return ThrowException(Exception::Error(
+                                  String::New("first argument must be a buffer object")));
+    Local<Object> obj = args[0]->ToObject();
+    if (obj->IsNull() || obj->IsUndefined() || !node::Buffer::HasInstance(obj))
+        return ThrowException(Exception::Error(
+                                  String::New("first arg must be a buffer object")));
+    std::size_t buffer_size = node::Buffer::Length(obj);
+    if (buffer_size <= 0)
+    {
+        return ThrowException(Exception::Error(
+                                  String::New("cannot accept empty buffer as protobuf")));
+    }
+    d->detach_buffer();
+    const char * data = node::Buffer::Data(obj);
+    if (node_mapnik::is_compressed(data,buffer_size))
+    {
+        try
+        {
+            std::string inflated;
+            node_mapnik::decompress(data,buffer_size,inflated);
+            d->buffer_.append(inflated);
+        }
+        catch (std::exception const& ex)
+        {
+            return ThrowException(Exception::Error(
+                                      String::New(ex.what())));
+        }
+    }
+    else
+    {
+        d->buffer_.append(data,buffer_size);
+    }
+    d->status_ = VectorTile::LAZY_MERGE;
+    d->index_layers();
+    return Undefined();
+}
+
+// parses the optional {copy:Boolean} options of setData
+static bool setdata_copy_option(Arguments const& args, bool has_callback, bool & copy, std::string & error_name)
+{
+    int num_args = has_callback ? args.Length() - 1 : args.Length();
+    if (num_args > 1)
+    {
+        if (!args[1]->IsObject())
+        {
+            error_name = "optional second argument must be an options object";
+            return false;
+        }
+        Local<Object> options = args[1]->ToObject();
+        if (options->Has(String::NewSymbol("copy")))
+        {
+            Local<Value> param_val = options->Get(String::NewSymbol("copy"));
+            if (!param_val->IsBoolean())
+            {
+                error_name = "option 'copy' must be a boolean";
+                return false;
+            }
+            copy = param_val->BooleanValue();
+        }
+    }
+    return true;
+}
+
+Handle<Value> VectorTile::setDataSync(const Arguments& args)
+{
+    HandleScope scope;
+    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = d->write_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
+    if (args.Length() < 1 || !args[0]->IsObject())
+        return ThrowException(Exception::Error(
+                                  String::New("first argument must be a buffer object")));
+    Local<Object> obj = args[0]->ToObject();
+    if (obj->IsNull() || obj->IsUndefined() || !node::Buffer::HasInstance(obj))
+        return ThrowException(Exception::Error(
+                                  String::New("first arg must be a buffer object")));
+    std::size_t buffer_size = node::Buffer::Length(obj);
+    if (buffer_size <= 0)
+    {
+        return ThrowException(Exception::Error(
+                                  String::New("cannot accept empty buffer as protobuf")));
+    }
+    bool copy = true;
+    std::string error_name;
+    if (!setdata_copy_option(args,false,copy,error_name))
+    {
+        return ThrowException(Exception::TypeError(String::New(error_name.c_str())));
+    }
+    const char * data = node::Buffer::Data(obj);
+    if (node_mapnik::is_compressed(data,buffer_size))
+    {
+        // the tile keeps its data if the input does not inflate
+        std::string inflated;
+        try
+        {
+            node_mapnik::decompress(data,buffer_size,inflated);
+        }
+        catch (std::exception const& ex)
+        {
+            return ThrowException(Exception::Error(
+                                      String::New(ex.what())));
+        }
+        d->release_buffer();
+        d->buffer_.swap(inflated);
+    }
+    else if (copy)
+    {
+        d->release_buffer();
+        d->buffer_ = std::string(data,buffer_size);
+    }
+    else
+    {
+        // keep a reference to the caller's buffer and parse it in place
+        d->borrow_buffer(obj);
+    }
+    d->status_ = VectorTile::LAZY_SET;
+    d->index_layers();
+    return Undefined();
+}
+
+typedef struct {
+    uv_work_t request;
+    VectorTile* d;
+    char *data;
+    size_t dataLength;
+    bool copy;
+    bool compressed;
+    std::string inflated;
+    bool error;
+    std::string error_name;
+    Persistent<Object> buffer;
+    Persistent<Function> cb;
+} vector_tile_setdata_baton_t;
+
+Handle<Value> VectorTile::setData(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() == 0 || !args[args.Length()-1]->IsFunction()) {
+        return setDataSync(args);
+    }
+
+    Local<Value> callback = args[args.Length()-1];
+    if (args.Length() < 1 || !args[0]->IsObject())
+        return ThrowException(Exception::Error(
+                                  String::New("first argument must be a buffer object")));
+    Local<Object> obj = args[0]->ToObject();
+    if (obj->IsNull() || obj->IsUndefined() || !node::Buffer::HasInstance(obj))
+        return ThrowException(Exception::Error(
+                                  String::New("first arg must be a buffer object")));
+    bool copy = true;
+    std::string error_name;
+    if (!setdata_copy_option(args,true,copy,error_name))
+    {
+        return ThrowException(Exception::TypeError(String::New(error_name.c_str())));
+    }
+
+    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = d->write_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
+    // compressed data is inflated on the worker, so never borrowed. The
+    // current data is kept (as a copy) in case it does not inflate.
+    bool compressed = node_mapnik::is_compressed(node::Buffer::Data(obj),node::Buffer::Length(obj));
+    if (compressed)
+    {
+        d->detach_buffer();
+    }
+    else if (copy)
+    {
+        d->release_buffer();
+    }
+    else
+    {
+        d->borrow_buffer(obj);
+    }
+
+    vector_tile_setdata_baton_t *closure = new vector_tile_setdata_baton_t();
+    closure->request.data = closure;
+    closure->d = d;
+    closure->data = node::Buffer::Data(obj);
+    closure->dataLength = node::Buffer::Length(obj);
+    closure->copy = copy || compressed;
+    closure->compressed = compressed;
+    closure->error = false;
+    // keeps the source alive until the worker has copied it
+    closure->buffer = Persistent<Object>::New(obj);
+    closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
+    node_mapnik::queue_work(&closure->request, EIO_SetData, (uv_after_work_cb)EIO_AfterSetData, "vtile-set-data", node_mapnik::PRIORITY_HIGH);
+    d->Ref();
+    d->begin_write();
+    return Undefined();
+}
+
+void VectorTile::EIO_SetData(uv_work_t* req)
+{
+    vector_tile_setdata_baton_t *closure = static_cast<vector_tile_setdata_baton_t *>(req->data);
+
+    if (closure->compressed)
+    {
+        try
+        {
+            node_mapnik::decompress(closure->data,closure->dataLength,closure->inflated);
+        }
+        catch (std::exception const& ex)
+        {
+            closure->error = true;
+            closure->error_name = ex.what();
+            return;
+        }
+    }
+    try
+    {
+        if (closure->compressed)
+        {
+            closure->d->buffer_.swap(closure->inflated);
+        }
+        else if (closure->copy)
+        {
+            closure->d->buffer_ = std::string(closure->data,closure->dataLength);
+        }
+        closure->d->status_ = VectorTile::LAZY_SET;
+        closure->d->index_layers();
+    }
+    catch (std::exception const& ex)
+    {
+        closure->d->buffer_.clear();
+        closure->d->status_ = VectorTile::LAZY_SET;
+        closure->d->index_layers();
+        closure->error = true;
+        closure->error_name = ex.what();
+    }
+}
+
+void VectorTile::EIO_AfterSetData(uv_work_t* req)
+{
+    HandleScope scope;
+
+    vector_tile_setdata_baton_t *closure = static_cast<vector_tile_setdata_baton_t *>(req->data);
+    closure->d->end_write();
+
+    TryCatch try_catch;
+
+    if (closure->error) {
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    }
+    else
+    {
+        Local<Value> argv[1] = { Local<Value>::New(Null()) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    }
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+    closure->d->Unref();
+    closure->buffer.Dispose();
+    closure->cb.Dispose();
+    delete closure;
+}
+
+enum getdata_compression {
+    GETDATA_NONE = 0,
+    GETDATA_GZIP,
+    GETDATA_DEFLATE
+};
+
+struct vector_tile_getdata_baton_t {
+    uv_work_t request;
+    VectorTile* d;
+    getdata_compression compression;
+    int level;
+    bool filter_layers;
+    std::vector<std::string> layers;
+    std::string data;
+    bool error;
+    std::string error_name;
+    Persistent<Function> cb;
+    vector_tile_getdata_baton_t() :
+        request(),
+        d(NULL),
+        compression(GETDATA_NONE),
+        level(Z_DEFAULT_COMPRESSION),
+        filter_layers(false),
+        layers(),
+        data(),
+        error(false) {}
+};
+
+static bool getdata_parse_args(Arguments const& args,
+                               bool has_callback,
+                               vector_tile_getdata_baton_t & closure)
+{
+    int num_args = has_callback ? args.Length() - 1 : args.Length();
+    if (num_args > 0)
+    {
+        if (!args[0]->IsObject())
+        {
+            closure.error_name = "optional first argument must be an options object";
+            return false;
+        }
+        Local<Object> options = args[0]->ToObject();
+        if (options->Has(String::NewSymbol("compression")))
+        {
+            Local<Value> param_val = options->Get(String::NewSymbol("compression"));
+            std::string compression;
+            if (param_val->IsString()) compression = TOSTR(param_val);
+            if (compression == "gzip")
+            {
+                closure.compression = GETDATA_GZIP;
+            }
+            else if (compression == "deflate")
+            {
+                closure.compression = GETDATA_DEFLATE;
+            }
+            else if (compression != "none")
+            {
+                closure.error_name = "option 'compression' must be one of 'none', 'gzip' or 'deflate'";
+                return false;
+            }
+        }
+        if (options->Has(String::NewSymbol("level")))
+        {
+            Local<Value> param_val = options->Get(String::NewSymbol("level"));
+            if (!param_val->IsNumber() ||
+                param_val->IntegerValue() < Z_NO_COMPRESSION ||
+                param_val->IntegerValue() > Z_BEST_COMPRESSION)
+            {
+                closure.error_name = "option 'level' must be an integer between 0 and 9";
+                return false;
+            }
+            closure.level = static_cast<int>(param_val->IntegerValue());
+        }
+        if (options->Has(String::NewSymbol("layers")))
+        {
+            Local<Value> param_val = options->Get(String::NewSymbol("layers"));
+            if (!param_val->IsArray())
+            {
+                closure.error_name = "option 'layers' must be an array of layer names";
+                return false;
+            }
+            Local<Array> names = Local<Array>::Cast(param_val);
+            unsigned num_names = names->Length();
+            for (unsigned i = 0; i < num_names; ++i)
+            {
+                Local<Value> name = names->Get(i);
+                if (!name->IsString())
+                {
+                    closure.error_name = "option 'layers' must be an array of layer names";
+                    return false;
+                }
+                closure.layers.push_back(TOSTR(name));
+            }
+            closure.filter_layers = true;
+        }
+    }
+    return true;
+}
+
+// serializes the parsed tile when the raw bytes do not describe all of it.
+// Returns false if the raw bytes can be used as they are.
+static bool serialize_tile(VectorTile * d, std::string & serialized)
+{
+    if (d->byte_size() <= static_cast<int>(d->raw_size()))
+    {
+        return false;
+    }
+    // NOTE: see getData about cached sizes
+    mapnik::vector::tile const& tiledata = d->get_tile();
+    serialized.resize(d->byte_size());
+    google::protobuf::uint8* start = reinterpret_cast<google::protobuf::uint8*>(&serialized[0]);
+    google::protobuf::uint8* end = tiledata.SerializeWithCachedSizesToArray(start);
+    if (end - start != d->byte_size())
+    {
+        throw std::runtime_error("serialization failed, possible race condition");
+    }
+    return true;
+}
+
+// encodes the tile into closure.data, compressed if requested
+static void get_tile_data(vector_tile_getdata_baton_t & closure)
+{
+    VectorTile* d = closure.d;
+    std::string serialized;
+    bool use_serialized = true;
+    const char * data = d->raw_data();
+    std::size_t size = d->raw_size();
+    if (closure.filter_layers)
+    {
+        // only the byte ranges of the selected layers are copied
+        d->write_layers(closure.layers,serialized);
+    }
+    else
+    {
+        use_serialized = serialize_tile(d,serialized);
+    }
+    if (use_serialized)
+    {
+        data = serialized.data();
+        size = serialized.size();
+    }
+    if (closure.compression == GETDATA_NONE)
+    {
+        if (use_serialized) closure.data.swap(serialized);
+        else closure.data.assign(data,size);
+    }
+    else if (size > 0)
+    {
+        node_mapnik::compress(data,size,closure.data,closure.compression == GETDATA_GZIP,closure.level);
+    }
+}
+
+Handle<Value> VectorTile::getData(const Arguments& args)
+{
+    HandleScope scope;
+    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = d->read_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
+    if (args.Length() > 0)
+    {
+        bool has_callback = args[args.Length()-1]->IsFunction();
+        vector_tile_getdata_baton_t *closure = new vector_tile_getdata_baton_t();
+        closure->request.data = closure;
+        closure->d = d;
+        if (!getdata_parse_args(args,has_callback,*closure))
+        {
+            Local<Value> err = Exception::TypeError(String::New(closure->error_name.c_str()));
+            delete closure;
+            return ThrowException(err);
+        }
+        if (has_callback)
+        {
+            Local<Value> callback = args[args.Length()-1];
+            closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
+            node_mapnik::queue_work(&closure->request, EIO_GetData, (uv_after_work_cb)EIO_AfterGetData, "vtile-get-data", node_mapnik::PRIORITY_HIGH);
+            d->Ref();
+            d->begin_read();
+            return Undefined();
+        }
+        if (closure->compression != GETDATA_NONE || closure->filter_layers)
+        {
+            try
+            {
+                get_tile_data(*closure);
+            }
+            catch (std::exception const& ex)
+            {
+                delete closure;
+                return ThrowException(Exception::Error(
+                                          String::New(ex.what())));
+            }
+            Local<Object> retbuf = Local<Object>::New(node::Buffer::New((char*)closure->data.data(),closure->data.size())->handle_);
+            delete closure;
+            return scope.Close(retbuf);
+        }
+        delete closure;
+    }
+    try {
+        // shortcut: return raw data and avoid trip through proto object
+        // TODO  - safe for null string?
+        int raw_size = d->raw_size();
+        if (d->byte_size_ <= raw_size) {
+            if (!d->borrowed_buffer_.IsEmpty())
+            {
+                // the caller's buffer still holds exactly this data
+                return scope.Close(d->borrowed_buffer_);
+            }
+            return scope.Close(node::Buffer::New((char*)d->raw_data(),raw_size)->handle_);
+        } else {
+            // NOTE: tiledata.ByteSize() must be called
+            // after each modification of tiledata otherwise the
+            // SerializeWithCachedSizesToArray will throw
+            mapnik::vector::tile const& tiledata = d->get_tile();
+            node::Buffer *retbuf = node::Buffer::New(d->byte_size_);
+            // TODO - consider wrapping in fastbuffer: https://gist.github.com/drewish/2732711
+            // http://www.samcday.com.au/blog/2011/03/03/creating-a-proper-buffer-in-a-node-c-addon/
+            google::protobuf::uint8* start = reinterpret_cast<google::protobuf::uint8*>(node::Buffer::Data(retbuf));
+            google::protobuf::uint8* end = tiledata.SerializeWithCachedSizesToArray(start);
+            if (end - start != d->byte_size_) {
+                return ThrowException(Exception::Error(
+                                          String::New("serialization failed, possible race condition")));
+            }
+            return scope.Close(retbuf->handle_);
+        }
+    } catch (std::exception const& ex) {
         return ThrowException(Exception::Error(
                                   String::New(ex.what())));
     }
     return Undefined();
 }
 
-typedef struct {
-    uv_work_t request;
-    VectorTile* d;
-    bool error;
-    std::string error_name;
-    Persistent<Function> cb;
-} vector_tile_parse_baton_t;
-
-Handle<Value> VectorTile::parse(const Arguments& args)
-{
-    HandleScope scope;
-    if (args.Length() == 0) {
-        return parseSync(args);
-    }
-
-    // ensure callback is a function
-    Local<Value> callback = args[args.Length()-1];
-    if (!args[args.Length()-1]->IsFunction())
-        return ThrowException(Exception::TypeError(
-                                  String::New("last argument must be a callback function")));
-
-    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
-    vector_tile_parse_baton_t *closure = new vector_tile_parse_baton_t();
-    closure->request.data = closure;
-    closure->d = d;
-    closure->error = false;
-    closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Parse, (uv_after_work_cb)EIO_AfterParse);
-    d->Ref();
-    return Undefined();
-}
-
-void VectorTile::EIO_Parse(uv_work_t* req)
+void VectorTile::EIO_GetData(uv_work_t* req)
 {
-    vector_tile_parse_baton_t *closure = static_cast<vector_tile_parse_baton_t *>(req->data);
+    vector_tile_getdata_baton_t *closure = static_cast<vector_tile_getdata_baton_t *>(req->data);
     try
     {
-        closure->d->parse_proto();
+        get_tile_data(*closure);
     }
     catch (std::exception const& ex)
     {
@@ -1163,19 +3022,21 @@ void VectorTile::EIO_Parse(uv_work_t* req)
     }
 }
 
-void VectorTile::EIO_AfterParse(uv_work_t* req)
+void VectorTile::EIO_AfterGetData(uv_work_t* req)
 {
     HandleScope scope;
-    vector_tile_parse_baton_t *closure = static_cast<vector_tile_parse_baton_t *>(req->data);
+    vector_tile_getdata_baton_t *closure = static_cast<vector_tile_getdata_baton_t *>(req->data);
+    closure->d->end_read();
     TryCatch try_catch;
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     }
     else
     {
-        Local<Value> argv[1] = { Local<Value>::New(Null()) };
-        closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+        Local<Value> argv[2] = { Local<Value>::New(Null()),
+                                 Local<Value>::New(node::Buffer::New((char*)closure->data.data(),closure->data.size())->handle_) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
     }
     if (try_catch.HasCaught()) {
         node::FatalException(try_catch);
@@ -1185,104 +3046,192 @@ void VectorTile::EIO_AfterParse(uv_work_t* req)
     delete closure;
 }
 
-Handle<Value> VectorTile::addData(const Arguments& args)
-{
-    HandleScope scope;
-    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
-    if (args.Length() < 1 || !args[0]->IsObject())
-        return ThrowException(Exception::Error(
-                                  String::New("first argument must be a buffer object")));
-    Local<Object> obj = args[0]->ToObject();
-    if (obj->IsNull() || obj->IsUndefined() || !node::Buffer::HasInstance(obj))
-        return ThrowException(Exception::Error(
-                                  String::New("first arg must be a buffer object")));
-    std::size_t buffer_size = node::Buffer::Length(obj);
-    if (buffer_size <= 0)
+struct layer_info {
+    std::string name;
+    unsigned version;
+    unsigned extent;
+    std::size_t bytes;
+    std::size_t features;
+    std::size_t keys;
+    std::size_t values;
+    // features by mapnik::vector::tile_GeomType
+    std::size_t geometry_types[4];
+    layer_info() :
+        name(),
+        version(1),
+        extent(4096),
+        bytes(0),
+        features(0),
+        keys(0),
+        values(0)
     {
-        return ThrowException(Exception::Error(
-                                  String::New("cannot accept empty buffer as protobuf")));
+        std::fill(geometry_types, geometry_types + 4, 0);
     }
-    d->buffer_.append(node::Buffer::Data(obj),buffer_size);
-    d->status_ = VectorTile::LAZY_MERGE;
-    return Undefined();
-}
+};
 
-Handle<Value> VectorTile::setDataSync(const Arguments& args)
+// walks the encoded layers without decoding the features themselves
+static void tile_info(const char * data, std::size_t size, std::vector<layer_info> & layers)
 {
-    HandleScope scope;
-    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
-    if (args.Length() < 1 || !args[0]->IsObject())
-        return ThrowException(Exception::Error(
-                                  String::New("first argument must be a buffer object")));
-    Local<Object> obj = args[0]->ToObject();
-    if (obj->IsNull() || obj->IsUndefined() || !node::Buffer::HasInstance(obj))
-        return ThrowException(Exception::Error(
-                                  String::New("first arg must be a buffer object")));
-    std::size_t buffer_size = node::Buffer::Length(obj);
-    if (buffer_size <= 0)
-    {
-        return ThrowException(Exception::Error(
-                                  String::New("cannot accept empty buffer as protobuf")));
+    pbf::message item(data,size);
+    while (item.next()) {
+        if (item.tag == 3) {
+            uint64_t len = item.varint();
+            layer_info info;
+            info.bytes = static_cast<std::size_t>(len);
+            pbf::message layermsg(item.getData(),info.bytes);
+            while (layermsg.next()) {
+                switch (layermsg.tag) {
+                case 1:
+                    info.name = layermsg.string();
+                    break;
+                case 2:
+                {
+                    uint64_t feature_len = layermsg.varint();
+                    pbf::message featuremsg(layermsg.getData(),static_cast<std::size_t>(feature_len));
+                    uint64_t geom_type = 0;
+                    while (featuremsg.next()) {
+                        if (featuremsg.tag == 3) {
+                            geom_type = featuremsg.varint();
+                        } else {
+                            featuremsg.skip();
+                        }
+                    }
+                    layermsg.skipBytes(feature_len);
+                    ++info.features;
+                    ++info.geometry_types[geom_type < 4 ? geom_type : 0];
+                    break;
+                }
+                case 3:
+                    ++info.keys;
+                    layermsg.skip();
+                    break;
+                case 4:
+                    ++info.values;
+                    layermsg.skip();
+                    break;
+                case 5:
+                    info.extent = static_cast<unsigned>(layermsg.varint());
+                    break;
+                case 15:
+                    info.version = static_cast<unsigned>(layermsg.varint());
+                    break;
+                default:
+                    layermsg.skip();
+                    break;
+                }
+            }
+            item.skipBytes(len);
+            layers.push_back(info);
+        } else {
+            item.skip();
+        }
     }
-    d->buffer_ = std::string(node::Buffer::Data(obj),buffer_size);
-    d->status_ = VectorTile::LAZY_SET;
-    return Undefined();
 }
 
-typedef struct {
+struct vector_tile_info_baton_t {
     uv_work_t request;
     VectorTile* d;
-    char *data;
-    size_t dataLength;
+    std::size_t bytes;
+    std::vector<layer_info> layers;
     bool error;
     std::string error_name;
     Persistent<Function> cb;
-} vector_tile_setdata_baton_t;
+    vector_tile_info_baton_t() :
+        request(),
+        d(NULL),
+        bytes(0),
+        layers(),
+        error(false) {}
+};
 
-Handle<Value> VectorTile::setData(const Arguments& args)
+static void get_tile_info(vector_tile_info_baton_t & closure)
 {
-    HandleScope scope;
-
-    if (args.Length() == 1) {
-        return setDataSync(args);
+    std::string serialized;
+    if (serialize_tile(closure.d,serialized))
+    {
+        closure.bytes = serialized.size();
+        tile_info(serialized.data(),serialized.size(),closure.layers);
     }
+    else
+    {
+        closure.bytes = closure.d->raw_size();
+        tile_info(closure.d->raw_data(),closure.d->raw_size(),closure.layers);
+    }
+}
 
-    // ensure callback is a function
-    Local<Value> callback = args[args.Length()-1];
-    if (!args[args.Length()-1]->IsFunction())
-        return ThrowException(Exception::TypeError(
-                                  String::New("last argument must be a callback function")));
-
-    if (args.Length() < 1 || !args[0]->IsObject())
-        return ThrowException(Exception::Error(
-                                  String::New("first argument must be a buffer object")));
-    Local<Object> obj = args[0]->ToObject();
-    if (obj->IsNull() || obj->IsUndefined() || !node::Buffer::HasInstance(obj))
-        return ThrowException(Exception::Error(
-                                  String::New("first arg must be a buffer object")));
+static Local<Object> tile_info_object(vector_tile_info_baton_t const& closure)
+{
+    Local<Object> info = Object::New();
+    info->Set(String::NewSymbol("bytes"), Number::New(closure.bytes));
+    Local<Array> layers = Array::New(closure.layers.size());
+    for (std::size_t i = 0; i < closure.layers.size(); ++i)
+    {
+        layer_info const& layer = closure.layers[i];
+        Local<Object> layer_obj = Object::New();
+        layer_obj->Set(String::NewSymbol("name"), String::New(layer.name.c_str()));
+        layer_obj->Set(String::NewSymbol("version"), Integer::NewFromUnsigned(layer.version));
+        layer_obj->Set(String::NewSymbol("extent"), Integer::NewFromUnsigned(layer.extent));
+        layer_obj->Set(String::NewSymbol("bytes"), Number::New(layer.bytes));
+        layer_obj->Set(String::NewSymbol("features"), Number::New(layer.features));
+        layer_obj->Set(String::NewSymbol("keys"), Number::New(layer.keys));
+        layer_obj->Set(String::NewSymbol("values"), Number::New(layer.values));
+        Local<Object> geometry_types = Object::New();
+        geometry_types->Set(String::NewSymbol("unknown"), Number::New(layer.geometry_types[0]));
+        geometry_types->Set(String::NewSymbol("point"), Number::New(layer.geometry_types[1]));
+        geometry_types->Set(String::NewSymbol("linestring"), Number::New(layer.geometry_types[2]));
+        geometry_types->Set(String::NewSymbol("polygon"), Number::New(layer.geometry_types[3]));
+        layer_obj->Set(String::NewSymbol("geometry_types"), geometry_types);
+        layers->Set(i, layer_obj);
+    }
+    info->Set(String::NewSymbol("layers"), layers);
+    return info;
+}
 
+Handle<Value> VectorTile::info(const Arguments& args)
+{
+    HandleScope scope;
     VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
-
-    vector_tile_setdata_baton_t *closure = new vector_tile_setdata_baton_t();
-    closure->request.data = closure;
-    closure->d = d;
-    closure->data = node::Buffer::Data(obj);
-    closure->dataLength = node::Buffer::Length(obj);
-    closure->error = false;
-    closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_SetData, (uv_after_work_cb)EIO_AfterSetData);
-    d->Ref();
-    return Undefined();
+    if (const char * busy = d->read_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
+    if (args.Length() > 0)
+    {
+        Local<Value> callback = args[args.Length()-1];
+        if (!callback->IsFunction())
+        {
+            return ThrowException(Exception::TypeError(
+                                      String::New("last argument must be a callback function")));
+        }
+        vector_tile_info_baton_t *closure = new vector_tile_info_baton_t();
+        closure->request.data = closure;
+        closure->d = d;
+        closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
+        node_mapnik::queue_work(&closure->request, EIO_Info, (uv_after_work_cb)EIO_AfterInfo, "vtile-info", node_mapnik::PRIORITY_HIGH);
+        d->Ref();
+        d->begin_read();
+        return Undefined();
+    }
+    vector_tile_info_baton_t closure;
+    closure.d = d;
+    try
+    {
+        get_tile_info(closure);
+    }
+    catch (std::exception const& ex)
+    {
+        return ThrowException(Exception::Error(
+                                  String::New(ex.what())));
+    }
+    return scope.Close(tile_info_object(closure));
 }
 
-void VectorTile::EIO_SetData(uv_work_t* req)
+void VectorTile::EIO_Info(uv_work_t* req)
 {
-    vector_tile_setdata_baton_t *closure = static_cast<vector_tile_setdata_baton_t *>(req->data);
-
+    vector_tile_info_baton_t *closure = static_cast<vector_tile_info_baton_t *>(req->data);
     try
     {
-        closure->d->buffer_ = std::string(closure->data,closure->dataLength);
-        closure->d->status_ = VectorTile::LAZY_SET;
+        get_tile_info(*closure);
     }
     catch (std::exception const& ex)
     {
@@ -1291,24 +3240,21 @@ void VectorTile::EIO_SetData(uv_work_t* req)
     }
 }
 
-void VectorTile::EIO_AfterSetData(uv_work_t* req)
+void VectorTile::EIO_AfterInfo(uv_work_t* req)
 {
     HandleScope scope;
-
-    vector_tile_setdata_baton_t *closure = static_cast<vector_tile_setdata_baton_t *>(req->data);
-
+    vector_tile_info_baton_t *closure = static_cast<vector_tile_info_baton_t *>(req->data);
+    closure->d->end_read();
     TryCatch try_catch;
-
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     }
     else
     {
-        Local<Value> argv[1] = { Local<Value>::New(Null()) };
-        closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+        Local<Value> argv[2] = { Local<Value>::New(Null()), tile_info_object(*closure) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
     }
-
     if (try_catch.HasCaught()) {
         node::FatalException(try_catch);
     }
@@ -1317,42 +3263,13 @@ void VectorTile::EIO_AfterSetData(uv_work_t* req)
     delete closure;
 }
 
-Handle<Value> VectorTile::getData(const Arguments& args)
-{
-    HandleScope scope;
-    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
-    try {
-        // shortcut: return raw data and avoid trip through proto object
-        // TODO  - safe for null string?
-        int raw_size = d->buffer_.size();
-        if (d->byte_size_ <= raw_size) {
-            return scope.Close(node::Buffer::New((char*)d->buffer_.data(),raw_size)->handle_);
-        } else {
-            // NOTE: tiledata.ByteSize() must be called
-            // after each modification of tiledata otherwise the
-            // SerializeWithCachedSizesToArray will throw
-            mapnik::vector::tile const& tiledata = d->get_tile();
-            node::Buffer *retbuf = node::Buffer::New(d->byte_size_);
-            // TODO - consider wrapping in fastbuffer: https://gist.github.com/drewish/2732711
-            // http://www.samcday.com.au/blog/2011/03/03/creating-a-proper-buffer-in-a-node-c-addon/
-            google::protobuf::uint8* start = reinterpret_cast<google::protobuf::uint8*>(node::Buffer::Data(retbuf));
-            google::protobuf::uint8* end = tiledata.SerializeWithCachedSizesToArray(start);
-            if (end - start != d->byte_size_) {
-                return ThrowException(Exception::Error(
-                                          String::New("serialization failed, possible race condition")));
-            }
-            return scope.Close(retbuf->handle_);
-        }
-    } catch (std::exception const& ex) {
-        return ThrowException(Exception::Error(
-                                  String::New(ex.what())));
-    }
-    return Undefined();
-}
+struct vector_tile_render_many_baton_t;
 
 struct vector_tile_render_baton_t {
     uv_work_t request;
     Map* m;
+    map_ptr map; // the map as it was when render was called
+    unsigned long layers_stamp;
     VectorTile* d;
     Image * im;
     CairoSurface * c;
@@ -1369,12 +3286,22 @@ struct vector_tile_render_baton_t {
     double scale_factor;
     double scale_denominator;
     std::string error_name;
+    std::string error_code;
+    node_mapnik::cancel_token cancel;
+    node_mapnik::render_stats_ptr stats; // set when 'stats' was requested
     Persistent<Function> cb;
     std::string result;
     bool use_cairo;
+    unsigned metatile;
+    node_mapnik::encode_options encoding;
+    image_ptr scratch; // render target when no Image is passed
+    vector_tile_render_many_baton_t * batch;
+    std::size_t batch_idx;
     vector_tile_render_baton_t() :
         request(),
         m(NULL),
+        map(),
+        layers_stamp(0),
         d(NULL),
         im(NULL),
         c(NULL),
@@ -1390,14 +3317,60 @@ struct vector_tile_render_baton_t {
         buffer_size(0),
         scale_factor(1.0),
         scale_denominator(0.0),
-        use_cairo(true) {}
+        cancel(),
+        stats(),
+        use_cairo(true),
+        metatile(0),
+        encoding(),
+        scratch(),
+        batch(NULL),
+        batch_idx(0) {}
 };
 
+// options shared by render and renderMany
+static bool render_parse_options(Local<Object> const& options,
+                                 vector_tile_render_baton_t & closure,
+                                 std::string & error_name)
+{
+    if (options->Has(String::New("buffer_size"))) {
+        Local<Value> bind_opt = options->Get(String::New("buffer_size"));
+        if (!bind_opt->IsNumber()) {
+            error_name = "optional arg 'buffer_size' must be a number";
+            return false;
+        }
+        closure.buffer_size = bind_opt->IntegerValue();
+    }
+    if (options->Has(String::New("scale"))) {
+        Local<Value> bind_opt = options->Get(String::New("scale"));
+        if (!bind_opt->IsNumber())
+        {
+            error_name = "optional arg 'scale' must be a number";
+            return false;
+        }
+        closure.scale_factor = bind_opt->NumberValue();
+    }
+    if (options->Has(String::NewSymbol("scale_denominator")))
+    {
+        Local<Value> bind_opt = options->Get(String::New("scale_denominator"));
+        if (!bind_opt->IsNumber())
+        {
+            error_name = "optional arg 'scale_denominator' must be a number";
+            return false;
+        }
+        closure.scale_denominator = bind_opt->NumberValue();
+    }
+    return node_mapnik::parse_cancel_options(options,closure.cancel,error_name);
+}
+
 Handle<Value> VectorTile::render(const Arguments& args)
 {
     HandleScope scope;
 
     VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = d->read_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
     if (args.Length() < 1 || !args[0]->IsObject()) {
         return ThrowException(Exception::TypeError(String::New("mapnik.Map expected as first arg")));
     }
@@ -1444,38 +3417,15 @@ Handle<Value> VectorTile::render(const Arguments& args)
         }
         if (options->Has(String::NewSymbol("y")))
         {
-            closure->zxy_override = true;
-            closure->y = options->Get(String::New("y"))->IntegerValue();
-        }
-        if (options->Has(String::New("buffer_size"))) {
-            Local<Value> bind_opt = options->Get(String::New("buffer_size"));
-            if (!bind_opt->IsNumber()) {
-                delete closure;
-                return ThrowException(Exception::TypeError(
-                                          String::New("optional arg 'buffer_size' must be a number")));
-            }
-            closure->buffer_size = bind_opt->IntegerValue();
-        }
-        if (options->Has(String::New("scale"))) {
-            Local<Value> bind_opt = options->Get(String::New("scale"));
-            if (!bind_opt->IsNumber())
-            {
-                delete closure;
-                return ThrowException(Exception::TypeError(
-                                        String::New("optional arg 'scale' must be a number")));
-            }
-            closure->scale_factor = bind_opt->NumberValue();
+            closure->zxy_override = true;
+            closure->y = options->Get(String::New("y"))->IntegerValue();
         }
-        if (options->Has(String::NewSymbol("scale_denominator")))
+        std::string error_name;
+        if (!render_parse_options(options,*closure,error_name) ||
+            !node_mapnik::parse_stats_option(options,closure->stats,error_name))
         {
-            Local<Value> bind_opt = options->Get(String::New("scale_denominator"));
-            if (!bind_opt->IsNumber())
-            {
-                delete closure;
-                return ThrowException(Exception::TypeError(
-                                        String::New("optional arg 'scale_denominator' must be a number")));
-            }
-            closure->scale_denominator = bind_opt->NumberValue();
+            delete closure;
+            return ThrowException(Exception::TypeError(String::New(error_name.c_str())));
         }
     }
 
@@ -1486,6 +3436,18 @@ Handle<Value> VectorTile::render(const Arguments& args)
         closure->im = im;
         closure->width = im->get()->width();
         closure->height = im->get()->height();
+        std::string error_name;
+        if (!node_mapnik::parse_metatile_option(options,closure->width,closure->height,closure->metatile,error_name) ||
+            !node_mapnik::parse_encode_options(options,closure->encoding,error_name))
+        {
+            delete closure;
+            return ThrowException(Exception::TypeError(String::New(error_name.c_str())));
+        }
+        if (closure->metatile > 0 && closure->stats)
+        {
+            delete closure;
+            return ThrowException(Exception::TypeError(String::New("'stats' cannot be combined with 'metatile'")));
+        }
         closure->im->_ref();
     }
     else if (CairoSurface::constructor->HasInstance(im_obj))
@@ -1612,6 +3574,25 @@ Handle<Value> VectorTile::render(const Arguments& args)
         }
         closure->layer_idx = layer_idx;
     }
+    else if (im_obj->Has(String::New("format")))
+    {
+        // {format, palette} in place of an Image: render into a scratch
+        // image the size of the map and encode it in the same job
+        std::string error_name;
+        if (!node_mapnik::parse_encode_options(im_obj,closure->encoding,error_name))
+        {
+            delete closure;
+            return ThrowException(Exception::TypeError(String::New(error_name.c_str())));
+        }
+        if (options->Has(String::New("metatile")))
+        {
+            delete closure;
+            return ThrowException(Exception::TypeError(String::New("'metatile' requires a mapnik.Image to render into")));
+        }
+        closure->width = m->get()->width();
+        closure->height = m->get()->height();
+        closure->scratch = node_mapnik::acquire_scratch_image(closure->width,closure->height);
+    }
     else
     {
         delete closure;
@@ -1620,69 +3601,113 @@ Handle<Value> VectorTile::render(const Arguments& args)
     closure->request.data = closure;
     closure->d = d;
     closure->m = m;
+    closure->map = m->get();
+    closure->layers_stamp = m->layers_stamp();
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_RenderTile, (uv_after_work_cb)EIO_AfterRenderTile);
+    node_mapnik::queue_work(&closure->request, EIO_RenderTile, (uv_after_work_cb)EIO_AfterRenderTile, "vtile-render");
     m->_ref();
     d->Ref();
+    d->begin_read();
     return Undefined();
 }
 
+// holds a layer datasource for the duration of one apply_to_layer call:
+// the cached decoded features when they are free, otherwise a fresh tile_datasource
+class layer_datasource_guard
+{
+public:
+    layer_datasource_guard(VectorTile * d,
+                           std::size_t idx,
+                           mapnik::box2d<double> const& buffered_extent)
+        : d_(d),
+          idx_(idx),
+          layer_(),
+          ds_(d->borrow_datasource(idx)),
+          borrowed_(ds_) {
+        if (!ds_)
+        {
+            // the tile_datasource refers to the layer, so it is held here
+            layer_ = d->get_layer(idx);
+            MAPNIK_SHARED_PTR<mapnik::vector::tile_datasource> ds = MAPNIK_MAKE_SHARED<
+                                            mapnik::vector::tile_datasource>(
+                                                *layer_,
+                                                d->x_,
+                                                d->y_,
+                                                d->z_,
+                                                d->width()
+                                                );
+            ds->set_envelope(buffered_extent);
+            ds_ = ds;
+        }
+    }
+    ~layer_datasource_guard() {
+        if (borrowed_) d_->return_datasource(idx_);
+    }
+    VectorTile::datasource_ptr const& get() const { return ds_; }
+private:
+    VectorTile * d_;
+    std::size_t idx_;
+    VectorTile::layer_ptr layer_;
+    VectorTile::datasource_ptr ds_;
+    bool borrowed_;
+};
+
 template <typename Renderer> void process_layers(Renderer & ren,
                                             mapnik::request const& m_req,
                                             mapnik::projection const& map_proj,
                                             std::vector<mapnik::layer> const& layers,
                                             double scale_denom,
-                                            mapnik::vector::tile const& tiledata,
                                             vector_tile_render_baton_t *closure,
                                             mapnik::box2d<double> const& map_extent)
 {
-    // loop over layers in map and match by name
-    // with layers in the vector tile
-    unsigned layers_size = layers.size();
-    for (unsigned i=0; i < layers_size; ++i)
+    // layers in map matched by name with layers
+    // in the vector tile, cached per map on the tile
+    VectorTile * d = closure->d;
+    VectorTile::layer_matches matches = d->matched_layers(closure->layers_stamp,layers);
+    for (std::size_t i=0; i < matches.size(); ++i)
     {
-        mapnik::layer const& lyr = layers[i];
+        mapnik::layer const& lyr = layers[matches[i].first];
+        closure->cancel.check();
         if (lyr.visible(scale_denom))
         {
-            for (int j=0; j < tiledata.layers_size(); ++j)
+            layer_datasource_guard ds(d,matches[i].second,m_req.get_buffered_extent());
+            mapnik::layer lyr_copy(lyr);
+            lyr_copy.set_datasource(ds.get());
+            node_mapnik::layer_stats * stats = NULL;
+            if (closure->stats)
             {
-                mapnik::vector::tile_layer const& layer = tiledata.layers(j);
-                if (lyr.name() == layer.name())
-                {
-                    mapnik::layer lyr_copy(lyr);
-                    MAPNIK_SHARED_PTR<mapnik::vector::tile_datasource> ds = MAPNIK_MAKE_SHARED<
-                                                    mapnik::vector::tile_datasource>(
-                                                        layer,
-                                                        closure->d->x_,
-                                                        closure->d->y_,
-                                                        closure->d->z_,
-                                                        closure->d->width()
-                                                        );
-                    ds->set_envelope(m_req.get_buffered_extent());
-                    lyr_copy.set_datasource(ds);
-                    std::set<std::string> names;
-                    ren.apply_to_layer(lyr_copy,
-                                       ren,
-                                       map_proj,
-                                       m_req.scale(),
-                                       scale_denom,
-                                       m_req.width(),
-                                       m_req.height(),
-                                       m_req.extent(),
-                                       m_req.buffer_size(),
-                                       names);
-                }
+                stats = &closure->stats->layers[matches[i].first];
+                lyr_copy.set_datasource(MAPNIK_MAKE_SHARED<node_mapnik::stats_datasource>(ds.get(),stats));
+            }
+            if (closure->cancel.active())
+            {
+                lyr_copy.set_datasource(MAPNIK_MAKE_SHARED<node_mapnik::cancel_datasource>(lyr_copy.datasource(),closure->cancel));
             }
+            uint64_t start = stats ? uv_hrtime() : 0;
+            std::set<std::string> names;
+            ren.apply_to_layer(lyr_copy,
+                               ren,
+                               map_proj,
+                               m_req.scale(),
+                               scale_denom,
+                               m_req.width(),
+                               m_req.height(),
+                               m_req.extent(),
+                               m_req.buffer_size(),
+                               names);
+            if (stats) stats->time += uv_hrtime() - start;
         }
     }
 }
 void VectorTile::EIO_RenderTile(uv_work_t* req)
 {
     vector_tile_render_baton_t *closure = static_cast<vector_tile_render_baton_t *>(req->data);
+    if (closure->stats) closure->stats->started_at = uv_hrtime();
 
     try {
-        mapnik::Map const& map_in = *closure->m->get();
+        closure->cancel.check();
+        mapnik::Map const& map_in = *closure->map;
         mapnik::vector::spherical_mercator merc(closure->d->width_);
         double minx,miny,maxx,maxy;
         if (closure->zxy_override) {
@@ -1701,7 +3726,15 @@ void VectorTile::EIO_RenderTile(uv_work_t* req)
         }
         scale_denom *= closure->scale_factor;
         std::vector<mapnik::layer> const& layers = map_in.layers();
-        mapnik::vector::tile const& tiledata = closure->d->get_tile();
+        VectorTile * d = closure->d;
+        if (closure->stats)
+        {
+            closure->stats->layers.resize(layers.size());
+            for (std::size_t i = 0; i < layers.size(); ++i)
+            {
+                closure->stats->layers[i].name = layers[i].name();
+            }
+        }
         // render grid for layer
         if (closure->g)
         {
@@ -1714,21 +3747,14 @@ void VectorTile::EIO_RenderTile(uv_work_t* req)
             mapnik::layer const& lyr = layers[closure->layer_idx];
             if (lyr.visible(scale_denom))
             {
-                int tile_layer_idx = -1;
-                for (int j=0; j < tiledata.layers_size(); ++j)
-                {
-                    mapnik::vector::tile_layer const& layer = tiledata.layers(j);
-                    if (lyr.name() == layer.name())
-                    {
-                        tile_layer_idx = j;
-                        break;
-                    }
-                }
+                int tile_layer_idx = d->find_layer(lyr.name());
                 if (tile_layer_idx > -1)
                 {
-                    mapnik::vector::tile_layer const& layer = tiledata.layers(tile_layer_idx);
+                    VectorTile::layer_ptr layer_data = d->get_layer(tile_layer_idx);
+                    mapnik::vector::tile_layer const& layer = *layer_data;
                     if (layer.features_size() <= 0)
                     {
+                        if (closure->stats) closure->stats->finished_at = uv_hrtime();
                         return;
                     }
 
@@ -1747,17 +3773,20 @@ void VectorTile::EIO_RenderTile(uv_work_t* req)
                         attributes.insert(join_field);
                     }
 
+                    layer_datasource_guard ds(d,tile_layer_idx,m_req.get_buffered_extent());
                     mapnik::layer lyr_copy(lyr);
-                    MAPNIK_SHARED_PTR<mapnik::vector::tile_datasource> ds = MAPNIK_MAKE_SHARED<
-                                                    mapnik::vector::tile_datasource>(
-                                                        layer,
-                                                        closure->d->x_,
-                                                        closure->d->y_,
-                                                        closure->d->z_,
-                                                        closure->d->width_
-                                                        );
-                    ds->set_envelope(m_req.get_buffered_extent());
-                    lyr_copy.set_datasource(ds);
+                    lyr_copy.set_datasource(ds.get());
+                    node_mapnik::layer_stats * stats = NULL;
+                    if (closure->stats)
+                    {
+                        stats = &closure->stats->layers[closure->layer_idx];
+                        lyr_copy.set_datasource(MAPNIK_MAKE_SHARED<node_mapnik::stats_datasource>(ds.get(),stats));
+                    }
+                    if (closure->cancel.active())
+                    {
+                        lyr_copy.set_datasource(MAPNIK_MAKE_SHARED<node_mapnik::cancel_datasource>(lyr_copy.datasource(),closure->cancel));
+                    }
+                    uint64_t start = stats ? uv_hrtime() : 0;
                     ren.apply_to_layer(lyr_copy,
                                        ren,
                                        map_proj,
@@ -1768,6 +3797,7 @@ void VectorTile::EIO_RenderTile(uv_work_t* req)
                                        m_req.extent(),
                                        m_req.buffer_size(),
                                        attributes);
+                    if (stats) stats->time += uv_hrtime() - start;
                 }
                 ren.end_map_processing(map_in);
             }
@@ -1788,7 +3818,7 @@ void VectorTile::EIO_RenderTile(uv_work_t* req)
                 mapnik::cairo_ptr c_context = (mapnik::create_context(surface));
                 mapnik::cairo_renderer<mapnik::cairo_ptr> ren(map_in,m_req,c_context,closure->scale_factor);
                 ren.start_map_processing(map_in);
-                process_layers(ren,m_req,map_proj,layers,scale_denom,tiledata,closure,map_extent);
+                process_layers(ren,m_req,map_proj,layers,scale_denom,closure,map_extent);
                 ren.end_map_processing(map_in);
 #else
                 closure->error = true;
@@ -1803,7 +3833,7 @@ void VectorTile::EIO_RenderTile(uv_work_t* req)
                 std::ostream_iterator<char> output_stream_iterator(closure->c->ss_);
                 svg_ren ren(map_in, m_req, output_stream_iterator, closure->scale_factor);
                 ren.start_map_processing(map_in);
-                process_layers(ren,m_req,map_proj,layers,scale_denom,tiledata,closure,map_extent);
+                process_layers(ren,m_req,map_proj,layers,scale_denom,closure,map_extent);
                 ren.end_map_processing(map_in);
   #else
                 closure->error = true;
@@ -1818,17 +3848,41 @@ void VectorTile::EIO_RenderTile(uv_work_t* req)
         // render all layers with agg
         else
         {
-            mapnik::agg_renderer<mapnik::image_32> ren(map_in,m_req,*closure->im->get(),closure->scale_factor);
+            if (closure->scratch)
+            {
+                // left over from the previous render that used it
+                closure->scratch->clear();
+            }
+            mapnik::image_32 & image = closure->scratch ? *closure->scratch : *closure->im->get();
+            mapnik::agg_renderer<mapnik::image_32> ren(map_in,m_req,image,closure->scale_factor);
             ren.start_map_processing(map_in);
-            process_layers(ren,m_req,map_proj,layers,scale_denom,tiledata,closure,map_extent);
+            process_layers(ren,m_req,map_proj,layers,scale_denom,closure,map_extent);
             ren.end_map_processing(map_in);
+            if (closure->scratch)
+            {
+                if (closure->encoding.palette.get())
+                {
+                    closure->result = save_to_string(image, closure->encoding.format, *closure->encoding.palette);
+                }
+                else
+                {
+                    closure->result = save_to_string(image, closure->encoding.format);
+                }
+            }
         }
     }
+    catch (node_mapnik::job_cancelled const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+        closure->error_code = ex.code();
+    }
     catch (std::exception const& ex)
     {
         closure->error = true;
         closure->error_name = ex.what();
     }
+    if (closure->stats) closure->stats->finished_at = uv_hrtime();
 }
 
 void VectorTile::EIO_AfterRenderTile(uv_work_t* req)
@@ -1836,29 +3890,51 @@ void VectorTile::EIO_AfterRenderTile(uv_work_t* req)
     HandleScope scope;
 
     vector_tile_render_baton_t *closure = static_cast<vector_tile_render_baton_t *>(req->data);
+    closure->d->end_read();
 
     TryCatch try_catch;
 
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name, closure->error_code) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     }
     else
     {
-        if (closure->im)
-        {
-            Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(closure->im->handle_) };
-            closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
-        }
-        else if (closure->g)
+        if (closure->im && closure->metatile > 0)
         {
-            Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(closure->g->handle_) };
-            closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+            node_mapnik::queue_metatile_encode(closure->im, closure->metatile, closure->encoding, closure->cb);
         }
-        else if (closure->c)
+        else
         {
-            Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(closure->c->handle_) };
-            closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+            // (err, image|grid|surface|buffer, [stats])
+            Local<Value> argv[3];
+            int argc = 0;
+            argv[argc++] = Local<Value>::New(Null());
+            if (closure->im)
+            {
+                argv[argc++] = Local<Value>::New(closure->im->handle_);
+            }
+            else if (closure->g)
+            {
+                argv[argc++] = Local<Value>::New(closure->g->handle_);
+            }
+            else if (closure->c)
+            {
+                argv[argc++] = Local<Value>::New(closure->c->handle_);
+            }
+            else if (closure->scratch)
+            {
+                #if NODE_VERSION_AT_LEAST(0, 11, 0)
+                argv[argc++] = Local<Value>::New(node::Buffer::New((char*)closure->result.data(),closure->result.size()));
+                #else
+                argv[argc++] = Local<Value>::New(node::Buffer::New((char*)closure->result.data(),closure->result.size())->handle_);
+                #endif
+            }
+            if (closure->stats)
+            {
+                argv[argc++] = node_mapnik::render_stats_object(*closure->stats);
+            }
+            closure->cb->Call(Context::GetCurrent()->Global(), argc, argv);
         }
     }
 
@@ -1867,6 +3943,7 @@ void VectorTile::EIO_AfterRenderTile(uv_work_t* req)
     }
 
     closure->m->_unref();
+    if (closure->scratch) node_mapnik::release_scratch_image(closure->scratch);
     if (closure->im) closure->im->_unref();
     if (closure->g) closure->g->_unref();
     closure->d->Unref();
@@ -1874,12 +3951,239 @@ void VectorTile::EIO_AfterRenderTile(uv_work_t* req)
     delete closure;
 }
 
+// one renderMany call: the tiles are queued as separate jobs so the
+// threadpool renders them in parallel from the same (shared) VectorTile
+struct vector_tile_render_many_baton_t {
+    Map* m;
+    VectorTile* d;
+    std::vector<vector_tile_render_baton_t *> tiles;
+    std::size_t pending;
+    bool stream;
+    Persistent<Function> cb;
+    vector_tile_render_many_baton_t() :
+        m(NULL),
+        d(NULL),
+        tiles(),
+        pending(0),
+        stream(false) {}
+    ~vector_tile_render_many_baton_t() {
+        BOOST_FOREACH ( vector_tile_render_baton_t * tile, tiles )
+        {
+            delete tile;
+        }
+    }
+};
+
+Handle<Value> VectorTile::renderMany(const Arguments& args)
+{
+    HandleScope scope;
+    VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = d->read_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
+    if (args.Length() < 1 || !args[0]->IsObject()) {
+        return ThrowException(Exception::TypeError(String::New("mapnik.Map expected as first arg")));
+    }
+    Local<Object> obj = args[0]->ToObject();
+    if (obj->IsNull() || obj->IsUndefined() || !Map::constructor->HasInstance(obj))
+        return ThrowException(Exception::TypeError(String::New("mapnik.Map expected as first arg")));
+    Map *m = node::ObjectWrap::Unwrap<Map>(obj);
+    if (args.Length() < 2 || !args[1]->IsArray()) {
+        return ThrowException(Exception::TypeError(String::New("an array of {z,x,y,surface} objects is expected as second arg")));
+    }
+    Local<Array> tiles = Local<Array>::Cast(args[1]);
+    unsigned num_tiles = tiles->Length();
+    if (num_tiles < 1) {
+        return ThrowException(Exception::TypeError(String::New("an array with at least one {z,x,y,surface} object is expected as second arg")));
+    }
+    Local<Value> callback = args[args.Length()-1];
+    if (!callback->IsFunction())
+    {
+        return ThrowException(Exception::TypeError(
+                                  String::New("last argument must be a callback function")));
+    }
+
+    // options shared by every tile of the batch
+    vector_tile_render_baton_t shared;
+    bool stream = false;
+    if (args.Length() > 3)
+    {
+        if (!args[2]->IsObject())
+        {
+            return ThrowException(Exception::TypeError(String::New("optional third argument must be an options object")));
+        }
+        Local<Object> options = args[2]->ToObject();
+        std::string error_name;
+        if (!render_parse_options(options,shared,error_name))
+        {
+            return ThrowException(Exception::TypeError(String::New(error_name.c_str())));
+        }
+        if (options->Has(String::NewSymbol("stream")))
+        {
+            Local<Value> param_val = options->Get(String::NewSymbol("stream"));
+            if (!param_val->IsBoolean())
+            {
+                return ThrowException(Exception::TypeError(String::New("optional arg 'stream' must be a boolean")));
+            }
+            stream = param_val->BooleanValue();
+        }
+    }
+
+    vector_tile_render_many_baton_t *batch = new vector_tile_render_many_baton_t();
+    batch->m = m;
+    batch->d = d;
+    batch->stream = stream;
+    // tiles render in parallel, so each needs an Image of its own
+    std::set<Image *> surfaces;
+    for (unsigned i = 0; i < num_tiles; ++i)
+    {
+        Local<Value> tile_val = tiles->Get(i);
+        if (!tile_val->IsObject())
+        {
+            delete batch;
+            return ThrowException(Exception::TypeError(String::New("each tile must be an object with z,x,y and surface properties")));
+        }
+        Local<Object> tile = tile_val->ToObject();
+        Local<Value> z = tile->Get(String::NewSymbol("z"));
+        Local<Value> x = tile->Get(String::NewSymbol("x"));
+        Local<Value> y = tile->Get(String::NewSymbol("y"));
+        Local<Value> surface = tile->Get(String::NewSymbol("surface"));
+        if (!z->IsNumber() || !x->IsNumber() || !y->IsNumber())
+        {
+            delete batch;
+            return ThrowException(Exception::TypeError(String::New("each tile must have numeric z,x,y properties")));
+        }
+        if (!surface->IsObject() || !Image::constructor->HasInstance(surface->ToObject()))
+        {
+            delete batch;
+            return ThrowException(Exception::TypeError(String::New("each tile must have a mapnik.Image as surface")));
+        }
+        Image *im = node::ObjectWrap::Unwrap<Image>(surface->ToObject());
+        if (!surfaces.insert(im).second)
+        {
+            delete batch;
+            return ThrowException(Exception::TypeError(String::New("each tile must have a different mapnik.Image as surface")));
+        }
+        vector_tile_render_baton_t *closure = new vector_tile_render_baton_t();
+        closure->request.data = closure;
+        closure->m = m;
+        closure->map = m->get();
+        closure->layers_stamp = m->layers_stamp();
+        closure->d = d;
+        closure->im = im;
+        closure->width = im->get()->width();
+        closure->height = im->get()->height();
+        closure->zxy_override = true;
+        closure->z = z->IntegerValue();
+        closure->x = x->IntegerValue();
+        closure->y = y->IntegerValue();
+        closure->buffer_size = shared.buffer_size;
+        closure->scale_factor = shared.scale_factor;
+        closure->scale_denominator = shared.scale_denominator;
+        closure->cancel = shared.cancel;
+        closure->batch = batch;
+        closure->batch_idx = i;
+        batch->tiles.push_back(closure);
+    }
+    batch->pending = batch->tiles.size();
+    batch->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
+    BOOST_FOREACH ( vector_tile_render_baton_t * closure, batch->tiles )
+    {
+        closure->im->_ref();
+        node_mapnik::queue_work(&closure->request, EIO_RenderTile, (uv_after_work_cb)EIO_AfterRenderMany, "vtile-render");
+    }
+    m->_ref();
+    d->Ref();
+    d->begin_read();
+    return Undefined();
+}
+
+void VectorTile::EIO_AfterRenderMany(uv_work_t* req)
+{
+    HandleScope scope;
+    vector_tile_render_baton_t *closure = static_cast<vector_tile_render_baton_t *>(req->data);
+    vector_tile_render_many_baton_t *batch = closure->batch;
+    TryCatch try_catch;
+    if (--batch->pending == 0)
+    {
+        batch->d->end_read();
+    }
+    if (closure->error)
+    {
+        node_mapnik::job_failed();
+    }
+    if (batch->stream)
+    {
+        // one callback per tile, in completion order
+        if (closure->error) {
+            Local<Value> argv[3] = { node_mapnik::job_error(closure->error_name, closure->error_code),
+                                     Local<Value>::New(Undefined()),
+                                     Integer::NewFromUnsigned(closure->batch_idx) };
+            batch->cb->Call(Context::GetCurrent()->Global(), 3, argv);
+        }
+        else
+        {
+            Local<Value> argv[3] = { Local<Value>::New(Null()),
+                                     Local<Value>::New(closure->im->handle_),
+                                     Integer::NewFromUnsigned(closure->batch_idx) };
+            batch->cb->Call(Context::GetCurrent()->Global(), 3, argv);
+        }
+    }
+    else if (batch->pending == 0)
+    {
+        // one callback for the batch with the surfaces in request order
+        vector_tile_render_baton_t * failed = NULL;
+        BOOST_FOREACH ( vector_tile_render_baton_t * tile, batch->tiles )
+        {
+            if (tile->error)
+            {
+                failed = tile;
+                break;
+            }
+        }
+        if (failed) {
+            Local<Value> argv[1] = { node_mapnik::job_error(failed->error_name, failed->error_code) };
+            batch->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+        }
+        else
+        {
+            Local<Array> surfaces = Array::New(batch->tiles.size());
+            for (std::size_t i = 0; i < batch->tiles.size(); ++i)
+            {
+                surfaces->Set(i, batch->tiles[i]->im->handle_);
+            }
+            Local<Value> argv[2] = { Local<Value>::New(Null()), surfaces };
+            batch->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+        }
+    }
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+    if (batch->pending == 0)
+    {
+        BOOST_FOREACH ( vector_tile_render_baton_t * tile, batch->tiles )
+        {
+            tile->im->_unref();
+        }
+        batch->m->_unref();
+        batch->d->Unref();
+        batch->cb.Dispose();
+        delete batch;
+    }
+}
+
 Handle<Value> VectorTile::clearSync(const Arguments& args)
 {
     HandleScope scope;
 #if MAPNIK_VERSION >= 200200
     VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = d->write_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
     d->clear();
+    d->release_buffer();
 #endif
     return Undefined();
 }
@@ -1897,6 +4201,10 @@ Handle<Value> VectorTile::clear(const Arguments& args)
 {
     HandleScope scope;
     VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = d->write_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
 
     if (args.Length() == 0) {
         return clearSync(args);
@@ -1910,9 +4218,14 @@ Handle<Value> VectorTile::clear(const Arguments& args)
     closure->request.data = closure;
     closure->d = d;
     closure->error = false;
+#if MAPNIK_VERSION >= 200200
+    // borrowed bytes are only given back on the main thread
+    d->release_buffer();
+#endif
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Clear, (uv_after_work_cb)EIO_AfterClear);
+    node_mapnik::queue_work(&closure->request, EIO_Clear, (uv_after_work_cb)EIO_AfterClear, "vtile-clear", node_mapnik::PRIORITY_HIGH);
     d->Ref();
+    d->begin_write();
     return Undefined();
 }
 
@@ -1936,10 +4249,11 @@ void VectorTile::EIO_AfterClear(uv_work_t* req)
 {
     HandleScope scope;
     clear_vector_tile_baton_t *closure = static_cast<clear_vector_tile_baton_t *>(req->data);
+    closure->d->end_write();
     TryCatch try_catch;
     if (closure->error)
     {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     }
     else
@@ -1956,14 +4270,160 @@ void VectorTile::EIO_AfterClear(uv_work_t* req)
     delete closure;
 }
 
+// true if a vertex of the feature lies inside the tile extent (inset by
+// 2 units for rounding). is_solid_extent rejects any such feature.
+static bool has_inner_vertex(const char * data, std::size_t size, unsigned extent)
+{
+    int64_t inset_min = 2;
+    int64_t inset_max = static_cast<int64_t>(extent) - 2;
+    pbf::message featuremsg(data,size);
+    while (featuremsg.next()) {
+        if (featuremsg.tag != 4) {
+            featuremsg.skip();
+            continue;
+        }
+        uint64_t len = featuremsg.varint();
+        const char * geom_data = featuremsg.getData();
+        const char * geom_end = geom_data + len;
+        featuremsg.skipBytes(len);
+        pbf::message geom(geom_data,static_cast<std::size_t>(len));
+        const unsigned cmd_bits = 3;
+        unsigned cmd = 0;
+        unsigned length = 0;
+        int64_t x = 0;
+        int64_t y = 0;
+        while (geom.getData() < geom_end)
+        {
+            if (!length) {
+                uint64_t cmd_length = geom.varint();
+                cmd = static_cast<unsigned>(cmd_length & ((1 << cmd_bits) - 1));
+                length = static_cast<unsigned>(cmd_length >> cmd_bits);
+                if (cmd == (mapnik::SEG_CLOSE & ((1 << cmd_bits) - 1)))
+                {
+                    length = 0;
+                }
+                else if (cmd != mapnik::SEG_MOVETO && cmd != mapnik::SEG_LINETO)
+                {
+                    std::stringstream msg;
+                    msg << "Unknown command type (is_solid): " << cmd;
+                    throw std::runtime_error(msg.str());
+                }
+                continue;
+            }
+            --length;
+            uint64_t dx = geom.varint();
+            uint64_t dy = geom.varint();
+            x += static_cast<int32_t>((dx >> 1) ^ (-(dx & 1)));
+            y += static_cast<int32_t>((dy >> 1) ^ (-(dy & 1)));
+            if (x > inset_min && x < inset_max &&
+                y > inset_min && y < inset_max)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// streams over the encoded layers, stopping at the first feature with a
+// vertex inside the extent: such a tile is not solid. Otherwise key is set
+// to the dash separated names of the layers and has_features tells whether
+// there was any feature to check.
+static bool has_inner_vertex_raw(const char * data,
+                                 std::size_t size,
+                                 std::string & key,
+                                 bool & has_features)
+{
+    pbf::message item(data,size);
+    while (item.next()) {
+        if (item.tag != 3) {
+            item.skip();
+            continue;
+        }
+        uint64_t len = item.varint();
+        const char * layer_data = item.getData();
+        std::size_t layer_len = static_cast<std::size_t>(len);
+        item.skipBytes(len);
+        // the extent is encoded after the features
+        std::string name;
+        unsigned extent = 4096;
+        pbf::message layermsg(layer_data,layer_len);
+        while (layermsg.next()) {
+            if (layermsg.tag == 1) {
+                name = layermsg.string();
+            } else if (layermsg.tag == 5) {
+                extent = static_cast<unsigned>(layermsg.varint());
+            } else {
+                layermsg.skip();
+            }
+        }
+        pbf::message features(layer_data,layer_len);
+        while (features.next()) {
+            if (features.tag == 2) {
+                uint64_t feature_len = features.varint();
+                has_features = true;
+                if (has_inner_vertex(features.getData(),static_cast<std::size_t>(feature_len),extent))
+                {
+                    return true;
+                }
+                features.skipBytes(feature_len);
+            } else {
+                features.skip();
+            }
+        }
+        if (key.empty())
+        {
+            key = name;
+        }
+        else
+        {
+            key += "-" + name;
+        }
+    }
+    return false;
+}
+
+static bool tile_is_solid(VectorTile * d, std::string & key)
+{
+    if (d->byte_size() <= static_cast<int>(d->raw_size()))
+    {
+        // unparsed and parsed-from-raw tiles are rejected without a full
+        // parse when a vertex is inside the extent, which is the common case
+        bool has_features = false;
+        if (has_inner_vertex_raw(d->raw_data(),d->raw_size(),key,has_features))
+        {
+            return false;
+        }
+        if (!has_features)
+        {
+            return true;
+        }
+        // whether the remaining features cover the extent is decided by
+        // is_solid_extent, on a local copy since the tile is shared with
+        // other readers
+        mapnik::vector::tile tiledata;
+        if (!tiledata.ParseFromArray(d->raw_data(),d->raw_size()))
+        {
+            throw std::runtime_error("could not parse buffer as protobuf");
+        }
+        key.clear();
+        return mapnik::vector::is_solid_extent(tiledata,key);
+    }
+    return mapnik::vector::is_solid_extent(d->get_tile(),key);
+}
+
 Handle<Value> VectorTile::isSolidSync(const Arguments& args)
 {
     HandleScope scope;
     VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = d->read_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
     try
     {
         std::string key;
-        bool is_solid = mapnik::vector::is_solid_extent(d->get_tile(),key);
+        bool is_solid = tile_is_solid(d,key);
         if (is_solid)
         {
             return scope.Close(String::New(key.c_str()));
@@ -1995,6 +4455,10 @@ Handle<Value> VectorTile::isSolid(const Arguments& args)
 {
     HandleScope scope;
     VectorTile* d = node::ObjectWrap::Unwrap<VectorTile>(args.This());
+    if (const char * busy = d->read_blocked())
+    {
+        return ThrowException(Exception::Error(String::New(busy)));
+    }
 
     if (args.Length() == 0) {
         return isSolidSync(args);
@@ -2011,8 +4475,9 @@ Handle<Value> VectorTile::isSolid(const Arguments& args)
     closure->result = true;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_IsSolid, (uv_after_work_cb)EIO_AfterIsSolid);
+    node_mapnik::queue_work(&closure->request, EIO_IsSolid, (uv_after_work_cb)EIO_AfterIsSolid, "vtile-is-solid", node_mapnik::PRIORITY_HIGH);
     d->Ref();
+    d->begin_read();
     return Undefined();
 }
 
@@ -2020,7 +4485,7 @@ void VectorTile::EIO_IsSolid(uv_work_t* req)
 {
     is_solid_vector_tile_baton_t *closure = static_cast<is_solid_vector_tile_baton_t *>(req->data);
     try {
-        closure->result = mapnik::vector::is_solid_extent(closure->d->get_tile(),closure->key);
+        closure->result = tile_is_solid(closure->d,closure->key);
     }
     catch (std::exception const& ex)
     {
@@ -2033,9 +4498,10 @@ void VectorTile::EIO_AfterIsSolid(uv_work_t* req)
 {
     HandleScope scope;
     is_solid_vector_tile_baton_t *closure = static_cast<is_solid_vector_tile_baton_t *>(req->data);
+    closure->d->end_read();
     TryCatch try_catch;
     if (closure->error) {
-        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        Local<Value> argv[1] = { node_mapnik::job_error(closure->error_name) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     }
     else
@@ -9,7 +9,14 @@
 #include <google/protobuf/io/coded_stream.h>
 #include <vector>
 #include <string>
+#include <map>
+#include <utility>
 #include "mapnik3x_compatibility.hpp"
+#include MAPNIK_SHARED_INCLUDE
+#include <boost/unordered_map.hpp>
+
+namespace mapnik { class layer; class datasource; }
+namespace node_mapnik { class query_index; }
 
 using namespace v8;
 
@@ -24,16 +31,28 @@ public:
     static void Initialize(Handle<Object> target);
     static Handle<Value> New(Arguments const&args);
     static Handle<Value> getData(Arguments const& args);
+    static void EIO_GetData(uv_work_t* req);
+    static void EIO_AfterGetData(uv_work_t* req);
     static Handle<Value> render(Arguments const& args);
     static Handle<Value> toJSON(Arguments const& args);
     static Handle<Value> query(Arguments const& args);
+    static Handle<Value> queryMany(Arguments const& args);
+    static void EIO_QueryMany(uv_work_t* req);
+    static void EIO_AfterQueryMany(uv_work_t* req);
     static Handle<Value> names(Arguments const& args);    
+    static Handle<Value> info(Arguments const& args);
+    static void EIO_Info(uv_work_t* req);
+    static void EIO_AfterInfo(uv_work_t* req);
     static Handle<Value> toGeoJSON(Arguments const& args);
+    static void EIO_ToGeoJSON(uv_work_t* req);
+    static void EIO_AfterToGeoJSON(uv_work_t* req);
 #ifdef PROTOBUF_FULL
     static Handle<Value> toString(Arguments const& args);
 #endif
     static void EIO_RenderTile(uv_work_t* req);
     static void EIO_AfterRenderTile(uv_work_t* req);
+    static Handle<Value> renderMany(Arguments const& args);
+    static void EIO_AfterRenderMany(uv_work_t* req);
     static Handle<Value> setData(Arguments const& args);
     static void EIO_SetData(uv_work_t* req);
     static void EIO_AfterSetData(uv_work_t* req);
@@ -44,6 +63,9 @@ public:
     static Handle<Value> parseSync(Arguments const& args);
     static Handle<Value> addData(Arguments const& args);
     static Handle<Value> composite(Arguments const& args);
+    static void EIO_Composite(uv_work_t* req);
+    static void EIO_AfterComposite(uv_work_t* req);
+    static Handle<Value> compositeSync(Arguments const& args);
     // methods common to mapnik.Image
     static Handle<Value> width(Arguments const& args);
     static Handle<Value> height(Arguments const& args);
@@ -56,35 +78,116 @@ public:
     static void EIO_IsSolid(uv_work_t* req);
     static void EIO_AfterIsSolid(uv_work_t* req);
     static Handle<Value> isSolidSync(Arguments const& args);
+    static Handle<Value> cacheStats(Arguments const& args);
 
     VectorTile(int z, int x, int y, unsigned w=256, unsigned h=256);
 
+    // byte range of one layer message inside the raw bytes
+    struct layer_offset {
+        std::string name;
+        std::size_t offset;
+        std::size_t length;
+    };
+    typedef MAPNIK_SHARED_PTR<mapnik::vector::tile_layer> layer_ptr;
+    typedef MAPNIK_SHARED_PTR<mapnik::datasource> datasource_ptr;
+    typedef MAPNIK_SHARED_PTR<node_mapnik::query_index> query_index_ptr;
+    // decoded features of one layer, lent to a single render at a time
+    struct cached_datasource {
+        datasource_ptr ds;
+        bool in_use;
+        cached_datasource() : ds(), in_use(false) {}
+    };
+    typedef boost::unordered_map<std::string, std::vector<std::size_t> > layer_name_index;
+    // (map layer index, tile layer index) pairs in map layer order
+    typedef std::vector<std::pair<std::size_t, std::size_t> > layer_matches;
+
     void clear() {
         tiledata_.Clear();
         buffer_.clear();
+        clear_layer_index();
         painted(false);
     }
     mapnik::vector::tile & get_tile_nonconst() {
         return tiledata_;
     }
     std::vector<std::string> lazy_names();
+    // raw tile bytes, either owned by buffer_ or borrowed from a node Buffer
+    // that was passed to setData with {copy:false}
+    const char * raw_data() const {
+        return borrowed_data_ ? borrowed_data_ : buffer_.data();
+    }
+    std::size_t raw_size() const {
+        return borrowed_data_ ? borrowed_size_ : buffer_.size();
+    }
+    // must be called from the main thread
+    void borrow_buffer(Handle<Object> obj);
+    void release_buffer();
+    // copies borrowed bytes into buffer_ before it is modified
+    void detach_buffer();
     void parse_proto();
+    // layer access that decodes individual layers from the raw bytes
+    // on demand when the tile has not been fully parsed
+    void index_layers();
+    void clear_layer_index();
+    bool lazy() const {
+        // a merge is only described by the raw bytes if they also hold
+        // the bytes of the previously parsed data
+        return layer_index_valid_ &&
+               (status_ == LAZY_SET ||
+                (status_ == LAZY_MERGE && byte_size_ <= static_cast<int>(raw_size())));
+    }
+    std::size_t layers_size() const;
+    std::string const& layer_name(std::size_t idx) const;
+    // the layer stays valid for as long as the pointer is held, even if the
+    // tile is changed. Layers of a parsed tile are owned by the tile data,
+    // which cannot change while async jobs that read it are in flight.
+    layer_ptr get_layer(std::size_t idx);
+    // name lookups shared by the render, query and geojson paths
+    void index_names();
+    std::vector<std::size_t> const& layers_named(std::string const& name) const;
+    int find_layer(std::string const& name) const;
+    // appends the encoded layers with the given names to out, in tile order,
+    // copying their byte ranges when the raw bytes describe the tile
+    void write_layers(std::vector<std::string> const& names, std::string & out) const;
+    layer_matches matched_layers(unsigned long map_stamp,
+                                 std::vector<mapnik::layer> const& layers);
+    // returns an empty pointer if the layer is already lent out
+    datasource_ptr borrow_datasource(std::size_t idx);
+    void return_datasource(std::size_t idx);
+    // spatial index of the decoded features of a layer, built on first query
+    query_index_ptr get_query_index(std::size_t idx);
     mapnik::vector::tile const& get_tile() {
         return tiledata_;
     }
     void painted(bool painted) {
         byte_size_ = tiledata_.ByteSize();
         painted_ = painted;
+        index_names();
     }
     bool painted() const {
         return painted_;
     }
+    // encoded size of the parsed tile data
+    int byte_size() const {
+        return byte_size_;
+    }
     unsigned width() const {
         return width_;
     }
     unsigned height() const {
         return height_;
     }
+    // async jobs in flight, main thread only. A job that changes the tile
+    // (setData, parse, clear, composite, Map.render) needs it to itself,
+    // jobs that read it may run side by side. After callbacks end the job
+    // before calling back, so the callback can use the tile again. These
+    // return why the tile cannot be read or changed right now, or NULL.
+    const char * read_blocked() const;
+    const char * write_blocked() const;
+    void begin_read() { ++readers_; }
+    void end_read() { --readers_; }
+    void begin_write() { writing_ = true; }
+    void end_write() { writing_ = false; }
     void _ref() { Ref(); }
     void _unref() { Unref(); }
     int z_;
@@ -95,6 +198,21 @@ public:
 private:
     ~VectorTile();
     mapnik::vector::tile tiledata_;
+    Persistent<Object> borrowed_buffer_;
+    const char * borrowed_data_;
+    std::size_t borrowed_size_;
+    std::vector<layer_offset> layer_index_;
+    std::vector<layer_ptr> decoded_layers_;
+    bool layer_index_valid_;
+    layer_name_index name_index_;
+    std::map<unsigned long, layer_matches> match_cache_;
+    std::vector<cached_datasource> ds_cache_;
+    std::vector<query_index_ptr> query_index_;
+    unsigned ds_cache_hits_;
+    unsigned ds_cache_misses_;
+    uv_mutex_t layer_mutex_;
+    int readers_;
+    bool writing_;
     unsigned width_;
     unsigned height_;
     bool painted_;
@@ -0,0 +1,245 @@
+// node
+#include <node.h>
+#include <node_buffer.h>
+#include <node_version.h>
+#include <uv.h>
+
+// mapnik
+#include <mapnik/graphics.hpp>          // for image_32
+#include <mapnik/image_data.hpp>        // for image_data_32
+#include <mapnik/image_view.hpp>        // for image_view
+#include <mapnik/image_util.hpp>        // for save_to_string
+
+#include "metatile.hpp"
+#include "worker_pool.hpp"
+#include "job_metrics.hpp"
+#include "mapnik_image.hpp"
+#include "mapnik_palette.hpp"
+#include "utils.hpp"
+
+// boost
+#include <boost/foreach.hpp>
+
+// std
+#include <exception>
+#include <vector>
+
+namespace node_mapnik {
+
+bool parse_encode_options(Local<Object> const& options,
+                          encode_options & opts,
+                          std::string & error_name)
+{
+    if (options->Has(String::New("format")))
+    {
+        Local<Value> format_opt = options->Get(String::New("format"));
+        if (!format_opt->IsString())
+        {
+            error_name = "'format' must be a string";
+            return false;
+        }
+        opts.format = TOSTR(format_opt);
+    }
+    if (options->Has(String::New("palette")))
+    {
+        Local<Value> palette_opt = options->Get(String::New("palette"));
+        if (!palette_opt->IsObject())
+        {
+            error_name = "'palette' must be an object";
+            return false;
+        }
+        Local<Object> obj = palette_opt->ToObject();
+        if (obj->IsNull() || obj->IsUndefined() || !Palette::constructor->HasInstance(obj))
+        {
+            error_name = "'palette' must be a mapnik.Palette";
+            return false;
+        }
+        opts.palette = node::ObjectWrap::Unwrap<Palette>(obj)->palette();
+    }
+    return true;
+}
+
+bool parse_metatile_option(Local<Object> const& options,
+                           unsigned width,
+                           unsigned height,
+                           unsigned & metatile,
+                           std::string & error_name)
+{
+    if (!options->Has(String::New("metatile")))
+    {
+        return true;
+    }
+    Local<Value> metatile_opt = options->Get(String::New("metatile"));
+    if (!metatile_opt->IsNumber() || metatile_opt->IntegerValue() < 1)
+    {
+        error_name = "'metatile' must be a positive integer";
+        return false;
+    }
+    metatile = metatile_opt->IntegerValue();
+    if (width % metatile != 0 || height % metatile != 0)
+    {
+        error_name = "'metatile' must evenly divide the width and height of the image";
+        return false;
+    }
+    return true;
+}
+
+struct metatile_baton_t;
+
+struct metatile_part_baton_t {
+    uv_work_t request;
+    metatile_baton_t * batch;
+    unsigned x;
+    unsigned y;
+    bool error;
+    std::string error_name;
+    std::string result;
+    metatile_part_baton_t() :
+        request(),
+        batch(NULL),
+        x(0),
+        y(0),
+        error(false) {}
+};
+
+struct metatile_baton_t {
+    Image * im;
+    image_ptr image;
+    unsigned tile_width;
+    unsigned tile_height;
+    encode_options opts;
+    std::vector<metatile_part_baton_t *> parts;
+    std::size_t pending;
+    Persistent<Function> cb;
+    metatile_baton_t() :
+        im(NULL),
+        image(),
+        tile_width(0),
+        tile_height(0),
+        opts(),
+        parts(),
+        pending(0) {}
+    ~metatile_baton_t() {
+        BOOST_FOREACH ( metatile_part_baton_t * part, parts )
+        {
+            delete part;
+        }
+    }
+};
+
+static void EIO_EncodePart(uv_work_t* req)
+{
+    metatile_part_baton_t *closure = static_cast<metatile_part_baton_t *>(req->data);
+    metatile_baton_t *batch = closure->batch;
+    try
+    {
+        mapnik::image_view<mapnik::image_data_32> view = batch->image->get_view(closure->x,
+                                                                                  closure->y,
+                                                                                  batch->tile_width,
+                                                                                  batch->tile_height);
+        if (batch->opts.palette.get())
+        {
+            closure->result = save_to_string(view, batch->opts.format, *batch->opts.palette);
+        }
+        else
+        {
+            closure->result = save_to_string(view, batch->opts.format);
+        }
+    }
+    catch (std::exception const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+    }
+}
+
+static void EIO_AfterEncodePart(uv_work_t* req)
+{
+    HandleScope scope;
+
+    metatile_part_baton_t *closure = static_cast<metatile_part_baton_t *>(req->data);
+    metatile_baton_t *batch = closure->batch;
+
+    if (closure->error)
+    {
+        job_failed();
+    }
+    if (--batch->pending > 0)
+    {
+        return;
+    }
+
+    TryCatch try_catch;
+
+    metatile_part_baton_t * failed = NULL;
+    BOOST_FOREACH ( metatile_part_baton_t * part, batch->parts )
+    {
+        if (part->error)
+        {
+            failed = part;
+            break;
+        }
+    }
+    if (failed)
+    {
+        Local<Value> argv[1] = { Exception::Error(String::New(failed->error_name.c_str())) };
+        batch->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    }
+    else
+    {
+        Local<Array> buffers = Array::New(batch->parts.size());
+        for (std::size_t i = 0; i < batch->parts.size(); ++i)
+        {
+            std::string const& result = batch->parts[i]->result;
+            #if NODE_VERSION_AT_LEAST(0, 11, 0)
+            buffers->Set(i, node::Buffer::New((char*)result.data(),result.size()));
+            #else
+            buffers->Set(i, node::Buffer::New((char*)result.data(),result.size())->handle_);
+            #endif
+        }
+        Local<Value> argv[2] = { Local<Value>::New(Null()), buffers };
+        batch->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+    }
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    batch->im->_unref();
+    batch->cb.Dispose();
+    delete batch;
+}
+
+void queue_metatile_encode(Image * im,
+                           unsigned metatile,
+                           encode_options const& opts,
+                           Handle<Function> cb)
+{
+    metatile_baton_t *batch = new metatile_baton_t();
+    batch->im = im;
+    batch->image = im->get();
+    batch->tile_width = batch->image->width() / metatile;
+    batch->tile_height = batch->image->height() / metatile;
+    batch->opts = opts;
+    batch->cb = Persistent<Function>::New(cb);
+    for (unsigned row = 0; row < metatile; ++row)
+    {
+        for (unsigned col = 0; col < metatile; ++col)
+        {
+            metatile_part_baton_t *closure = new metatile_part_baton_t();
+            closure->request.data = closure;
+            closure->batch = batch;
+            closure->x = col * batch->tile_width;
+            closure->y = row * batch->tile_height;
+            batch->parts.push_back(closure);
+        }
+    }
+    batch->pending = batch->parts.size();
+    BOOST_FOREACH ( metatile_part_baton_t * closure, batch->parts )
+    {
+        queue_work(&closure->request, EIO_EncodePart, (uv_after_work_cb)EIO_AfterEncodePart, encode_operation(batch->opts.format));
+    }
+    im->_ref();
+}
+
+}
@@ -0,0 +1,51 @@
+#ifndef __NODE_MAPNIK_METATILE_H__
+#define __NODE_MAPNIK_METATILE_H__
+
+// v8
+#include <v8.h>
+
+// stl
+#include <string>
+
+#include "mapnik_palette.hpp"
+
+using namespace v8;
+
+class Image;
+
+namespace node_mapnik {
+
+// how rendered images are encoded before they are handed back to js
+struct encode_options
+{
+    std::string format;
+    palette_ptr palette;
+    encode_options() :
+        format("png"),
+        palette() {}
+};
+
+// reads the optional 'format' and 'palette' render options
+bool parse_encode_options(Local<Object> const& options,
+                          encode_options & opts,
+                          std::string & error_name);
+
+// reads the optional 'metatile' render option: the number of tiles along
+// each side of a width x height surface. Left at 0 when not passed.
+bool parse_metatile_option(Local<Object> const& options,
+                           unsigned width,
+                           unsigned height,
+                           unsigned & metatile,
+                           std::string & error_name);
+
+// splits a rendered metatile into metatile x metatile views, encodes each
+// view as its own threadpool job and calls cb(err, [Buffer]) once all are
+// done. Buffers are ordered by row, then column.
+void queue_metatile_encode(Image * im,
+                           unsigned metatile,
+                           encode_options const& opts,
+                           Handle<Function> cb);
+
+}
+
+#endif // __NODE_MAPNIK_METATILE_H__
@@ -9,6 +9,11 @@
 // node-mapnik
 #include "mapnik_vector_tile.hpp"
 #include "mapnik_map.hpp"
+#include "mapnik_map_pool.hpp"
+#include "mapnik_cancel_signal.hpp"
+#include "mapnik_tile_cache.hpp"
+#include "worker_pool.hpp"
+#include "job_metrics.hpp"
 #include "mapnik_color.hpp"
 #include "mapnik_geometry.hpp"
 #include "mapnik_feature.hpp"
@@ -69,6 +74,40 @@ static Handle<Value> gc(const Arguments& args)
     return scope.Close(Boolean::New(V8::IdleNotification()));
 }
 
+// threadpoolSize() returns, threadpoolSize(n) sets the number of threads
+// running async work. Setting it is only possible before the first async call.
+static Handle<Value> threadpoolSize(const Arguments& args)
+{
+    HandleScope scope;
+    if (args.Length() > 0)
+    {
+        if (!args[0]->IsNumber() || args[0]->IntegerValue() < 1)
+            return ThrowException(Exception::TypeError(
+                                      String::New("threadpool size must be a positive integer")));
+        if (!node_mapnik::set_threadpool_size(args[0]->IntegerValue()))
+            return ThrowException(Exception::Error(
+                                      String::New("threadpool size cannot be changed once async work has started")));
+    }
+    return scope.Close(Integer::New(node_mapnik::threadpool_size()));
+}
+
+// counters and latency histograms of the async jobs run so far, plus the
+// threads' current load
+static Handle<Value> metrics(const Arguments& args)
+{
+    HandleScope scope;
+    unsigned queued = 0;
+    unsigned running = 0;
+    node_mapnik::threadpool_load(queued, running);
+    Local<Object> threadpool = Object::New();
+    threadpool->Set(String::NewSymbol("size"), Integer::New(node_mapnik::threadpool_size()));
+    threadpool->Set(String::NewSymbol("queued"), Integer::New(queued));
+    threadpool->Set(String::NewSymbol("running"), Integer::New(running));
+    Local<Object> obj = node_mapnik::job_metrics_object();
+    obj->Set(String::NewSymbol("threadpool"), threadpool);
+    return scope.Close(obj);
+}
+
 static std::string format_version(int version)
 {
     std::ostringstream s;
@@ -101,6 +140,8 @@ static Handle<Value> clearCache(const Arguments& args)
 static Handle<Value> shutdown(const Arguments& args)
 {
     HandleScope scope;
+    // no pool thread may still be inside mapnik or protobuf below
+    node_mapnik::stop_threadpool();
     google::protobuf::ShutdownProtobufLibrary();
     // http://lists.fedoraproject.org/pipermail/devel/2010-January/129117.html
     xmlCleanupParser();
@@ -129,10 +170,15 @@ extern "C" {
         NODE_SET_METHOD(target, "clearCache", clearCache);
         NODE_SET_METHOD(target, "gc", gc);
         NODE_SET_METHOD(target, "shutdown",shutdown);
+        NODE_SET_METHOD(target, "threadpoolSize", threadpoolSize);
+        NODE_SET_METHOD(target, "metrics", metrics);
 
         // Classes
         VectorTile::Initialize(target);
         Map::Initialize(target);
+        MapPool::Initialize(target);
+        CancelSignal::Initialize(target);
+        TileCache::Initialize(target);
         Color::Initialize(target);
         Geometry::Initialize(target);
         Feature::Initialize(target);
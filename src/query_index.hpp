@@ -0,0 +1,236 @@
+#ifndef __NODE_MAPNIK_QUERY_INDEX_H__
+#define __NODE_MAPNIK_QUERY_INDEX_H__
+
+// mapnik
+#include <mapnik/feature.hpp>
+#include <mapnik/box2d.hpp>
+#include <mapnik/geometry.hpp>
+
+// boost
+#include <boost/utility.hpp>
+#include <boost/foreach.hpp>
+
+// stl
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+namespace node_mapnik {
+
+// uniform grid over the bounding boxes of a set of decoded features,
+// built once and then used to find hit-test candidates for a point.
+// Vertices are copied out of the features so that hit-testing does not
+// touch the iteration state of the mapnik geometries and several threads
+// can query the same index.
+class query_index : private boost::noncopyable
+{
+public:
+    // read-only vertex source over one path of the index
+    class path_cursor
+    {
+    public:
+        path_cursor(query_index const& index, std::size_t path)
+            : index_(index),
+              begin_(index.paths_[path].begin),
+              end_(index.paths_[path].end),
+              type_(index.paths_[path].type),
+              itr_(begin_) {}
+
+        unsigned type() const
+        {
+            return type_;
+        }
+
+        void rewind(unsigned)
+        {
+            itr_ = begin_;
+        }
+
+        unsigned vertex(double * x, double * y)
+        {
+            if (itr_ >= end_) return mapnik::SEG_END;
+            *x = index_.xs_[itr_];
+            *y = index_.ys_[itr_];
+            return index_.commands_[itr_++];
+        }
+
+    private:
+        query_index const& index_;
+        std::size_t begin_;
+        std::size_t end_;
+        unsigned type_;
+        std::size_t itr_;
+    };
+
+    explicit query_index(std::vector<mapnik::feature_ptr> const& features)
+        : features_(features),
+          feature_paths_(),
+          paths_(),
+          xs_(),
+          ys_(),
+          commands_(),
+          boxes_(),
+          extent_(),
+          cols_(1),
+          rows_(1),
+          cell_width_(0),
+          cell_height_(0),
+          cells_()
+    {
+        boxes_.reserve(features_.size());
+        feature_paths_.reserve(features_.size() + 1);
+        for (std::size_t i = 0; i < features_.size(); ++i)
+        {
+            feature_paths_.push_back(paths_.size());
+            BOOST_FOREACH ( mapnik::geometry_type const& geom, features_[i]->paths() )
+            {
+                indexed_path path;
+                path.type = geom.type();
+                path.begin = xs_.size();
+                double x = 0;
+                double y = 0;
+                unsigned command;
+                geom.rewind(0);
+                while (mapnik::SEG_END != (command = geom.vertex(&x, &y)))
+                {
+                    xs_.push_back(x);
+                    ys_.push_back(y);
+                    commands_.push_back(static_cast<unsigned char>(command));
+                }
+                path.end = xs_.size();
+                paths_.push_back(path);
+            }
+            mapnik::box2d<double> box = features_[i]->envelope();
+            boxes_.push_back(box);
+            if (!box.valid()) continue;
+            if (!extent_.valid()) extent_ = box;
+            else extent_.expand_to_include(box);
+        }
+        feature_paths_.push_back(paths_.size());
+        if (!extent_.valid()) return;
+        // aim for roughly one feature per cell
+        unsigned dim = static_cast<unsigned>(std::ceil(std::sqrt(static_cast<double>(features_.size()))));
+        cols_ = std::max(1u, std::min(dim, 64u));
+        rows_ = cols_;
+        cell_width_ = extent_.width() / cols_;
+        cell_height_ = extent_.height() / rows_;
+        cells_.resize(cols_ * rows_);
+        for (std::size_t i = 0; i < boxes_.size(); ++i)
+        {
+            mapnik::box2d<double> const& box = boxes_[i];
+            if (!box.valid()) continue;
+            unsigned minc, minr, maxc, maxr;
+            cell_range(box, minc, minr, maxc, maxr);
+            for (unsigned r = minr; r <= maxr; ++r)
+            {
+                for (unsigned c = minc; c <= maxc; ++c)
+                {
+                    cells_[r * cols_ + c].push_back(i);
+                }
+            }
+        }
+    }
+
+    // indices of features whose bounding box intersects the query box
+    void query(mapnik::box2d<double> const& box, std::vector<std::size_t> & candidates) const
+    {
+        candidates.clear();
+        if (cells_.empty() || !box.intersects(extent_)) return;
+        unsigned minc, minr, maxc, maxr;
+        cell_range(box, minc, minr, maxc, maxr);
+        for (unsigned r = minr; r <= maxr; ++r)
+        {
+            for (unsigned c = minc; c <= maxc; ++c)
+            {
+                std::vector<std::size_t> const& cell = cells_[r * cols_ + c];
+                for (std::size_t i = 0; i < cell.size(); ++i)
+                {
+                    if (boxes_[cell[i]].intersects(box)) candidates.push_back(cell[i]);
+                }
+            }
+        }
+        // features spanning several cells are listed once, in layer order
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    }
+
+    mapnik::feature_ptr const& feature(std::size_t idx) const
+    {
+        return features_[idx];
+    }
+
+    std::size_t size() const
+    {
+        return features_.size();
+    }
+
+    // paths of feature idx are [paths_begin(idx), paths_end(idx))
+    std::size_t paths_begin(std::size_t idx) const
+    {
+        return feature_paths_[idx];
+    }
+
+    std::size_t paths_end(std::size_t idx) const
+    {
+        return feature_paths_[idx + 1];
+    }
+
+    path_cursor path(std::size_t path_idx) const
+    {
+        return path_cursor(*this, path_idx);
+    }
+
+private:
+    struct indexed_path
+    {
+        unsigned type;
+        std::size_t begin;
+        std::size_t end;
+    };
+
+    unsigned clamp_col(double x) const
+    {
+        if (cell_width_ <= 0) return 0;
+        double c = std::floor((x - extent_.minx()) / cell_width_);
+        if (c < 0) return 0;
+        if (c >= cols_) return cols_ - 1;
+        return static_cast<unsigned>(c);
+    }
+
+    unsigned clamp_row(double y) const
+    {
+        if (cell_height_ <= 0) return 0;
+        double r = std::floor((y - extent_.miny()) / cell_height_);
+        if (r < 0) return 0;
+        if (r >= rows_) return rows_ - 1;
+        return static_cast<unsigned>(r);
+    }
+
+    void cell_range(mapnik::box2d<double> const& box,
+                    unsigned & minc, unsigned & minr,
+                    unsigned & maxc, unsigned & maxr) const
+    {
+        minc = clamp_col(box.minx());
+        maxc = clamp_col(box.maxx());
+        minr = clamp_row(box.miny());
+        maxr = clamp_row(box.maxy());
+    }
+
+    std::vector<mapnik::feature_ptr> features_;
+    std::vector<std::size_t> feature_paths_;
+    std::vector<indexed_path> paths_;
+    std::vector<double> xs_;
+    std::vector<double> ys_;
+    std::vector<unsigned char> commands_;
+    std::vector<mapnik::box2d<double> > boxes_;
+    mapnik::box2d<double> extent_;
+    unsigned cols_;
+    unsigned rows_;
+    double cell_width_;
+    double cell_height_;
+    std::vector<std::vector<std::size_t> > cells_;
+};
+
+}
+
+#endif // __NODE_MAPNIK_QUERY_INDEX_H__
@@ -0,0 +1,80 @@
+#include "render_stats.hpp"
+
+// node
+#include <node.h>
+
+namespace node_mapnik {
+
+void instrument_layers(std::vector<mapnik::layer> & layers,
+                       render_stats & stats)
+{
+    // sized once up front: the datasources keep references into it
+    stats.layers.resize(layers.size());
+    for (std::size_t i = 0; i < layers.size(); ++i)
+    {
+        stats.layers[i].name = layers[i].name();
+        if (layers[i].datasource())
+        {
+            layers[i].set_datasource(MAPNIK_MAKE_SHARED<stats_datasource>(layers[i].datasource(),
+                                                                          &stats.layers[i]));
+        }
+    }
+}
+
+bool parse_stats_option(Local<Object> const& options,
+                        render_stats_ptr & stats,
+                        std::string & error_name)
+{
+    if (!options->Has(String::New("stats")))
+    {
+        return true;
+    }
+    Local<Value> stats_opt = options->Get(String::New("stats"));
+    if (!stats_opt->IsBoolean())
+    {
+        error_name = "'stats' must be a boolean";
+        return false;
+    }
+    if (stats_opt->BooleanValue())
+    {
+        stats = MAPNIK_MAKE_SHARED<render_stats>();
+    }
+    return true;
+}
+
+static double to_ms(uint64_t ns)
+{
+    return static_cast<double>(ns) / 1e6;
+}
+
+Local<Object> render_stats_object(render_stats const& stats)
+{
+    HandleScope scope;
+    Local<Object> obj = Object::New();
+    obj->Set(String::NewSymbol("queueTime"), Number::New(to_ms(stats.started_at - stats.queued_at)));
+    obj->Set(String::NewSymbol("renderTime"), Number::New(to_ms(stats.finished_at - stats.started_at)));
+    Local<Array> layers = Array::New(stats.layers.size());
+    for (std::size_t i = 0; i < stats.layers.size(); ++i)
+    {
+        layer_stats const& ls = stats.layers[i];
+        uint64_t time = ls.time;
+        if (time == 0 && ls.first_query > 0)
+        {
+            time = ls.last_feature - ls.first_query;
+        }
+        // everything but reading features: evaluating rules and drawing
+        uint64_t symbolizer_time = time > ls.query_time ? time - ls.query_time : 0;
+        Local<Object> layer = Object::New();
+        layer->Set(String::NewSymbol("name"), String::New(ls.name.c_str()));
+        layer->Set(String::NewSymbol("time"), Number::New(to_ms(time)));
+        layer->Set(String::NewSymbol("queryTime"), Number::New(to_ms(ls.query_time)));
+        layer->Set(String::NewSymbol("symbolizerTime"), Number::New(to_ms(symbolizer_time)));
+        layer->Set(String::NewSymbol("features"), Number::New(static_cast<double>(ls.features)));
+        layer->Set(String::NewSymbol("vertices"), Number::New(static_cast<double>(ls.vertices)));
+        layers->Set(i, layer);
+    }
+    obj->Set(String::NewSymbol("layers"), layers);
+    return scope.Close(obj);
+}
+
+}
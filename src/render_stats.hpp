@@ -0,0 +1,142 @@
+#ifndef __NODE_MAPNIK_RENDER_STATS_H__
+#define __NODE_MAPNIK_RENDER_STATS_H__
+
+#include <v8.h>
+#include <uv.h>
+#include "forwarding_datasource.hpp"
+
+// mapnik
+#include <mapnik/feature.hpp>
+#include <mapnik/featureset.hpp>
+#include <mapnik/layer.hpp>
+#include <mapnik/query.hpp>
+#include "mapnik3x_compatibility.hpp"
+
+// boost
+#include MAPNIK_SHARED_INCLUDE
+#include MAPNIK_MAKE_SHARED_INCLUDE
+
+// stl
+#include <string>
+#include <vector>
+
+using namespace v8;
+
+namespace node_mapnik {
+
+// uv_hrtime() nanoseconds spent on one layer of a render
+struct layer_stats
+{
+    std::string name;
+    uint64_t time;       // the whole layer: querying, styling and drawing
+    uint64_t query_time; // in the datasource: features() and next()
+    uint64_t first_query;
+    uint64_t last_feature;
+    uint64_t features;
+    uint64_t vertices;
+    layer_stats() :
+        name(),
+        time(0),
+        query_time(0),
+        first_query(0),
+        last_feature(0),
+        features(0),
+        vertices(0) {}
+};
+
+// filled in by one render job when the 'stats' option is set
+struct render_stats
+{
+    uint64_t queued_at;
+    uint64_t started_at;
+    uint64_t finished_at;
+    std::vector<layer_stats> layers; // indexed like the map's layers
+    render_stats() :
+        queued_at(uv_hrtime()),
+        started_at(0),
+        finished_at(0),
+        layers() {}
+};
+
+typedef MAPNIK_SHARED_PTR<render_stats> render_stats_ptr;
+
+// times and counts what the renderer pulls from a featureset
+class stats_featureset : public mapnik::Featureset
+{
+public:
+    stats_featureset(mapnik::featureset_ptr const& fs, layer_stats * stats)
+        : fs_(fs),
+          stats_(stats) {}
+
+    mapnik::feature_ptr next()
+    {
+        uint64_t start = uv_hrtime();
+        mapnik::feature_ptr feature = fs_->next();
+        uint64_t end = uv_hrtime();
+        stats_->query_time += end - start;
+        stats_->last_feature = end;
+        if (feature)
+        {
+            ++stats_->features;
+            for (std::size_t i = 0; i < feature->num_geometries(); ++i)
+            {
+                stats_->vertices += feature->get_geometry(i).size();
+            }
+        }
+        return feature;
+    }
+
+private:
+    mapnik::featureset_ptr fs_;
+    layer_stats * stats_;
+};
+
+// wraps a layer's datasource for one render job to fill in its stats
+class stats_datasource : public forwarding_datasource
+{
+public:
+    stats_datasource(MAPNIK_SHARED_PTR<mapnik::datasource> const& ds,
+                     layer_stats * stats)
+        : forwarding_datasource(ds),
+          stats_(stats) {}
+
+    mapnik::featureset_ptr features(mapnik::query const& q) const
+    {
+        uint64_t start = uv_hrtime();
+        if (stats_->first_query == 0)
+        {
+            stats_->first_query = start;
+        }
+        mapnik::featureset_ptr fs = ds_->features(q);
+        uint64_t end = uv_hrtime();
+        stats_->query_time += end - start;
+        stats_->last_feature = end;
+        if (!fs)
+        {
+            return fs;
+        }
+        return MAPNIK_MAKE_SHARED<stats_featureset>(fs, stats_);
+    }
+
+private:
+    layer_stats * stats_;
+};
+
+// sizes stats.layers for layers and points every datasource at its entry.
+// Renderers that do not report per layer timing get the span from the
+// first query to the last feature as the layer time.
+void instrument_layers(std::vector<mapnik::layer> & layers,
+                       render_stats & stats);
+
+// reads the optional boolean 'stats' option
+bool parse_stats_option(Local<Object> const& options,
+                        render_stats_ptr & stats,
+                        std::string & error_name);
+
+// {queueTime, renderTime, layers: [{name, time, queryTime, symbolizerTime,
+// features, vertices}]} in milliseconds
+Local<Object> render_stats_object(render_stats const& stats);
+
+}
+
+#endif // __NODE_MAPNIK_RENDER_STATS_H__
@@ -0,0 +1,60 @@
+#ifndef __NODE_MAPNIK_SCRATCH_IMAGE_H__
+#define __NODE_MAPNIK_SCRATCH_IMAGE_H__
+
+// mapnik
+#include <mapnik/graphics.hpp>          // for image_32
+
+#include "mapnik3x_compatibility.hpp"
+#include "mapnik_image.hpp"             // for image_ptr
+
+// boost
+#include MAPNIK_MAKE_SHARED_INCLUDE
+
+// stl
+#include <vector>
+#include <cstddef>
+
+namespace node_mapnik {
+
+// render targets for renders that hand back encoded bytes instead of an Image.
+// The pool is only touched from the main thread: an image is taken when the
+// render job is queued and given back in its after callback, so the worker
+// owns it exclusively in between.
+
+static const std::size_t SCRATCH_IMAGE_POOL_SIZE = 16;
+
+inline std::vector<image_ptr> & scratch_image_pool()
+{
+    static std::vector<image_ptr> pool;
+    return pool;
+}
+
+inline image_ptr acquire_scratch_image(unsigned width, unsigned height)
+{
+    std::vector<image_ptr> & pool = scratch_image_pool();
+    for (std::size_t i = pool.size(); i > 0; --i)
+    {
+        image_ptr image = pool[i - 1];
+        if (image->width() == width && image->height() == height)
+        {
+            pool.erase(pool.begin() + (i - 1));
+            return image;
+        }
+    }
+    return MAPNIK_MAKE_SHARED<mapnik::image_32>(width,height);
+}
+
+inline void release_scratch_image(image_ptr const& image)
+{
+    std::vector<image_ptr> & pool = scratch_image_pool();
+    // drop the least recently used size first
+    if (pool.size() >= SCRATCH_IMAGE_POOL_SIZE)
+    {
+        pool.erase(pool.begin());
+    }
+    pool.push_back(image);
+}
+
+}
+
+#endif // __NODE_MAPNIK_SCRATCH_IMAGE_H__
@@ -0,0 +1,93 @@
+#ifndef __NODE_MAPNIK_SHARED_QUERY_DATASOURCE_H__
+#define __NODE_MAPNIK_SHARED_QUERY_DATASOURCE_H__
+
+#include "forwarding_datasource.hpp"
+
+// mapnik
+#include <mapnik/feature.hpp>
+#include <mapnik/featureset.hpp>
+#include <mapnik/query.hpp>
+#include "mapnik3x_compatibility.hpp"
+
+// boost
+#include MAPNIK_SHARED_INCLUDE
+#include MAPNIK_MAKE_SHARED_INCLUDE
+#include <boost/foreach.hpp>
+
+// stl
+#include <set>
+#include <string>
+#include <vector>
+
+namespace node_mapnik {
+
+typedef std::vector<mapnik::feature_ptr> feature_list;
+
+// hands out the features read by the first query, in order
+class replay_featureset : public mapnik::Featureset
+{
+public:
+    explicit replay_featureset(MAPNIK_SHARED_PTR<feature_list const> const& features)
+        : features_(features),
+          itr_(0) {}
+
+    mapnik::feature_ptr next()
+    {
+        if (itr_ < features_->size())
+        {
+            return (*features_)[itr_++];
+        }
+        return mapnik::feature_ptr();
+    }
+
+private:
+    MAPNIK_SHARED_PTR<feature_list const> features_;
+    std::size_t itr_;
+};
+
+// wraps a layer's datasource for renders of the same map extent by more
+// than one renderer in one job. The first query reads every feature, with
+// the extra property names the later renderers need, and later queries
+// replay them instead of asking the datasource again.
+// Not thread safe: share it only within one job.
+class shared_query_datasource : public forwarding_datasource
+{
+public:
+    shared_query_datasource(MAPNIK_SHARED_PTR<mapnik::datasource> const& ds,
+                            std::set<std::string> const& extra_names)
+        : forwarding_datasource(ds),
+          extra_names_(extra_names),
+          features_() {}
+
+    mapnik::featureset_ptr features(mapnik::query const& q) const
+    {
+        if (!features_)
+        {
+            mapnik::query shared_q(q);
+            BOOST_FOREACH ( std::string const& name, extra_names_ )
+            {
+                shared_q.add_property_name(name);
+            }
+            MAPNIK_SHARED_PTR<feature_list> features = MAPNIK_MAKE_SHARED<feature_list>();
+            mapnik::featureset_ptr fs = ds_->features(shared_q);
+            if (fs)
+            {
+                mapnik::feature_ptr feature;
+                while ((feature = fs->next()))
+                {
+                    features->push_back(feature);
+                }
+            }
+            features_ = features;
+        }
+        return MAPNIK_MAKE_SHARED<replay_featureset>(features_);
+    }
+
+private:
+    std::set<std::string> extra_names_;
+    mutable MAPNIK_SHARED_PTR<feature_list const> features_;
+};
+
+}
+
+#endif // __NODE_MAPNIK_SHARED_QUERY_DATASOURCE_H__
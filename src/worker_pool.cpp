@@ -0,0 +1,265 @@
+#include "worker_pool.hpp"
+#include "job_metrics.hpp"
+
+// stl
+#include <deque>
+#include <vector>
+#include <cstdlib>
+
+namespace node_mapnik {
+
+struct pool_job {
+    uv_work_t* req;
+    uv_work_cb work;
+    uv_after_work_cb after;
+    std::string op;
+    uint64_t queued_at;
+    uint64_t started_at;
+    uint64_t finished_at;
+    bool failed;
+};
+
+static const unsigned DEFAULT_THREADPOOL_SIZE = 4;
+static const unsigned MAX_THREADPOOL_SIZE = 128;
+static const int PRIORITY_CLASSES = 2;
+
+// guarded by pool_mutex
+static std::deque<pool_job> pool_queues[PRIORITY_CLASSES];
+static std::deque<pool_job> pool_done;
+
+static uv_mutex_t pool_mutex;
+static uv_cond_t pool_cond;
+static uv_async_t pool_async;
+static std::vector<uv_thread_t> pool_threads;
+static bool pool_initialized = false;
+static bool pool_started = false;
+// tells the threads to exit, guarded by pool_mutex
+static bool pool_stopping = false;
+static unsigned pool_size = 0;
+// jobs queued or running, main thread only
+static unsigned pool_pending = 0;
+// the job whose after callback is running, main thread only
+static pool_job * pool_completing = NULL;
+
+struct deferred_call {
+    void (*fn)(void *);
+    void * data;
+};
+
+// main thread only
+static std::deque<deferred_call> deferred;
+static uv_idle_t deferred_idle;
+static bool deferred_started = false;
+
+static void pool_worker(void*)
+{
+    for (;;)
+    {
+        uv_mutex_lock(&pool_mutex);
+        while (!pool_stopping &&
+               pool_queues[PRIORITY_HIGH].empty() &&
+               pool_queues[PRIORITY_NORMAL].empty())
+        {
+            uv_cond_wait(&pool_cond, &pool_mutex);
+        }
+        // queued jobs stay queued for a restarted pool
+        if (pool_stopping)
+        {
+            uv_mutex_unlock(&pool_mutex);
+            return;
+        }
+        std::deque<pool_job> & queue = pool_queues[PRIORITY_HIGH].empty() ?
+                                       pool_queues[PRIORITY_NORMAL] :
+                                       pool_queues[PRIORITY_HIGH];
+        pool_job job = queue.front();
+        queue.pop_front();
+        uv_mutex_unlock(&pool_mutex);
+
+        job.started_at = uv_hrtime();
+        job.work(job.req);
+        job.finished_at = uv_hrtime();
+
+        uv_mutex_lock(&pool_mutex);
+        pool_done.push_back(job);
+        uv_mutex_unlock(&pool_mutex);
+        uv_async_send(&pool_async);
+    }
+}
+
+// several sends may be coalesced into one call, so drain everything done
+static void EIO_AfterPoolWork(uv_async_t*)
+{
+    std::deque<pool_job> done;
+    uv_mutex_lock(&pool_mutex);
+    done.swap(pool_done);
+    uv_mutex_unlock(&pool_mutex);
+    // no longer running, even while waiting for their turn below
+    pool_pending -= done.size();
+    for (std::size_t i = 0; i < done.size(); ++i)
+    {
+        pool_completing = &done[i];
+        done[i].after(done[i].req, 0);
+        pool_completing = NULL;
+        job_completed(done[i].op,
+                      done[i].queued_at,
+                      done[i].started_at,
+                      done[i].finished_at,
+                      done[i].failed);
+    }
+    // let the process exit while the pool is idle
+    if (pool_pending == 0)
+    {
+        uv_unref(reinterpret_cast<uv_handle_t *>(&pool_async));
+    }
+}
+
+unsigned threadpool_size()
+{
+    if (pool_size == 0)
+    {
+        pool_size = DEFAULT_THREADPOOL_SIZE;
+        const char * env = std::getenv("MAPNIK_THREADPOOL_SIZE");
+        if (env)
+        {
+            int size = std::atoi(env);
+            if (size > 0) pool_size = static_cast<unsigned>(size);
+        }
+        if (pool_size > MAX_THREADPOOL_SIZE) pool_size = MAX_THREADPOOL_SIZE;
+    }
+    return pool_size;
+}
+
+bool set_threadpool_size(unsigned size)
+{
+    if (pool_started || size == 0) return false;
+    pool_size = size > MAX_THREADPOOL_SIZE ? MAX_THREADPOOL_SIZE : size;
+    return true;
+}
+
+static void start_pool()
+{
+    if (!pool_initialized)
+    {
+        uv_mutex_init(&pool_mutex);
+        uv_cond_init(&pool_cond);
+        uv_async_init(uv_default_loop(), &pool_async, (uv_async_cb)EIO_AfterPoolWork);
+        uv_unref(reinterpret_cast<uv_handle_t *>(&pool_async));
+        pool_initialized = true;
+    }
+    else if (pool_pending > 0)
+    {
+        // jobs left queued by stop_threadpool
+        uv_ref(reinterpret_cast<uv_handle_t *>(&pool_async));
+    }
+    unsigned size = threadpool_size();
+    pool_threads.resize(size);
+    for (unsigned i = 0; i < size; ++i)
+    {
+        uv_thread_create(&pool_threads[i], pool_worker, NULL);
+    }
+    pool_started = true;
+}
+
+void stop_threadpool()
+{
+    if (!pool_started) return;
+    uv_mutex_lock(&pool_mutex);
+    pool_stopping = true;
+    uv_mutex_unlock(&pool_mutex);
+    uv_cond_broadcast(&pool_cond);
+    for (std::size_t i = 0; i < pool_threads.size(); ++i)
+    {
+        uv_thread_join(&pool_threads[i]);
+    }
+    pool_threads.clear();
+    uv_mutex_lock(&pool_mutex);
+    pool_stopping = false;
+    uv_mutex_unlock(&pool_mutex);
+    pool_started = false;
+    // jobs left queued must not keep the loop alive
+    uv_unref(reinterpret_cast<uv_handle_t *>(&pool_async));
+}
+
+void threadpool_load(unsigned & queued, unsigned & running)
+{
+    queued = 0;
+    running = 0;
+    if (!pool_initialized) return;
+    uv_mutex_lock(&pool_mutex);
+    queued = pool_queues[PRIORITY_HIGH].size() + pool_queues[PRIORITY_NORMAL].size();
+    unsigned done = pool_done.size();
+    uv_mutex_unlock(&pool_mutex);
+    running = pool_pending - queued - done;
+}
+
+// calls deferred while these run wait for the next turn of the loop
+static void run_deferred(uv_idle_t*)
+{
+    std::deque<deferred_call> calls;
+    calls.swap(deferred);
+    for (std::size_t i = 0; i < calls.size(); ++i)
+    {
+        calls[i].fn(calls[i].data);
+    }
+    if (deferred.empty())
+    {
+        uv_idle_stop(&deferred_idle);
+    }
+}
+
+void defer(void (*fn)(void *), void * data)
+{
+    if (!deferred_started)
+    {
+        uv_idle_init(uv_default_loop(), &deferred_idle);
+        deferred_started = true;
+    }
+    deferred_call call;
+    call.fn = fn;
+    call.data = data;
+    deferred.push_back(call);
+    // an active idle handle also keeps the loop alive until it has run
+    uv_idle_start(&deferred_idle, (uv_idle_cb)run_deferred);
+}
+
+void job_failed()
+{
+    if (pool_completing)
+    {
+        pool_completing->failed = true;
+    }
+}
+
+void queue_work(uv_work_t* req,
+                uv_work_cb work,
+                uv_after_work_cb after,
+                std::string const& op,
+                work_priority priority,
+                uint64_t queued_at)
+{
+    if (!pool_started)
+    {
+        start_pool();
+    }
+    pool_job job;
+    job.req = req;
+    job.work = work;
+    job.after = after;
+    job.op = op;
+    job.queued_at = queued_at ? queued_at : uv_hrtime();
+    job.started_at = 0;
+    job.finished_at = 0;
+    job.failed = false;
+    job_queued(op);
+    // keep the loop alive until the after callback has run
+    if (pool_pending++ == 0)
+    {
+        uv_ref(reinterpret_cast<uv_handle_t *>(&pool_async));
+    }
+    uv_mutex_lock(&pool_mutex);
+    pool_queues[priority].push_back(job);
+    uv_mutex_unlock(&pool_mutex);
+    uv_cond_signal(&pool_cond);
+}
+
+}
@@ -0,0 +1,56 @@
+#ifndef __NODE_MAPNIK_WORKER_POOL_H__
+#define __NODE_MAPNIK_WORKER_POOL_H__
+
+#include <uv.h>
+
+// stl
+#include <string>
+
+namespace node_mapnik {
+
+// node-mapnik runs its async work on its own threads instead of libuv's
+// default threadpool, which it would otherwise share with fs and dns
+// requests. Idle threads always take high priority jobs first, so cheap
+// calls (isSolid, clear, info, ...) do not wait behind queued renders.
+enum work_priority {
+    PRIORITY_HIGH = 0,
+    PRIORITY_NORMAL = 1
+};
+
+// drop-in for uv_queue_work(uv_default_loop(), ...): work runs on a pool
+// thread, after runs on the main thread once work has returned. op names
+// the operation in mapnik.metrics(). queued_at (uv_hrtime()) is when the
+// job was requested, for jobs that waited before being queued here; 0
+// means now.
+void queue_work(uv_work_t* req,
+                uv_work_cb work,
+                uv_after_work_cb after,
+                std::string const& op,
+                work_priority priority = PRIORITY_NORMAL,
+                uint64_t queued_at = 0);
+
+// called from an after callback that reports an error, to count the job
+// as failed in mapnik.metrics(). Does nothing outside of after callbacks.
+void job_failed();
+
+// jobs waiting for a thread and jobs running on one
+void threadpool_load(unsigned & queued, unsigned & running);
+
+// number of pool threads, MAPNIK_THREADPOOL_SIZE or 4 by default. The size
+// can only be changed before the first job starts the pool.
+unsigned threadpool_size();
+bool set_threadpool_size(unsigned size);
+
+// waits for the running jobs and joins the pool threads, for mapnik.shutdown()
+// and process exit. Queued jobs are not started; the next queue_work starts
+// the threads again. Main thread only.
+void stop_threadpool();
+
+// runs fn(data) on the main thread on a later turn of the event loop,
+// without a pool job. For results that are ready at once (cache hits, idle
+// maps) but must still be delivered asynchronously. Main thread only.
+void defer(void (*fn)(void *), void * data);
+
+}
+
+#endif // __NODE_MAPNIK_WORKER_POOL_H__
@@ -0,0 +1,68 @@
+var mapnik = require('../');
+var assert = require('assert');
+var path = require('path');
+
+mapnik.register_datasource(path.join(mapnik.settings.paths.input_plugins,'shape.input'));
+
+describe('mapnik.CancelSignal', function() {
+    it('should start out not cancelled', function() {
+        var signal = new mapnik.CancelSignal();
+        assert.equal(signal.cancelled, false);
+        signal.cancel();
+        assert.equal(signal.cancelled, true);
+    });
+
+    it('should throw with invalid options', function() {
+        var map = new mapnik.Map(256, 256);
+        var im = new mapnik.Image(256, 256);
+        assert.throws(function() { map.render(im, {signal:{}}, function() {}); });
+        assert.throws(function() { map.render(im, {timeout:0}, function() {}); });
+        assert.throws(function() { map.render(im, {timeout:'10'}, function() {}); });
+        assert.throws(function() { im.encode('png', {signal:null}, function() {}); });
+    });
+
+    it('should cancel a map render', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.load('./test/stylesheet.xml', function(err,map) {
+            if (err) throw err;
+            map.zoomAll();
+            var signal = new mapnik.CancelSignal();
+            signal.cancel();
+            map.render(new mapnik.Image(256, 256), {signal:signal}, function(err, im) {
+                assert.ok(err);
+                assert.equal(err.code, 'ECANCELED');
+                // the map is usable again afterwards
+                map.render(new mapnik.Image(256, 256), function(err, im) {
+                    if (err) throw err;
+                    done();
+                });
+            });
+        });
+    });
+
+    it('should cancel an encode', function(done) {
+        var im = new mapnik.Image(256, 256);
+        var signal = new mapnik.CancelSignal();
+        signal.cancel();
+        im.encode('png', {signal:signal}, function(err, buffer) {
+            assert.ok(err);
+            assert.equal(err.code, 'ECANCELED');
+            done();
+        });
+    });
+
+    it('should leave the target of a cancelled composite untouched', function() {
+        var vtile = new mapnik.VectorTile(0,0,0);
+        var source = new mapnik.VectorTile(0,0,0);
+        source.setData(new Buffer('hello'));
+        var signal = new mapnik.CancelSignal();
+        signal.cancel();
+        try {
+            vtile.composite([source], {signal:signal});
+            assert.fail('composite should have thrown');
+        } catch (err) {
+            assert.equal(err.code, 'ECANCELED');
+        }
+        assert.equal(vtile.getData().length, 0);
+    });
+});
@@ -0,0 +1,119 @@
+var mapnik = require('../');
+var assert = require('assert');
+var path = require('path');
+
+mapnik.register_datasource(path.join(mapnik.settings.paths.input_plugins,'shape.input'));
+
+describe('mapnik.MapPool', function() {
+    it('should throw with invalid usage', function() {
+        assert.throws(function() { mapnik.MapPool(1, './test/stylesheet.xml'); });
+        assert.throws(function() { new mapnik.MapPool(); });
+        assert.throws(function() { new mapnik.MapPool(0, './test/stylesheet.xml'); });
+        assert.throws(function() { new mapnik.MapPool(1, './test/doesnotexist.xml'); });
+        assert.throws(function() { new mapnik.MapPool(1, './test/stylesheet.xml', {width:'a'}); });
+        var pool = new mapnik.MapPool(1, './test/stylesheet.xml');
+        assert.throws(function() { pool.acquire(); });
+        assert.throws(function() { pool.release(new mapnik.Map(256, 256)); });
+    });
+
+    it('should clone maps from the loaded stylesheet', function(done) {
+        var pool = new mapnik.MapPool(2, './test/stylesheet.xml', {width:512, height:512});
+        assert.deepEqual(pool.stats(), {size:2, created:0, idle:0, waiting:0});
+        pool.acquire(function(err, a) {
+            if (err) throw err;
+            assert.ok(a instanceof mapnik.Map);
+            assert.equal(a.width, 512);
+            assert.equal(a.layers().length, 1);
+            pool.acquire(function(err, b) {
+                if (err) throw err;
+                assert.notEqual(a, b);
+                // clones do not share styles or layers with each other
+                b.add_layer(new mapnik.Layer('extra'));
+                assert.equal(a.layers().length, 1);
+                assert.deepEqual(pool.stats(), {size:2, created:2, idle:0, waiting:0});
+                pool.release(a);
+                assert.throws(function() { pool.release(a); });
+                pool.release(b);
+                assert.deepEqual(pool.stats(), {size:2, created:2, idle:2, waiting:0});
+                done();
+            });
+        });
+    });
+
+    it('should call back asynchronously and restore released maps', function(done) {
+        var pool = new mapnik.MapPool(1, './test/stylesheet.xml');
+        var acquired = false;
+        pool.acquire(function(err, map) {
+            if (err) throw err;
+            acquired = true;
+            var srs = map.srs;
+            var background = map.background.toString();
+            var buffer_size = map.bufferSize;
+            map.add_layer(new mapnik.Layer('extra'));
+            map.srs = '+init=epsg:4326';
+            map.background = new mapnik.Color('red');
+            map.bufferSize = 64;
+            pool.release(map);
+            var reacquired = false;
+            pool.acquire(function(err, next) {
+                if (err) throw err;
+                reacquired = true;
+                assert.equal(next, map);
+                assert.equal(next.layers().length, 1);
+                assert.equal(next.srs, srs);
+                assert.equal(next.background.toString(), background);
+                assert.equal(next.bufferSize, buffer_size);
+                done();
+            });
+            // even though the map was idle
+            assert.equal(reacquired, false);
+        });
+        assert.equal(acquired, false);
+    });
+
+    it('should reset the size, extent and buffer size of released maps', function(done) {
+        var pool = new mapnik.MapPool(1, './test/stylesheet.xml');
+        pool.acquire(function(err, map) {
+            if (err) throw err;
+            var extent = map.extent;
+            var buffer_size = map.bufferSize;
+            map.resize(512, 300);
+            map.zoomToBox(-1e6, -1e6, 1e6, 1e6);
+            map.bufferSize = 32;
+            pool.release(map);
+            pool.acquire(function(err, next) {
+                if (err) throw err;
+                assert.equal(next, map);
+                assert.equal(next.width, 256);
+                assert.equal(next.height, 256);
+                assert.deepEqual(next.extent, extent);
+                assert.equal(next.bufferSize, buffer_size);
+                assert.equal(next.layers().length, 1);
+                done();
+            });
+        });
+    });
+
+    it('should queue acquire calls until a map is released', function(done) {
+        var pool = new mapnik.MapPool(1, './test/stylesheet.xml');
+        pool.acquire(function(err, map) {
+            if (err) throw err;
+            map.zoomAll();
+            map.render(new mapnik.Image(map.width, map.height), function(err, im) {
+                if (err) throw err;
+                assert.equal(pool.stats().waiting, 1);
+                map.resize(64, 64);
+                pool.release(map);
+            });
+            // the map is rendering and cannot go back to the pool yet
+            assert.throws(function() { pool.release(map); });
+            pool.acquire(function(err, next) {
+                if (err) throw err;
+                assert.equal(next, map);
+                assert.equal(next.width, 256);
+                assert.equal(pool.stats().waiting, 0);
+                done();
+            });
+        });
+    });
+});
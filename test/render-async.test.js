@@ -31,4 +31,128 @@ describe('mapnik async rendering', function() {
             });
         });
     });
+
+    it('should render a metatile to encoded tiles', function(done) {
+        var map = new mapnik.Map(512, 512);
+        map.load('./test/stylesheet.xml', function(err,map) {
+            if (err) throw err;
+            map.zoomAll();
+            var im = new mapnik.Image(map.width, map.height);
+            assert.throws(function() { map.render(im, {metatile:5}, function() {}); });
+            map.render(im, {metatile:2, format:'png'}, function(err, tiles) {
+                if (err) throw err;
+                assert.equal(tiles.length, 4);
+                tiles.forEach(function(tile) {
+                    assert.ok(tile instanceof Buffer);
+                    assert.equal(new mapnik.Image.fromBytesSync(tile).width(), 256);
+                });
+                done();
+            });
+        });
+    });
+
+    it('should render to encoded bytes', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.load('./test/stylesheet.xml', function(err,map) {
+            if (err) throw err;
+            map.zoomAll();
+            map.render({format:'png8:m=h'}, function(err, buffer) {
+                if (err) throw err;
+                assert.ok(buffer instanceof Buffer);
+                var im = new mapnik.Image.fromBytesSync(buffer);
+                assert.equal(im.width(), 256);
+                assert.equal(im.height(), 256);
+                done();
+            });
+        });
+    });
+
+    it('should queue concurrent renders on the same map', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.load('./test/stylesheet.xml', function(err,map) {
+            if (err) throw err;
+            map.zoomAll();
+            assert.equal(map.renderQueueLimit, -1);
+            assert.throws(function() { map.renderQueueLimit = 'a'; });
+            map.renderQueueLimit = 1;
+            var order = [];
+            map.render(new mapnik.Image(256, 256), function(err, im) {
+                if (err) throw err;
+                order.push(0);
+            });
+            map.render(new mapnik.Image(256, 256), function(err, im) {
+                if (err) throw err;
+                order.push(1);
+                assert.deepEqual(order, [0,1]);
+                done();
+            });
+            // one render in flight and one waiting: the queue is full
+            assert.throws(function() { map.render(new mapnik.Image(256, 256), function() {}); }, /render queue/);
+        });
+    });
+
+    it('should render queued jobs from the map state they were called with', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        map.zoomAll();
+        var expected_all = map.renderSync('png');
+        var results = [];
+        function check() {
+            if (results.length < 3) return;
+            assert.equal(mapnik.Image.fromBytesSync(results[0]).width(), 256);
+            assert.equal(results[0].toString('hex'), expected_all.toString('hex'));
+            assert.equal(results[1].toString('hex'), expected_all.toString('hex'));
+            assert.equal(mapnik.Image.fromBytesSync(results[2]).width(), 128);
+            assert.equal(results[2].toString('hex'), expected_zoomed.toString('hex'));
+            done();
+        }
+        map.render({format:'png'}, function(err, buffer) {
+            if (err) throw err;
+            results[0] = buffer;
+            check();
+        });
+        map.render({format:'png'}, function(err, buffer) {
+            if (err) throw err;
+            results[1] = buffer;
+            check();
+        });
+        // one render in flight and one waiting: neither sees these changes
+        map.zoomToBox(-2e6, -2e6, 2e6, 2e6);
+        map.resize(128, 128);
+        assert.deepEqual(map.extent.map(Math.round), [-2e6, -2e6, 2e6, 2e6]);
+        var expected_zoomed = map.renderSync('png');
+        map.render({format:'png'}, function(err, buffer) {
+            if (err) throw err;
+            results[2] = buffer;
+            check();
+        });
+    });
+
+    it('should report per layer stats', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.load('./test/stylesheet.xml', function(err,map) {
+            if (err) throw err;
+            map.zoomAll();
+            assert.throws(function() { map.render(new mapnik.Image(256, 256), {stats:1}, function() {}); });
+            assert.throws(function() { map.render(new mapnik.Image(512, 512), {stats:true, metatile:2}, function() {}); });
+            map.render(new mapnik.Image(256, 256), {stats:true}, function(err, im, stats) {
+                if (err) throw err;
+                assert.ok(im instanceof mapnik.Image);
+                assert.equal(typeof stats.queueTime, 'number');
+                assert.equal(typeof stats.renderTime, 'number');
+                assert.equal(stats.layers.length, 1);
+                var layer = stats.layers[0];
+                assert.equal(layer.name, 'world');
+                assert.ok(layer.features > 0);
+                assert.ok(layer.vertices >= layer.features);
+                assert.ok(layer.queryTime <= layer.time);
+                assert.ok(layer.symbolizerTime <= layer.time);
+                map.render(new mapnik.Image(256, 256), function(err, im, stats) {
+                    if (err) throw err;
+                    assert.equal(stats, undefined);
+                    done();
+                });
+            });
+        });
+    });
 });
@@ -158,4 +158,76 @@ describe('mapnik grid rendering ', function() {
         });
     });
 
+    it('should render several layers into one grid', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.loadSync(stylesheet, {strict: true});
+        map.add_layer(new mapnik.Layer('empty'));
+        map.zoomAll();
+        var grid = new mapnik.Grid(map.width, map.height, {key: 'ISO3'});
+        assert.throws(function() { map.render(grid, {layers: []}, function() {}); });
+        assert.throws(function() { map.render(grid, {layers: ['world', 0]}, function() {}); });
+        assert.throws(function() { map.render(grid, {layers: ['missing']}, function() {}); });
+        assert.throws(function() { map.render(grid, {layers: [{layer: 'world', fields: 'NAME'}]}, function() {}); });
+        var options = {'layers': [{layer: 'empty', fields: ['FIPS']},
+                                  {layer: 'world', fields: ['NAME']}]
+                      };
+        map.render(grid, options, function(err, grid) {
+            if (err) throw err;
+            var grid_utf = grid.encodeSync('utf', {resolution: 4});
+            assert.deepEqual(grid.fields().sort(), ['FIPS', 'NAME']);
+            var keys = Object.keys(grid_utf.data);
+            assert.ok(keys.length > 0);
+            assert.ok(grid_utf.data[keys[0]].NAME);
+            done();
+        });
+    });
+
+    it('should refuse several layers with the __id__ key', function(done) {
+        // both layers read the same shapefile, so their feature ids overlap
+        var map = new mapnik.Map(256, 256);
+        map.loadSync(stylesheet, {strict: true});
+        var copy = map.get_layer('world');
+        copy.name = 'world2';
+        map.add_layer(copy);
+        map.zoomAll();
+        var grid = new mapnik.Grid(map.width, map.height, {key: '__id__'});
+        assert.throws(function() { map.render(grid, {layers: ['world', 'world2']}, function() {}); }, /__id__/);
+        assert.throws(function() {
+            map.render(new mapnik.Image(map.width, map.height), {grid: grid, layers: ['world', 'world2']}, function() {});
+        }, /__id__/);
+        var keyed = new mapnik.Grid(map.width, map.height, {key: 'ISO3'});
+        map.render(keyed, {layers: ['world', 'world2'], fields: ['NAME']}, function(err, keyed) {
+            if (err) throw err;
+            var grid_utf = keyed.encodeSync('utf', {resolution: 4});
+            var keys = Object.keys(grid_utf.data);
+            assert.ok(keys.length > 0);
+            assert.ok(grid_utf.data[keys[0]].NAME);
+            done();
+        });
+    });
+
+    it('should render an image and a grid from the same queries', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.loadSync(stylesheet, {strict: true});
+        map.zoomAll();
+        var im = new mapnik.Image(map.width, map.height);
+        var grid = new mapnik.Grid(map.width, map.height, {key: '__id__'});
+        assert.throws(function() { map.render(im, {grid: {}, layer: 0}, function() {}); });
+        assert.throws(function() { map.render(im, {grid: grid}, function() {}); });
+        assert.throws(function() { map.render(im, {grid: grid, layer: 0, metatile: 2}, function() {}); });
+        map.render(im, {grid: grid, layer: 0, fields: ['NAME'], stats: true}, function(err, im, grid, stats) {
+            if (err) throw err;
+            assert.equal(JSON.stringify(grid.encodeSync('utf', {resolution: 4})), reference);
+            map.render(new mapnik.Image(map.width, map.height), {stats: true}, function(err, expected, expected_stats) {
+                if (err) throw err;
+                assert.equal(im.encodeSync('png').toString('hex'), expected.encodeSync('png').toString('hex'));
+                // the grid replays the image's features instead of querying again
+                assert.ok(expected_stats.layers[0].features > 0);
+                assert.equal(stats.layers[0].features, expected_stats.layers[0].features);
+                assert.equal(stats.layers[0].vertices, expected_stats.layers[0].vertices);
+                done();
+            });
+        });
+    });
+
 });
@@ -0,0 +1,75 @@
+var mapnik = require('../');
+var assert = require('assert');
+var path = require('path');
+
+mapnik.register_datasource(path.join(mapnik.settings.paths.input_plugins,'shape.input'));
+
+describe('mapnik.threadpoolSize', function() {
+    it('should report the number of threads running async work', function() {
+        assert.ok(mapnik.threadpoolSize() >= 1);
+        assert.throws(function() { mapnik.threadpoolSize(0); });
+        assert.throws(function() { mapnik.threadpoolSize('a'); });
+    });
+
+    it('should not be resizable once async work has started', function(done) {
+        var im = new mapnik.Image(256, 256);
+        im.encode('png', function(err, buffer) {
+            if (err) throw err;
+            assert.ok(buffer.length > 0);
+            var size = mapnik.threadpoolSize();
+            assert.throws(function() { mapnik.threadpoolSize(size + 1); });
+            assert.equal(mapnik.threadpoolSize(), size);
+            done();
+        });
+    });
+});
+
+describe('mapnik.metrics', function() {
+    it('should count async jobs per operation', function(done) {
+        var im = new mapnik.Image(256, 256);
+        im.encode('png8:m=h', function(err, buffer) {
+            if (err) throw err;
+            im.encode('bogus', function(err) {
+                assert.ok(err);
+                var metrics = mapnik.metrics();
+                assert.ok(metrics.threadpool.size >= 1);
+                assert.equal(typeof metrics.threadpool.queued, 'number');
+                assert.equal(typeof metrics.threadpool.running, 'number');
+                var encode = metrics.operations['encode-png8'];
+                assert.ok(encode.count >= 1);
+                assert.equal(encode.inflight, 0);
+                assert.equal(encode.queueWait.count, encode.count);
+                assert.equal(encode.execution.buckets['+Inf'], encode.count);
+                assert.equal(metrics.operations['encode-bogus'].errors, 1);
+                // this job has finished even though its callback is running
+                assert.equal(metrics.threadpool.running, 0);
+                done();
+            });
+        });
+    });
+
+    it('should count the wait behind earlier renders on the same map', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        map.zoomAll();
+        var render = mapnik.metrics().operations['render-image'];
+        var wait_before = render ? render.queueWait.sum : 0;
+        var first_time;
+        map.render(new mapnik.Image(256, 256), {stats:true}, function(err, im, stats) {
+            if (err) throw err;
+            first_time = stats.renderTime;
+        });
+        map.render(new mapnik.Image(256, 256), function(err) {
+            if (err) throw err;
+            // the second render waited on the map while the first ran
+            var wait = mapnik.metrics().operations['render-image'].queueWait.sum - wait_before;
+            assert.ok(wait >= first_time);
+            done();
+        });
+    });
+
+    it('should report the renders waiting on a map', function() {
+        var map = new mapnik.Map(256, 256);
+        assert.equal(map.renderQueueLength, 0);
+    });
+});
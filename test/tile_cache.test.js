@@ -0,0 +1,140 @@
+var mapnik = require('../');
+var assert = require('assert');
+var path = require('path');
+
+mapnik.register_datasource(path.join(mapnik.settings.paths.input_plugins,'shape.input'));
+
+describe('mapnik.TileCache', function() {
+    it('should throw with invalid usage', function() {
+        assert.throws(function() { mapnik.TileCache(1024); });
+        assert.throws(function() { new mapnik.TileCache(); });
+        assert.throws(function() { new mapnik.TileCache(0); });
+        var map = new mapnik.Map(256, 256);
+        assert.throws(function() { map.render({format:'png', cache:{}}, function() {}); });
+    });
+
+    it('should coalesce identical renders and serve repeats from the cache', function(done) {
+        var cache = new mapnik.TileCache(1024 * 1024);
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        map.zoomAll();
+        var results = [];
+        var remaining = 3;
+        function rendered(err, buffer) {
+            if (err) throw err;
+            results.push(buffer);
+            if (--remaining > 0) return;
+            assert.equal(results[0].toString('hex'), results[1].toString('hex'));
+            assert.equal(results[0].toString('hex'), results[2].toString('hex'));
+            var stats = cache.stats();
+            assert.equal(stats.misses, 1);
+            assert.equal(stats.coalesced, 2);
+            assert.equal(stats.count, 1);
+            assert.equal(stats.inflight, 0);
+            map.render({format:'png', cache:cache}, function(err, buffer) {
+                if (err) throw err;
+                assert.equal(buffer.toString('hex'), results[0].toString('hex'));
+                assert.equal(cache.stats().hits, 1);
+                // a different format is a different tile
+                map.render({format:'jpeg', cache:cache}, function(err, buffer) {
+                    if (err) throw err;
+                    assert.equal(cache.stats().misses, 2);
+                    assert.equal(cache.stats().count, 2);
+                    cache.clear();
+                    assert.equal(cache.stats().count, 0);
+                    assert.equal(cache.stats().bytes, 0);
+                    done();
+                });
+            });
+        }
+        map.render({format:'png', cache:cache}, rendered);
+        map.render({format:'png', cache:cache}, rendered);
+        map.render({format:'png', cache:cache}, rendered);
+    });
+
+    it('should key tiles on the map state at call time', function(done) {
+        var cache = new mapnik.TileCache(1024 * 1024);
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        map.zoomAll();
+        var extent = map.extent;
+        var expected = map.renderSync('png');
+        var remaining = 2;
+        function rendered(err) {
+            if (err) throw err;
+            if (--remaining > 0) return;
+            assert.equal(cache.stats().misses, 2);
+            map.extent = extent;
+            var renders = mapnik.metrics().operations['render-image'].count;
+            var served = false;
+            map.render({format:'png', cache:cache}, function(err, buffer) {
+                if (err) throw err;
+                served = true;
+                assert.equal(cache.stats().hits, 1);
+                assert.equal(buffer.toString('hex'), expected.toString('hex'));
+                // hits are not pool jobs
+                var operations = mapnik.metrics().operations;
+                assert.equal(operations['render-image'].count, renders);
+                assert.equal(operations['cache-hit'], undefined);
+                done();
+            });
+            assert.equal(served, false);
+        }
+        map.render({format:'png', cache:cache}, rendered);
+        // changes the map for the next render only
+        map.zoomToBox(-2e6, -2e6, 2e6, 2e6);
+        map.render({format:'png', cache:cache}, rendered);
+    });
+
+    it('should key tiles on the palette colors and the maximum extent', function(done) {
+        var cache = new mapnik.TileCache(1024 * 1024);
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        map.zoomAll();
+        map.render({format:'png8', palette:new mapnik.Palette('\x01\x02\x03\xff\xff\xff\xff\xff'), cache:cache}, function(err) {
+            if (err) throw err;
+            // another palette object with the same colors
+            map.render({format:'png8', palette:new mapnik.Palette('\x01\x02\x03\xff\xff\xff\xff\xff'), cache:cache}, function(err) {
+                if (err) throw err;
+                assert.equal(cache.stats().hits, 1);
+                map.render({format:'png8', palette:new mapnik.Palette('\x04\x05\x06\xff\xff\xff\xff\xff'), cache:cache}, function(err) {
+                    if (err) throw err;
+                    assert.equal(cache.stats().hits, 1);
+                    assert.equal(cache.stats().misses, 2);
+                    map.maximumExtent = [-1e6, -1e6, 1e6, 1e6];
+                    map.render({format:'png8', palette:new mapnik.Palette('\x04\x05\x06\xff\xff\xff\xff\xff'), cache:cache}, function(err) {
+                        if (err) throw err;
+                        assert.equal(cache.stats().hits, 1);
+                        assert.equal(cache.stats().misses, 3);
+                        done();
+                    });
+                });
+            });
+        });
+    });
+
+    it('should evict the least recently used tiles', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        map.zoomAll();
+        map.render({format:'png'}, function(err, png) {
+            if (err) throw err;
+            map.render({format:'jpeg'}, function(err, jpeg) {
+                if (err) throw err;
+                // room for either tile but not both
+                var cache = new mapnik.TileCache(Math.max(png.length, jpeg.length) + 512);
+                map.render({format:'png', cache:cache}, function(err) {
+                    if (err) throw err;
+                    map.render({format:'jpeg', cache:cache}, function(err) {
+                        if (err) throw err;
+                        var stats = cache.stats();
+                        assert.equal(stats.evictions, 1);
+                        assert.equal(stats.count, 1);
+                        assert.ok(stats.bytes <= stats.maxBytes);
+                        done();
+                    });
+                });
+            });
+        });
+    });
+});
@@ -143,6 +143,28 @@ describe('mapnik.VectorTile ', function() {
         })
     });
 
+    it('should render by overzooming (async)', function(done) {
+        var vtile = new mapnik.VectorTile(2,1,1);
+        var vtiles = [get_tile_at('lines',[0,0,0]),get_tile_at('points',[1,1,1])]
+        var vtile_sync = new mapnik.VectorTile(2,1,1);
+        vtile_sync.compositeSync(vtiles);
+        vtile.composite(vtiles,{},function(err,result) {
+            if (err) throw err;
+            assert.equal(result,vtile);
+            assert.deepEqual(vtile.names(),['lines','points']);
+            assert.equal(vtile.getData().length,vtile_sync.getData().length);
+            done();
+        });
+    });
+
+    it('should error out in async composite with invalid options', function(done) {
+        var vtile = new mapnik.VectorTile(2,1,1);
+        assert.throws(function() { vtile.composite([],function(err) {}); });
+        assert.throws(function() { vtile.composite([{}],function(err) {}); });
+        assert.throws(function() { vtile.composite([vtile],{buffer_size:'a'},function(err) {}); });
+        done();
+    });
+
     it('should render with custom buffer_size', function(done) {
         var vtile = new mapnik.VectorTile(2,1,1);
         var vtiles = [get_tile_at('lines',[0,0,0]),get_tile_at('points',[1,1,1])]
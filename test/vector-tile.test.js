@@ -15,6 +15,7 @@ function deepEqualTrunc(json1,json2) {
 }
 
 mapnik.register_datasource(path.join(mapnik.settings.paths.input_plugins,'shape.input'));
+mapnik.register_datasource(path.join(mapnik.settings.paths.input_plugins,'csv.input'));
 
 describe('mapnik.VectorTile ', function() {
     // generate test data
@@ -116,6 +117,69 @@ describe('mapnik.VectorTile ', function() {
         })
     });
 
+    it('should detect solid tiles without parsing', function(done) {
+        var vtile = new mapnik.VectorTile(9,112,195);
+        vtile.setData(fs.readFileSync("./test/data/vector_tile/tile1.vector.pbf"));
+        assert.equal(vtile.isSolid(), "world");
+        assert.equal(vtile.painted(), false);
+        var vtile2 = new mapnik.VectorTile(5,28,12);
+        vtile2.setData(fs.readFileSync("./test/data/vector_tile/tile3.vector.pbf"));
+        assert.strictEqual(vtile2.isSolid(), false);
+        vtile.isSolid(function(err, solid, key) {
+            if (err) throw err;
+            assert.equal(solid, true);
+            assert.equal(key, "world");
+            assert.equal(vtile.painted(), false);
+            done();
+        });
+    });
+
+    it('should agree on solid tiles with and without parsing', function(done) {
+        // tiles from Map.render are checked with is_solid_extent, the same
+        // bytes passed to setData are checked by streaming them
+        var merc = '+proj=merc +a=6378137 +b=6378137 +lat_ts=0.0 +lon_0=0.0 +x_0=0.0 +y_0=0 +k=1.0 +units=m +nadgrids=@null +wktext +no_defs +over';
+        var outer = '(-30000000 -30000000,30000000 -30000000,30000000 30000000,-30000000 30000000,-30000000 -30000000)';
+        var hole = '(-1000000 -1000000,-1000000 1000000,1000000 1000000,1000000 -1000000,-1000000 -1000000)';
+        function polygon_map(polygons) {
+            var map = new mapnik.Map(256, 256, merc);
+            Object.keys(polygons).forEach(function(name) {
+                var layer = new mapnik.Layer(name, merc);
+                layer.datasource = new mapnik.Datasource({type:'csv', inline:'wkt\n"POLYGON(' + polygons[name] + ')"\n'});
+                map.add_layer(layer);
+            });
+            map.extent = [-20037508.34, -20037508.34, 20037508.34, 20037508.34];
+            return map;
+        }
+        var layers = new mapnik.Map(256, 256);
+        layers.loadSync('./test/data/vector_tile/layers.xml');
+        layers.extent = [-11271098.442818949,4696291.017841229,-11192826.925854929,4774562.534805249];
+        var world = new mapnik.Map(256, 256);
+        world.loadSync('./test/stylesheet.xml');
+        world.extent = [-20037508.34, -20037508.34, 20037508.34, 20037508.34];
+        var cases = [
+            [polygon_map({square:outer}), [0,0,0], 'square'],
+            [polygon_map({square:outer, hole:outer + ',' + hole}), [0,0,0], false],
+            [polygon_map({hole:outer + ',' + hole}), [0,0,0], false],
+            [layers, [9,112,195], 'world-world2'],
+            [world, [0,0,0], false]
+        ];
+        function next() {
+            if (!cases.length) return done();
+            var c = cases.shift();
+            var rendered = new mapnik.VectorTile(c[1][0],c[1][1],c[1][2]);
+            c[0].render(rendered, {}, function(err, rendered) {
+                if (err) throw err;
+                var raw = new mapnik.VectorTile(c[1][0],c[1][1],c[1][2]);
+                raw.setData(rendered.getData());
+                assert.strictEqual(rendered.isSolid(), c[2]);
+                assert.strictEqual(raw.isSolid(), c[2]);
+                assert.equal(raw.painted(), false);
+                next();
+            });
+        }
+        next();
+    });
+
     it('should be able to setData/parse (async)', function(done) {
         var vtile = new mapnik.VectorTile(9,112,195);
         var data = fs.readFileSync("./test/data/vector_tile/tile1.vector.pbf");
@@ -135,6 +199,28 @@ describe('mapnik.VectorTile ', function() {
         });
     });
 
+    it('should not change a tile while async calls use it', function(done) {
+        var vtile = new mapnik.VectorTile(9,112,195);
+        var data = fs.readFileSync("./test/data/vector_tile/tile1.vector.pbf");
+        vtile.setData(data, function(err) {
+            if (err) throw err;
+            var map = new mapnik.Map(256, 256);
+            map.loadSync('./test/stylesheet.xml');
+            vtile.render(map, new mapnik.Image(256, 256), function(err) {
+                if (err) throw err;
+                // free again once the render has called back
+                vtile.clear();
+                done();
+            });
+            assert.throws(function() { vtile.setData(data); }, /busy/);
+            assert.throws(function() { vtile.clear(function() {}); }, /busy/);
+            assert.throws(function() { vtile.parse(); }, /busy/);
+        });
+        // reads have to wait for the async setData
+        assert.throws(function() { vtile.names(); }, /busy/);
+        assert.throws(function() { vtile.getData(); }, /busy/);
+    });
+
     it('should be able to get layer names without parsing', function(done) {
         var vtile = new mapnik.VectorTile(9,112,195);
         var data = fs.readFileSync("./test/data/vector_tile/tile1.vector.pbf");
@@ -148,6 +234,18 @@ describe('mapnik.VectorTile ', function() {
     });
 
 
+    it('should be able to read layers without parsing', function(done) {
+        var vtile = new mapnik.VectorTile(9,112,195);
+        vtile.setData(new Buffer(_data,"hex"));
+        // layers are decoded on demand from the raw data
+        assert.deepEqual(vtile.names(),['world']);
+        assert.deepEqual(vtile.toJSON(),_vtile.toJSON());
+        deepEqualTrunc(vtile.toGeoJSON('world'),_vtile.toGeoJSON('world'));
+        vtile.parse();
+        assert.deepEqual(vtile.toJSON(),_vtile.toJSON());
+        done();
+    });
+
     it('should be able to get tile info as JSON', function(done) {
         var vtile = new mapnik.VectorTile(9,112,195);
         vtile.setData(new Buffer(_data,"hex"));
@@ -172,6 +270,49 @@ describe('mapnik.VectorTile ', function() {
         done();
     });
 
+    it('should be able to get GeoJSON as a string (sync and async)', function(done) {
+        var vtile = new mapnik.VectorTile(9,112,195);
+        vtile.setData(new Buffer(_data,"hex"));
+        deepEqualTrunc(JSON.parse(vtile.toGeoJSON(0,{format:'string'})),vtile.toGeoJSON(0));
+        deepEqualTrunc(JSON.parse(vtile.toGeoJSON('__all__',{format:'buffer'}).toString()),vtile.toGeoJSON('__all__'));
+        assert.throws(function() { vtile.toGeoJSON(0,{format:'foo'}); });
+        assert.throws(function() { vtile.toGeoJSON(0,{format:'object'},function(err) {}); });
+        vtile.toGeoJSON('__array__',function(err,json) {
+            if (err) throw err;
+            assert.equal(typeof json,'string');
+            deepEqualTrunc(JSON.parse(json),vtile.toGeoJSON('__array__'));
+            vtile.toGeoJSON('world',{format:'buffer'},function(err,buffer) {
+                if (err) throw err;
+                assert.ok(buffer instanceof Buffer);
+                deepEqualTrunc(JSON.parse(buffer.toString()),vtile.toGeoJSON('world'));
+                done();
+            });
+        });
+    });
+
+    it('should write the same numbers in GeoJSON strings as JSON.stringify', function() {
+        // a hand encoded tile: one point with float, double and nan properties
+        function bytes(num, data) { return Buffer.concat([new Buffer([(num << 3) | 2, data.length]), new Buffer(data)]); }
+        var float_value = new Buffer(5); float_value[0] = 0x15; float_value.writeFloatLE(0.1, 1);
+        var double_value = new Buffer(9); double_value[0] = 0x19; double_value.writeDoubleLE(0.1, 1);
+        var nan_value = new Buffer(9); nan_value[0] = 0x19; nan_value.writeDoubleLE(NaN, 1);
+        var feature = Buffer.concat([new Buffer([0x08, 1]), bytes(2, [0, 0, 1, 1, 2, 2]), new Buffer([0x18, 1]), bytes(4, [9, 2, 6])]);
+        var layer = Buffer.concat([new Buffer([0x78, 2]), bytes(1, new Buffer('geo')), bytes(2, feature),
+                                   bytes(3, new Buffer('f')), bytes(3, new Buffer('d')), bytes(3, new Buffer('n')),
+                                   bytes(4, float_value), bytes(4, double_value), bytes(4, nan_value),
+                                   new Buffer([0x28, 0x80, 0x20])]);
+        var vtile = new mapnik.VectorTile(0,0,0);
+        vtile.setData(bytes(3, layer));
+        vtile.parse();
+        var json = vtile.toGeoJSON(0,{format:'string'});
+        assert.ok(json.indexOf('"n":null') > -1);
+        assert.equal(json.indexOf('0.10000000000000001'), -1);
+        var expected = JSON.parse(JSON.stringify(vtile.toGeoJSON(0)));
+        assert.equal(expected.features[0].properties.d, 0.1);
+        assert.ok(expected.features[0].geometry.coordinates[0] % 1 !== 0);
+        assert.deepEqual(JSON.parse(json), expected);
+    });
+
     it('should be able to get and set data', function(done) {
         var vtile = new mapnik.VectorTile(9,112,195);
         vtile.setData(new Buffer(_data,"hex"));
@@ -185,6 +326,137 @@ describe('mapnik.VectorTile ', function() {
         done();
     });
 
+    it('should be able to set data without copying the buffer', function(done) {
+        var data = new Buffer(_data,"hex");
+        var vtile = new mapnik.VectorTile(9,112,195);
+        assert.throws(function() { vtile.setData(data,{copy:'no'}); });
+        vtile.setData(data,{copy:false});
+        assert.equal(vtile.getData(),data);
+        assert.deepEqual(vtile.names(),_vtile.names());
+        assert.deepEqual(vtile.toJSON(),_vtile.toJSON());
+        // adding data copies the borrowed bytes first
+        vtile.addData(new Buffer(_data,"hex"));
+        assert.equal(data.toString('hex'),_data);
+        vtile.parse();
+        assert.deepEqual(vtile.names(),_vtile.names().concat(_vtile.names()));
+        var vtile2 = new mapnik.VectorTile(9,112,195);
+        vtile2.setData(data,{copy:false},function(err) {
+            if (err) throw err;
+            vtile2.parse();
+            assert.deepEqual(vtile2.toJSON(),_vtile.toJSON());
+            done();
+        });
+    });
+
+    it('should be able to set and get compressed data', function(done) {
+        var zlib = require('zlib');
+        var data = new Buffer(_data,"hex");
+        zlib.gzip(data, function(err, gzipped) {
+            if (err) throw err;
+            var vtile = new mapnik.VectorTile(9,112,195);
+            vtile.setData(gzipped);
+            assert.equal(vtile.getData().toString('hex'),_data);
+            assert.deepEqual(vtile.toJSON(),_vtile.toJSON());
+            assert.throws(function() { vtile.getData({compression:'lzma'}); });
+            assert.throws(function() { vtile.getData({level:10}); });
+            assert.throws(function() { vtile.setData(gzipped.slice(0,gzipped.length/2)); });
+            zlib.deflate(data, function(err, deflated) {
+                if (err) throw err;
+                var vtile2 = new mapnik.VectorTile(9,112,195);
+                vtile2.setData(deflated, function(err) {
+                    if (err) throw err;
+                    assert.deepEqual(vtile2.toJSON(),_vtile.toJSON());
+                    var level9 = vtile2.getData({compression:'deflate',level:9});
+                    zlib.inflate(level9, function(err, inflated) {
+                        if (err) throw err;
+                        assert.equal(inflated.toString('hex'),_data);
+                        vtile2.getData({compression:'gzip'}, function(err, compressed) {
+                            if (err) throw err;
+                            zlib.gunzip(compressed, function(err, uncompressed) {
+                                if (err) throw err;
+                                assert.equal(uncompressed.toString('hex'),_data);
+                                done();
+                            });
+                        });
+                    });
+                });
+            });
+        });
+    });
+
+    it('should refuse to inflate oversized data and keep the tile', function(done) {
+        this.timeout(10000);
+        var zlib = require('zlib');
+        var zeros = new Buffer(65 * 1024 * 1024);
+        zeros.fill(0);
+        zlib.deflate(zeros, function(err, deflated) {
+            if (err) throw err;
+            var vtile = new mapnik.VectorTile(9,112,195);
+            vtile.setData(new Buffer(_data,"hex"));
+            assert.throws(function() { vtile.setData(deflated); }, /inflated size exceeds/);
+            assert.throws(function() { vtile.addData(deflated); }, /inflated size exceeds/);
+            assert.equal(vtile.getData().toString('hex'),_data);
+            vtile.setData(deflated, function(err) {
+                assert.ok(err);
+                assert.ok(/inflated size exceeds/.test(err.message));
+                assert.equal(vtile.getData().toString('hex'),_data);
+                done();
+            });
+        });
+    });
+
+    it('should be able to get the data of selected layers', function(done) {
+        var vtile = new mapnik.VectorTile(9,112,195);
+        vtile.setData(new Buffer(_data,"hex"));
+        vtile.addData(new Buffer(_data,"hex"));
+        assert.equal(vtile.getData({layers:['world']}).toString('hex'),_data+_data);
+        assert.equal(vtile.getData({layers:['missing']}).length,0);
+        assert.throws(function() { vtile.getData({layers:'world'}); });
+        assert.throws(function() { vtile.getData({layers:[1]}); });
+        vtile.parse();
+        // parsed tiles encode the selected layers again
+        assert.equal(vtile.getData({layers:['world','missing']}).toString('hex'),_data+_data);
+        // bytes that could not be indexed have no layers to select yet
+        var invalid = new mapnik.VectorTile(9,112,195);
+        invalid.setData(new Buffer('foo'));
+        assert.throws(function() { invalid.getData({layers:['world']}); }, /parse/);
+        var vtile2 = new mapnik.VectorTile(9,112,195);
+        vtile2.setData(new Buffer(_data,"hex"));
+        vtile2.getData({layers:['world']}, function(err, data) {
+            if (err) throw err;
+            assert.equal(data.toString('hex'),_data);
+            done();
+        });
+    });
+
+    it('should be able to get tile statistics', function(done) {
+        var vtile = new mapnik.VectorTile(9,112,195);
+        vtile.setData(fs.readFileSync("./test/data/vector_tile/tile1.vector.pbf"));
+        var expected = {
+            bytes: 213,
+            layers: [{
+                name: 'world',
+                version: 2,
+                extent: 4096,
+                bytes: 210,
+                features: 1,
+                keys: 11,
+                values: 10,
+                geometry_types: { unknown: 0, point: 0, linestring: 0, polygon: 1 }
+            }]
+        };
+        assert.deepEqual(vtile.info(), expected);
+        assert.throws(function() { vtile.info('foo'); });
+        vtile.info(function(err, info) {
+            if (err) throw err;
+            assert.deepEqual(info, expected);
+            vtile.parse();
+            assert.deepEqual(vtile.info(), expected);
+            assert.deepEqual(new mapnik.VectorTile(0,0,0).info(), {bytes:0, layers:[]});
+            done();
+        });
+    });
+
     it('should be able to get virtual datasource and features', function(done) {
         var vtile = new mapnik.VectorTile(9,112,195);
         vtile.setData(new Buffer(_data,"hex"));
@@ -368,6 +640,129 @@ describe('mapnik.VectorTile ', function() {
         });
     });
 
+    it('should not reuse layer matches after the map layers change', function(done) {
+        var vtile = new mapnik.VectorTile(0, 0, 0);
+        vtile.setData(fs.readFileSync('./test/data/vector_tile/tile0.vector.pbf'));
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        vtile.render(map, new mapnik.Image(256, 256), function(err, image) {
+            if (err) throw err;
+            var styled_length = image.encodeSync('png').length;
+            map.clear();
+            vtile.render(map, new mapnik.Image(256, 256), function(err, image) {
+                if (err) throw err;
+                // no layers left to match so only the background is drawn
+                assert.ok(image.encodeSync('png').length < styled_length);
+                done();
+            });
+        });
+    });
+
+    it('should reuse decoded layers across renders', function(done) {
+        var vtile = new mapnik.VectorTile(0, 0, 0);
+        vtile.setData(fs.readFileSync('./test/data/vector_tile/tile0.vector.pbf'));
+        assert.deepEqual(vtile.cacheStats(),{hits:0,misses:0,layers:0});
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        vtile.render(map, new mapnik.Image(256, 256), function(err, first) {
+            if (err) throw err;
+            assert.deepEqual(vtile.cacheStats(),{hits:0,misses:1,layers:1});
+            vtile.render(map, new mapnik.Image(256, 256), function(err, second) {
+                if (err) throw err;
+                assert.deepEqual(vtile.cacheStats(),{hits:1,misses:1,layers:1});
+                assert.equal(first.encodeSync('png').length,second.encodeSync('png').length);
+                vtile.clear();
+                assert.equal(vtile.cacheStats().layers,0);
+                done();
+            });
+        });
+    });
+
+    it('should render many child tiles from one vector tile', function(done) {
+        var vtile = new mapnik.VectorTile(0, 0, 0);
+        vtile.setData(fs.readFileSync('./test/data/vector_tile/tile0.vector.pbf'));
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        var children = [[1,0,0],[1,1,0],[1,0,1],[1,1,1]].map(function(zxy) {
+            return {z:zxy[0], x:zxy[1], y:zxy[2], surface:new mapnik.Image(256, 256)};
+        });
+        assert.throws(function() { vtile.renderMany(map, [], function() {}); });
+        assert.throws(function() { vtile.renderMany(map, [{z:1,x:0,y:0}], function() {}); });
+        assert.throws(function() { vtile.renderMany(map, children, {stream:1}, function() {}); });
+        var shared = new mapnik.Image(256, 256);
+        assert.throws(function() {
+            vtile.renderMany(map, [{z:1,x:0,y:0,surface:shared},{z:1,x:1,y:0,surface:shared}], function() {});
+        }, /different mapnik.Image/);
+        vtile.renderMany(map, children, {buffer_size:64}, function(err, images) {
+            if (err) throw err;
+            assert.equal(images.length, 4);
+            // same output as rendering the first child on its own
+            vtile.render(map, new mapnik.Image(256, 256), {z:1, x:0, y:0, buffer_size:64}, function(err, image) {
+                if (err) throw err;
+                assert.equal(images[0].encodeSync('png32').length, image.encodeSync('png32').length);
+                var seen = [];
+                var streamed = children.map(function(c) {
+                    return {z:c.z, x:c.x, y:c.y, surface:new mapnik.Image(256, 256)};
+                });
+                vtile.renderMany(map, streamed, {buffer_size:64, stream:true}, function(err, image, idx) {
+                    if (err) throw err;
+                    assert.equal(image, streamed[idx].surface);
+                    seen.push(idx);
+                    if (seen.length == streamed.length) {
+                        assert.deepEqual(seen.sort(), [0,1,2,3]);
+                        done();
+                    }
+                });
+            });
+        });
+    });
+
+    it('should render a metatile and split it into encoded tiles', function(done) {
+        var vtile = new mapnik.VectorTile(0, 0, 0);
+        vtile.setData(fs.readFileSync('./test/data/vector_tile/tile0.vector.pbf'));
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        assert.throws(function() { vtile.render(map, new mapnik.Image(512, 512), {metatile:3}, function() {}); });
+        assert.throws(function() { vtile.render(map, new mapnik.Image(512, 512), {metatile:0}, function() {}); });
+        assert.throws(function() { vtile.render(map, new mapnik.Image(512, 512), {metatile:2, palette:{}}, function() {}); });
+        vtile.render(map, new mapnik.Image(512, 512), {metatile:2, format:'png32'}, function(err, tiles) {
+            if (err) throw err;
+            assert.equal(tiles.length, 4);
+            vtile.render(map, new mapnik.Image(512, 512), function(err, image) {
+                if (err) throw err;
+                // row-major: [top-left, top-right, bottom-left, bottom-right]
+                assert.equal(tiles[0].length, image.view(0, 0, 256, 256).encodeSync('png32').length);
+                assert.equal(tiles[1].length, image.view(256, 0, 256, 256).encodeSync('png32').length);
+                assert.equal(tiles[2].length, image.view(0, 256, 256, 256).encodeSync('png32').length);
+                assert.equal(tiles[3].length, image.view(256, 256, 256, 256).encodeSync('png32').length);
+                done();
+            });
+        });
+    });
+
+    it('should render straight to encoded bytes', function(done) {
+        var vtile = new mapnik.VectorTile(0, 0, 0);
+        vtile.setData(fs.readFileSync('./test/data/vector_tile/tile0.vector.pbf'));
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        assert.throws(function() { vtile.render(map, {format:'png32', palette:{}}, function() {}); });
+        assert.throws(function() { vtile.render(map, {format:'png32'}, {metatile:2}, function() {}); });
+        vtile.render(map, {format:'png32'}, function(err, buffer) {
+            if (err) throw err;
+            assert.ok(buffer instanceof Buffer);
+            vtile.render(map, new mapnik.Image(256, 256), function(err, image) {
+                if (err) throw err;
+                assert.equal(buffer.length, image.encodeSync('png32').length);
+                // the scratch image is reused and cleared between renders
+                vtile.render(map, {format:'png32'}, function(err, again) {
+                    if (err) throw err;
+                    assert.equal(again.toString('hex'), buffer.toString('hex'));
+                    done();
+                });
+            });
+        });
+    });
+
     it('should read back the vector tile and render an image with it using negative buffer', function(done) {
         var vtile = new mapnik.VectorTile(0, 0, 0);
         vtile.setData(fs.readFileSync('./test/data/vector_tile/tile0.vector.pbf'));
@@ -418,6 +813,21 @@ describe('mapnik.VectorTile ', function() {
         });
     });
 
+    it('should return independent features when querying repeatedly', function() {
+        var data = fs.readFileSync("./test/data/vector_tile/tile3.vector.pbf");
+        var vtile = new mapnik.VectorTile(5,28,12);
+        vtile.setData(data);
+        vtile.parse();
+        var first = vtile.query(139.6142578125,37.17782559332976,{tolerance:0});
+        assert.equal(first.length,1);
+        first[0].addAttributes({NAME:'changed'});
+        var second = vtile.query(139.6142578125,37.17782559332976,{tolerance:0});
+        assert.equal(second.length,1);
+        assert.equal(second[0].id(),89);
+        assert.equal(JSON.parse(second[0].toJSON()).properties.NAME,'Japan');
+        assert.equal(second[0].toJSON(),vtile.query(139.6142578125,37.17782559332976,{tolerance:0})[0].toJSON());
+    });
+
     it('should be able to query features from vector tile', function(done) {
         var data = fs.readFileSync("./test/data/vector_tile/tile3.vector.pbf");
         var vtile = new mapnik.VectorTile(5,28,12);
@@ -457,6 +867,31 @@ describe('mapnik.VectorTile ', function() {
         });
     });
 
+    it('should be able to query many points at once', function(done) {
+        var data = fs.readFileSync("./test/data/vector_tile/tile3.vector.pbf");
+        var vtile = new mapnik.VectorTile(5,28,12);
+        vtile.setData(data);
+        vtile.parse();
+        var lonlats = new Float64Array([139.6142578125,37.17782559332976,142.3388671875,39.52099229357195]);
+        var sync = vtile.queryMany(lonlats,{tolerance:0});
+        assert.equal(sync.length,2);
+        assert.equal(sync[0].length,1);
+        assert.equal(sync[0][0].layer,0);
+        assert.equal(sync[0][0].id,89);
+        assert.equal(sync[0][0].distance,0);
+        assert.equal(sync[1].length,0);
+        assert.deepEqual(vtile.queryMany([139.6142578125,37.17782559332976],{layer:'doesnotexist'}),[[]]);
+        assert.throws(function() { vtile.queryMany([139.6142578125]); });
+        assert.throws(function() { vtile.queryMany(new Float32Array(2)); });
+        assert.throws(function() { vtile.query(139.6142578125,91); }, /could not reproject lon\/lat to mercator/);
+        assert.throws(function() { vtile.queryMany([139.6142578125,-90]); }, /could not reproject lon\/lat to mercator/);
+        vtile.queryMany(lonlats,{tolerance:0},function(err,results) {
+            if (err) throw err;
+            assert.deepEqual(results,sync);
+            done();
+        });
+    });
+
     it('should read back the vector tile and render an image with markers', function(done) {
         var vtile = new mapnik.VectorTile(0, 0, 0);
         vtile.setData(fs.readFileSync('./test/data/vector_tile/tile0.vector.pbf'));